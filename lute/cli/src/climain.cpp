@@ -34,9 +34,6 @@ static char** program_argv = nullptr;
 
 lua_State* setupState(lua_State* parent, Runtime& runtime, void (*doBeforeSandbox)(lua_State*))
 {
-    // Separate VM for data copies
-    runtime.dataCopy.reset(luaL_newstate());
-
     runtime.globalState.reset(luaL_newstate());
 
     lua_State* L = runtime.globalState.get();
@@ -20,9 +20,27 @@ int open(lua_State* L);
 /* Reads a file into a string. Takes a file handle obtained from openfile */
 int read(lua_State* L);
 
-/* Writes a string to a file without closing it*/
+/* Writes a string or buffer to a file without closing it*/
 int write(lua_State* L);
 
+/* Reads into a range of a buffer, optionally at a file position. Returns the number of bytes read */
+int readinto(lua_State* L);
+
+/* Reads up to a number of bytes at a file position into a new buffer */
+int pread(lua_State* L);
+
+/* Writes a buffer or string at a file position without moving the handle */
+int pwrite(lua_State* L);
+
+/* Writes a list of buffers and strings with a single vectored write */
+int writev(lua_State* L);
+
+/* Moves the position of a file handle */
+int seek(lua_State* L);
+
+/* Copies a range of one handle to another inside the kernel, without reading it into Luau */
+int sendfile(lua_State* L);
+
 /* takes a file handle into a string and then closes it */
 int close(lua_State* L);
 
@@ -34,6 +52,12 @@ int writestringtofile(lua_State* L);
 /* Reads a file without blocking */
 int readasync(lua_State* L);
 
+/* Writes a string to a file without blocking, replacing its contents */
+int writeasync(lua_State* L);
+
+/* Appends a string to a file without blocking */
+int appendasync(lua_State* L);
+
 /* Removes a file */
 int fs_remove(lua_State* L);
 
@@ -46,6 +70,9 @@ int fs_rmdir(lua_State* L);
 /* Gets the metadata of a file */
 int fs_stat(lua_State* L);
 
+/* Gets the metadata of a list of files, issuing all the stats at once. Missing files are reported as false */
+int statmany(lua_State* L);
+
 /* Checks if a file exists */
 int fs_exists(lua_State* L);
 
@@ -67,6 +94,21 @@ int fs_watch(lua_State* L);
 /* Lists the contents of a directory */
 int listdir(lua_State* L);
 
+/* Opens a buffered writer that flushes when full, on a timer and on close */
+int writer(lua_State* L);
+
+/* Returns an iterator over the lines of a file, read ahead in the background. Blocks the runtime thread when it catches up */
+int lines(lua_State* L);
+
+/* Returns an iterator over fixed-size chunks of a file, read ahead in the background. Blocks the runtime thread when it catches up */
+int chunks(lua_State* L);
+
+/* Returns an iterator over batches of the entries below a directory, scanned on the thread pool */
+int walk(lua_State* L);
+
+/* Maps a file into memory, returning a MappedFile with buffer-style accessors */
+int fs_mmap(lua_State* L);
+
 static const luaL_Reg lib[] = {
     /* Manual control apis - you are responsible for calling close / open*/
     {"open", open},
@@ -74,9 +116,18 @@ static const luaL_Reg lib[] = {
     {"write", write},
     {"close", close},
 
+    /* Positional and buffer based I/O on open handles */
+    {"readinto", readinto},
+    {"pread", pread},
+    {"pwrite", pwrite},
+    {"writev", writev},
+    {"seek", seek},
+    {"sendfile", sendfile},
+
     {"remove", fs_remove},
 
     {"stat", fs_stat},
+    {"statmany", statmany},
     {"exists", fs_exists},
     {"type", type},
 
@@ -87,11 +138,21 @@ static const luaL_Reg lib[] = {
 
     {"mkdir", fs_mkdir},
     {"listdir", listdir},
+    {"walk", walk},
     {"rmdir", fs_rmdir},
 
+    {"mmap", fs_mmap},
+    {"writer", writer},
+    {"lines", lines},
+    {"chunks", chunks},
+
     {"readfiletostring", readfiletostring},
     {"writestringtofile", writestringtofile},
     {"readasync", readasync},
+    {"writeasync", writeasync},
+    {"appendasync", appendasync},
+    // fs.copy already runs on the thread pool through uv_fs_copyfile
+    {"copyasync", fs_copy},
     {NULL, NULL},
 };
 
@@ -8,19 +8,34 @@
 #include "lute/time.h"
 #include "lute/userdatas.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
 #include <cstdio>
+#include <condition_variable>
 #include <cstring>
 #ifdef _WIN32
 #include <direct.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 #include <fcntl.h>
 #include <filesystem>
+#include <deque>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <sys/stat.h>
 #include <string>
 #include <stdlib.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 
 #if !defined(S_ISREG) && defined(S_IFMT) && defined(S_IFREG)
@@ -185,6 +200,169 @@ void createFileHandle(lua_State* L, const FileHandle& toCreate)
     setfield(L, "err", toCreate.errcode);
 }
 
+struct StatBatch;
+
+// A libuv fs request together with what is needed to finish it. Requests are recycled through a per-thread free list,
+// so the metadata calls below do not allocate a uv_fs_t and a resume token holder each time
+struct FsRequest
+{
+    uv_fs_t req;
+    ResumeToken token;
+    // Pushes the results of a finished request; runs on the thread that made the call
+    std::function<int(lua_State*, uv_fs_t*)> complete;
+    // When false a negative result raises the libuv error instead of calling complete
+    bool handlesErrors = false;
+    // Put in front of the libuv error message when set, e.g. to name the file that failed to open
+    std::string errorContext;
+
+    // Set for the requests of an fs.statmany batch
+    std::shared_ptr<StatBatch> batch;
+    size_t batchIndex = 0;
+
+    FsRequest* nextFree = nullptr;
+};
+
+static constexpr size_t kMaxPooledRequests = 256;
+
+static thread_local FsRequest* freeRequests = nullptr;
+static thread_local size_t freeRequestCount = 0;
+
+static FsRequest* acquireRequest()
+{
+    FsRequest* request = freeRequests;
+
+    if (request)
+    {
+        freeRequests = request->nextFree;
+        freeRequestCount--;
+        request->nextFree = nullptr;
+    }
+    else
+    {
+        request = new FsRequest();
+    }
+
+    memset(&request->req, 0, sizeof(request->req));
+    request->req.data = request;
+    return request;
+}
+
+static void releaseRequest(FsRequest* request)
+{
+    uv_fs_req_cleanup(&request->req);
+
+    request->token.reset();
+    request->complete = nullptr;
+    request->handlesErrors = false;
+    request->errorContext.clear();
+    request->batch.reset();
+    request->batchIndex = 0;
+
+    if (freeRequestCount >= kMaxPooledRequests)
+    {
+        delete request;
+        return;
+    }
+
+    request->nextFree = freeRequests;
+    freeRequests = request;
+    freeRequestCount++;
+}
+
+// Returns a request to the pool when the scope ends, including when complete raises an error
+struct RequestLease
+{
+    FsRequest* request;
+
+    ~RequestLease()
+    {
+        releaseRequest(request);
+    }
+};
+
+static std::string requestError(const FsRequest* request)
+{
+    const char* message = uv_strerror(static_cast<int>(request->req.result));
+
+    if (request->errorContext.empty())
+        return message;
+
+    return request->errorContext + ": " + message;
+}
+
+static int finishRequest(lua_State* L, FsRequest* request)
+{
+    RequestLease lease{request};
+
+    if (request->req.result < 0 && !request->handlesErrors)
+        luaL_errorL(L, "%s", requestError(request).c_str());
+
+    return request->complete(L, &request->req);
+}
+
+static void onFsRequestDone(uv_fs_t* req)
+{
+    FsRequest* request = static_cast<FsRequest*>(req->data);
+    ResumeToken token = std::move(request->token);
+
+    if (req->result < 0 && !request->handlesErrors)
+    {
+        std::string message = requestError(request);
+        releaseRequest(request);
+        token->fail(std::move(message));
+        return;
+    }
+
+    token->complete(
+        [request](lua_State* L)
+        {
+            return finishRequest(L, request);
+        }
+    );
+}
+
+// Runs a uv_fs_* call with a pooled request. `start` issues the call with the loop, request and callback it is given, and
+// `complete` pushes its results. When the calling thread can yield, the call runs on the libuv thread pool and the thread is
+// resumed once it is done; otherwise, e.g. inside a metamethod, it runs synchronously as a null callback call would.
+template<typename Start>
+static int runFsRequest(
+    lua_State* L,
+    Start start,
+    std::function<int(lua_State*, uv_fs_t*)> complete,
+    bool handlesErrors = false,
+    std::string errorContext = {}
+)
+{
+    FsRequest* request = acquireRequest();
+    request->complete = std::move(complete);
+    request->handlesErrors = handlesErrors;
+    request->errorContext = std::move(errorContext);
+
+    if (!lua_isyieldable(L))
+    {
+        start(&getRuntime(L)->loop, &request->req, nullptr);
+        return finishRequest(L, request);
+    }
+
+    request->token = getResumeToken(L);
+
+    int err = start(&getRuntime(L)->loop, &request->req, onFsRequestDone);
+
+    if (err < 0)
+    {
+        // the callback will not run, so report the error through the token like a failed request
+        request->req.result = err;
+        onFsRequestDone(&request->req);
+    }
+
+    return lua_yield(L, 0);
+}
+
+static int noResults(lua_State* L, uv_fs_t* req)
+{
+    return 0;
+}
+
 FileHandle unpackFileHandle(lua_State* L)
 {
     FileHandle result;
@@ -207,776 +385,3267 @@ int close(lua_State* L)
 {
     lua_settop(L, 1);
     FileHandle file = unpackFileHandle(L);
+    uv_file fd = static_cast<uv_file>(file.fileDescriptor);
 
-    uv_fs_t closeReq;
-    uv_fs_close(uv_default_loop(), &closeReq, file.fileDescriptor, nullptr);
-    return 0;
+    return runFsRequest(
+        L,
+        [fd](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_close(loop, req, fd, cb);
+        },
+        noResults
+    );
 }
 
-static char readBuffer[1024];
-int read(lua_State* L)
+// Luau strings are limited to 1 GiB
+static constexpr size_t kMaxReadSize = size_t(1) << 30;
+
+// Reads fd from its current position until EOF and pushes the contents as a string. The string is allocated once with the size
+// reported by fstat and read into directly, so a regular file costs one allocation and usually a single read.
+// Returns 0 on success or a libuv error code, in which case nothing is pushed.
+static int pushRemainingContents(lua_State* L, uv_file fd)
 {
-    memset(readBuffer, 0, sizeof(readBuffer));
-    // discard any extra arguments passed in
-    lua_settop(L, 1);
-    FileHandle file = unpackFileHandle(L);
+    size_t expected = 0;
 
-    int numBytesRead = 0;
-    uv_fs_t readReq;
-    uv_buf_t iov = uv_buf_init(readBuffer, sizeof(readBuffer));
-    // Output data
-    std::vector<char> resultData;
-    do
+    uv_fs_t statReq;
+    if (uv_fs_fstat(uv_default_loop(), &statReq, fd, nullptr) == 0 && S_ISREG(statReq.statbuf.st_mode))
+        expected = static_cast<size_t>(statReq.statbuf.st_size);
+    uv_fs_req_cleanup(&statReq);
+
+    if (expected > kMaxReadSize)
+        return UV_EFBIG;
+
+    luaL_Strbuf result;
+    luaL_buffinitsize(L, &result, expected);
+    size_t totalRead = 0;
+
+    for (;;)
     {
-        uv_fs_read(uv_default_loop(), &readReq, file.fileDescriptor, &iov, 1, -1, nullptr);
+        uv_fs_t readReq;
+        int numBytesRead = 0;
+
+        if (result.p < result.end)
+        {
+            uv_buf_t iov = uv_buf_init(result.p, static_cast<unsigned int>(result.end - result.p));
+            numBytesRead = uv_fs_read(uv_default_loop(), &readReq, fd, &iov, 1, -1, nullptr);
+            uv_fs_req_cleanup(&readReq);
 
-        numBytesRead = readReq.result;
+            if (numBytesRead > 0)
+                luaL_addsize(&result, numBytesRead);
+        }
+        else
+        {
+            // Past the size from fstat: either EOF, or a pipe / a file that grew. Probing into a scratch buffer keeps the
+            // exact-size string intact in the common case
+            char chunk[16 * 1024];
+            uv_buf_t iov = uv_buf_init(chunk, sizeof(chunk));
+            numBytesRead = uv_fs_read(uv_default_loop(), &readReq, fd, &iov, 1, -1, nullptr);
+            uv_fs_req_cleanup(&readReq);
+
+            if (numBytesRead > 0)
+            {
+                if (totalRead + numBytesRead > kMaxReadSize)
+                    numBytesRead = UV_EFBIG;
+                else
+                    luaL_addlstring(&result, chunk, numBytesRead);
+            }
+        }
 
         if (numBytesRead < 0)
         {
-            luaL_errorL(L, "Error reading: %s. Closing file.\n", uv_err_name(numBytesRead));
-            memset(readBuffer, 0, sizeof(readBuffer));
-            return 0;
+            // The string storage only occupies a stack slot once it outgrew the inline buffer
+            if (result.storage)
+                lua_pop(L, 1);
+
+            return numBytesRead;
         }
 
-        for (int i = 0; i < numBytesRead; i++)
-            resultData.push_back(readBuffer[i]);
+        if (numBytesRead == 0)
+            break;
+
+        totalRead += numBytesRead;
+    }
+
+    luaL_pushresult(&result);
+    return 0;
+}
 
-    } while (numBytesRead > 0);
+int read(lua_State* L)
+{
+    // discard any extra arguments passed in
+    lua_settop(L, 1);
+    FileHandle file = unpackFileHandle(L);
 
-    lua_pushlstring(L, resultData.data(), resultData.size());
+    int err = pushRemainingContents(L, file.fileDescriptor);
+    if (err < 0)
+        luaL_errorL(L, "Error reading: %s. Closing file.\n", uv_err_name(err));
 
-    // Clean up the scratch space
-    memset(readBuffer, 0, sizeof(readBuffer));
     return 1;
 }
 
-int write(lua_State* L)
+// Accepts either a buffer or a string as the source of a write, without copying it
+static const char* checkWriteSource(lua_State* L, int idx, size_t& size)
 {
-    char writeBuffer[4096];
+    if (lua_isbuffer(L, idx))
+        return static_cast<const char*>(lua_tobuffer(L, idx, &size));
 
-    // Reset the write buffer
-    int wbSize = sizeof(writeBuffer);
-    memset(writeBuffer, 0, sizeof(writeBuffer));
-    FileHandle file = unpackFileHandle(L);
-    size_t len;
-    const char* stringToWrite = luaL_checklstring(L, 2, &len);
+    if (lua_type(L, idx) != LUA_TSTRING)
+        luaL_typeerrorL(L, idx, "buffer or string");
+
+    return lua_tolstring(L, idx, &size);
+}
 
-    // Set up the buffer to write
-    int numBytesLeftToWrite = len;
-    int offset = 0;
-    do
+// Writes every byte described by bufs, continuing after short writes; the iovecs are adjusted in place.
+// Returns 0 on success or a libuv error code
+static int writeBuffers(uv_file fd, uv_buf_t* bufs, size_t count, int64_t position)
+{
+    for (;;)
     {
-        // copy stringToWrite[0], numBytesLeftToWrite into write buffer
+        // Skip what has been written, including empty pieces
+        while (count > 0 && bufs->len == 0)
+        {
+            bufs++;
+            count--;
+        }
 
-        int sizeToWrite = std::min(wbSize, numBytesLeftToWrite);
-        memcpy(writeBuffer, stringToWrite + offset, sizeToWrite);
-        uv_buf_t iov = uv_buf_init(writeBuffer, sizeToWrite);
+        if (count == 0)
+            return 0;
 
+        // The result is read from the request, as the int returned by uv_fs_write cannot hold every byte count
         uv_fs_t writeReq;
-        int bytesWritten = 0;
-        uv_fs_write(uv_default_loop(), &writeReq, file.fileDescriptor, &iov, 1, -1, nullptr);
-        bytesWritten = writeReq.result;
+        uv_fs_write(uv_default_loop(), &writeReq, fd, bufs, static_cast<unsigned int>(count), position, nullptr);
+        int64_t bytesWritten = writeReq.result;
+        uv_fs_req_cleanup(&writeReq);
 
         if (bytesWritten < 0)
-        {
-            // Error case.
-            luaL_errorHandle(L, file);
-            memset(writeBuffer, 0, sizeof(writeBuffer));
-            return 0;
-        }
+            return static_cast<int>(bytesWritten);
 
+        if (bytesWritten == 0)
+            return UV_EIO;
 
-        offset += bytesWritten;
-        numBytesLeftToWrite -= bytesWritten;
-    } while (numBytesLeftToWrite > 0);
+        if (position >= 0)
+            position += bytesWritten;
 
-    return 0;
-}
-// Returns 0 on error, 1 otherwise
-std::optional<FileHandle> openHelper(lua_State* L, const char* path, const char* mode, int* openFlags)
-{
-    std::optional<int> modeFlags = setFlags(mode, openFlags);
-    if (!modeFlags)
-        return std::nullopt;
+        size_t remaining = size_t(bytesWritten);
+        while (remaining > 0)
+        {
+            size_t consumed = std::min(remaining, size_t(bufs->len));
+            bufs->base += consumed;
+            bufs->len -= consumed;
+            remaining -= consumed;
 
-    uv_fs_t openReq;
-    int errcode = uv_fs_open(uv_default_loop(), &openReq, path, *openFlags, *modeFlags, nullptr);
-    if (openReq.result < 0)
-    {
-        luaL_errorL(L, "Error opening file %s\n", path);
-        return std::nullopt;
+            if (bufs->len == 0)
+            {
+                bufs++;
+                count--;
+            }
+        }
     }
-
-    return FileHandle{openReq.result, errcode};
 }
 
-int open(lua_State* L)
+int write(lua_State* L)
 {
-    int nArgs = lua_gettop(L);
-    const char* path = luaL_checkstring(L, 1);
-    int openFlags = 0x0000;
-    // When the number of arguments is less 2
-    if (nArgs < 1)
-    {
-        luaL_errorL(L, "Error: no file supplied\n");
-        return 0;
-    }
-
-    if (nArgs < 2)
-    {
-        openFlags = O_RDONLY;
-    }
+    FileHandle file = unpackFileHandle(L);
+    size_t len;
+    const char* data = checkWriteSource(L, 2, len);
 
-    const char* mode = luaL_checkstring(L, 2);
-    if (std::optional<FileHandle> result = openHelper(L, path, mode, &openFlags))
-    {
-        createFileHandle(L, *result);
-        return 1;
-    }
+    // Written straight from the source memory
+    uv_buf_t iov = uv_buf_init(const_cast<char*>(data), static_cast<unsigned int>(len));
+    if (writeBuffers(file.fileDescriptor, &iov, 1, -1) < 0)
+        luaL_errorHandle(L, file);
 
     return 0;
 }
 
-void cleanup(char* buffer, int size, const FileHandle& handle)
+// Reads the optional (offset, length) pair that selects a range of a buffer, defaulting to everything after offset.
+// Both are read as numbers, so sizes are not limited to the range of an int
+static void checkBufferRange(lua_State* L, int offsetArg, size_t size, size_t& offset, size_t& length)
 {
-    memset(buffer, 0, size);
-    uv_fs_t closeReq;
-    uv_fs_close(uv_default_loop(), &closeReq, handle.fileDescriptor, nullptr);
-}
+    double offsetValue = luaL_optnumber(L, offsetArg, 0);
+    if (!(offsetValue >= 0) || offsetValue != std::floor(offsetValue) || offsetValue > double(size))
+        luaL_errorL(L, "buffer offset out of bounds");
 
-int fs_remove(lua_State* L)
-{
-    uv_fs_t unlink_req;
-    int err = uv_fs_unlink(uv_default_loop(), &unlink_req, luaL_checkstring(L, 1), nullptr);
+    offset = static_cast<size_t>(offsetValue);
 
-    if (err)
-        luaL_errorL(L, "%s", uv_strerror(err));
+    double lengthValue = luaL_optnumber(L, offsetArg + 1, double(size - offset));
+    if (!(lengthValue >= 0) || lengthValue != std::floor(lengthValue) || lengthValue > double(size - offset))
+        luaL_errorL(L, "buffer length out of bounds");
 
-    return 0;
+    length = static_cast<size_t>(lengthValue);
 }
 
-int fs_mkdir(lua_State* L)
+// File positions are doubles so files beyond 2 GiB can be addressed; -1 means the current position of the handle
+static int64_t optFilePosition(lua_State* L, int idx)
 {
-    const char* path = luaL_checkstring(L, 1);
-    int mode = luaL_optinteger(L, 2, 0777);
-
-    uv_fs_t req;
-    int err = uv_fs_mkdir(uv_default_loop(), &req, path, mode, nullptr);
+    if (lua_isnoneornil(L, idx))
+        return -1;
 
-    if (err)
-        luaL_errorL(L, "%s", uv_strerror(err));
+    double position = luaL_checknumber(L, idx);
+    if (!(position >= 0) || position != std::floor(position))
+        luaL_errorL(L, "file position must be a non-negative integer");
 
-    return 0;
+    return static_cast<int64_t>(position);
 }
 
-int fs_rmdir(lua_State* L)
+int readinto(lua_State* L)
 {
-    const char* path = luaL_checkstring(L, 1);
-
-    uv_fs_t rmdir_req;
-    int err = uv_fs_rmdir(uv_default_loop(), &rmdir_req, path, nullptr);
+    FileHandle file = unpackFileHandle(L);
 
-    if (err)
-        luaL_errorL(L, "%s", uv_strerror(err));
+    size_t bufferSize = 0;
+    char* data = static_cast<char*>(luaL_checkbuffer(L, 2, &bufferSize));
 
-    return 0;
-}
+    size_t offset = 0;
+    size_t length = 0;
+    checkBufferRange(L, 3, bufferSize, offset, length);
 
-int fs_stat(lua_State* L)
-{
-    const char* path = luaL_checkstring(L, 1);
+    int64_t position = optFilePosition(L, 5);
 
-    uv_fs_t stat_req;
-    int err = uv_fs_stat(uv_default_loop(), &stat_req, path, nullptr);
+    uv_fs_t readReq;
+    uv_buf_t iov = uv_buf_init(data + offset, static_cast<unsigned int>(length));
+    uv_fs_read(uv_default_loop(), &readReq, file.fileDescriptor, &iov, 1, position, nullptr);
+    int64_t numBytesRead = readReq.result;
+    uv_fs_req_cleanup(&readReq);
 
-    if (err)
-        luaL_errorL(L, "%s", uv_strerror(err));
+    if (numBytesRead < 0)
+        luaL_errorL(L, "Error reading: %s", uv_strerror(static_cast<int>(numBytesRead)));
 
-    lua_createtable(L, 0, 6);
+    lua_pushnumber(L, static_cast<double>(numBytesRead));
+    return 1;
+}
 
-    auto stat = stat_req.statbuf;
+int pread(lua_State* L)
+{
+    FileHandle file = unpackFileHandle(L);
 
-    auto type = fileModeToType(stat.st_mode);
-    lua_pushstring(L, type);
-    lua_setfield(L, -2, "type");
+    double countValue = luaL_checknumber(L, 2);
+    if (!(countValue >= 0) || countValue != std::floor(countValue))
+        luaL_errorL(L, "count must be a non-negative integer");
+    if (countValue > double(kMaxReadSize))
+        luaL_errorL(L, "count cannot exceed %d bytes", int(kMaxReadSize));
 
-    // this is fine unless the file is 9 petabytes
-    lua_pushnumber(L, static_cast<double>(stat.st_size));
-    lua_setfield(L, -2, "size");
+    size_t count = static_cast<size_t>(countValue);
+    int64_t position = optFilePosition(L, 3);
 
-    createDurationFromTimespec32(L, stat.st_birthtim);
-    lua_setfield(L, -2, "created_at");
+    char* data = static_cast<char*>(lua_newbuffer(L, count));
 
-    createDurationFromTimespec32(L, stat.st_atim);
-    lua_setfield(L, -2, "accessed_at");
+    // Short reads are retried so the result only falls short of count at the end of the file
+    size_t total = 0;
+    while (total < count)
+    {
+        uv_fs_t readReq;
+        uv_buf_t iov = uv_buf_init(data + total, static_cast<unsigned int>(count - total));
+        uv_fs_read(uv_default_loop(), &readReq, file.fileDescriptor, &iov, 1, position, nullptr);
+        int64_t numBytesRead = readReq.result;
+        uv_fs_req_cleanup(&readReq);
 
-    createDurationFromTimespec32(L, stat.st_mtim);
-    lua_setfield(L, -2, "modified_at");
+        if (numBytesRead < 0)
+            luaL_errorL(L, "Error reading: %s", uv_strerror(static_cast<int>(numBytesRead)));
 
-    // permissions
-    lua_createtable(L, 0, 2);
+        if (numBytesRead == 0)
+            break;
 
-    // libuv writes this correctly cross-platform
-    bool canAnyWrite = stat.st_mode & 0222;
-    lua_pushboolean(L, !canAnyWrite);
-    lua_setfield(L, -2, "readonly");
+        total += size_t(numBytesRead);
+        if (position >= 0)
+            position += numBytesRead;
+    }
 
-    lua_setfield(L, -2, "permissions");
+    if (total < count)
+    {
+        void* truncated = lua_newbuffer(L, total);
+        memcpy(truncated, data, total);
+    }
 
     return 1;
 }
 
-static void defaultCallback(uv_fs_t* req)
+int pwrite(lua_State* L)
 {
-    auto* request_state = static_cast<ResumeToken*>(req->data);
+    FileHandle file = unpackFileHandle(L);
 
-    if (req->result)
-    {
-        request_state->get()->fail(uv_strerror(req->result));
-        uv_fs_req_cleanup(req);
-        delete req;
-        return;
-    }
+    size_t size = 0;
+    const char* data = checkWriteSource(L, 2, size);
 
-    request_state->get()->complete(
-        [req](lua_State* L)
-        {
-            uv_fs_req_cleanup(req);
+    int64_t position = optFilePosition(L, 3);
 
-            delete req;
+    size_t offset = 0;
+    size_t length = 0;
+    checkBufferRange(L, 4, size, offset, length);
 
-            return 0;
-        }
-    );
+    uv_buf_t iov = uv_buf_init(const_cast<char*>(data + offset), static_cast<unsigned int>(length));
+    int err = writeBuffers(file.fileDescriptor, &iov, 1, position);
+    if (err < 0)
+        luaL_errorL(L, "Error writing: %s", uv_strerror(err));
+
+    lua_pushnumber(L, static_cast<double>(length));
+    return 1;
 }
 
-int fs_copy(lua_State* L)
+int writev(lua_State* L)
 {
-    const char* path = luaL_checkstring(L, 1);
-    const char* dest = luaL_checkstring(L, 2);
+    FileHandle file = unpackFileHandle(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int64_t position = optFilePosition(L, 3);
 
-    auto* req = new uv_fs_t();
-    req->data = new ResumeToken(getResumeToken(L));
+    int pieces = lua_objlen(L, 2);
 
-    int err = uv_fs_copyfile(uv_default_loop(), req, path, dest, 0, defaultCallback);
+    // The pieces stay referenced by the table, so the iovecs can point straight into them
+    std::vector<uv_buf_t> bufs;
+    bufs.reserve(pieces);
 
-    if (err)
+    size_t total = 0;
+    for (int i = 1; i <= pieces; i++)
     {
-        luaL_errorL(L, "%s", uv_strerror(err));
+        lua_rawgeti(L, 2, i);
+
+        size_t size = 0;
+        const char* data = checkWriteSource(L, -1, size);
+        bufs.push_back(uv_buf_init(const_cast<char*>(data), static_cast<unsigned int>(size)));
+        total += size;
+
+        lua_pop(L, 1);
     }
 
-    return lua_yield(L, 0);
+    int err = writeBuffers(file.fileDescriptor, bufs.data(), bufs.size(), position);
+    if (err < 0)
+        luaL_errorL(L, "Error writing: %s", uv_strerror(err));
+
+    lua_pushnumber(L, static_cast<double>(total));
+    return 1;
 }
 
-int fs_link(lua_State* L)
+int seek(lua_State* L)
 {
-    const char* path = luaL_checkstring(L, 1);
-    const char* dest = luaL_checkstring(L, 2);
+    FileHandle file = unpackFileHandle(L);
 
-    auto* req = new uv_fs_t();
-    req->data = new ResumeToken(getResumeToken(L));
+    double offset = luaL_checknumber(L, 2);
+    if (offset != std::floor(offset))
+        luaL_errorL(L, "offset must be an integer");
 
-    int err = uv_fs_link(uv_default_loop(), req, path, dest, defaultCallback);
+    const char* whence = luaL_optstring(L, 3, "set");
 
-    if (err)
-    {
-        luaL_errorL(L, "%s", uv_strerror(err));
-    }
+    int origin = SEEK_SET;
+    if (strcmp(whence, "cur") == 0)
+        origin = SEEK_CUR;
+    else if (strcmp(whence, "end") == 0)
+        origin = SEEK_END;
+    else if (strcmp(whence, "set") != 0)
+        luaL_errorL(L, "whence must be 'set', 'cur' or 'end'");
 
-    return lua_yield(L, 0);
+#ifdef _WIN32
+    int64_t position = _lseeki64(int(file.fileDescriptor), static_cast<int64_t>(offset), origin);
+#else
+    int64_t position = lseek(int(file.fileDescriptor), static_cast<off_t>(offset), origin);
+#endif
+
+    if (position < 0)
+        luaL_errorL(L, "Error seeking: %s", strerror(errno));
+
+    lua_pushnumber(L, static_cast<double>(position));
+    return 1;
 }
 
-int fs_symlink(lua_State* L)
+// Reads the descriptor of the handle table at idx, unlike unpackFileHandle it works for any argument
+static uv_file checkFileDescriptor(lua_State* L, int idx)
 {
-    const char* path = luaL_checkstring(L, 1);
-    const char* dest = luaL_checkstring(L, 2);
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_getfield(L, idx, "fd");
+    uv_file fd = static_cast<uv_file>(luaL_checkinteger(L, -1));
+    lua_pop(L, 1);
 
-    auto* req = new uv_fs_t();
-    req->data = new ResumeToken(getResumeToken(L));
+    return fd;
+}
 
-    if (std::filesystem::is_directory(path))
-    {
-        req->flags = UV_FS_SYMLINK_DIR; // windows
-    }
-    else
+// sendfile and copy_file_range move at most 0x7ffff000 bytes (a little under 2 GiB) per call on Linux
+static constexpr size_t kMaxSendChunk = 0x7ffff000;
+
+// Moves length bytes (or everything up to EOF when negative) of in, starting at offset, to out without copying them through
+// userspace; libuv uses copy_file_range between files and sendfile otherwise. Loops over short transfers.
+// Returns the number of bytes sent or a libuv error code
+static int64_t sendFileRange(uv_file out, uv_file in, int64_t offset, int64_t length)
+{
+    uv_fs_t req;
+
+    if (length < 0 && uv_fs_fstat(uv_default_loop(), &req, in, nullptr) == 0 && S_ISREG(req.statbuf.st_mode))
+        length = std::max(int64_t(0), static_cast<int64_t>(req.statbuf.st_size) - offset);
+    uv_fs_req_cleanup(&req);
+
+    int64_t sent = 0;
+    while (length < 0 || sent < length)
     {
-        req->flags = 0;
+        size_t chunk = length < 0 ? kMaxSendChunk : static_cast<size_t>(std::min<int64_t>(length - sent, kMaxSendChunk));
+
+        int result = uv_fs_sendfile(uv_default_loop(), &req, out, in, offset + sent, chunk, nullptr);
+        uv_fs_req_cleanup(&req);
+
+        if (result < 0)
+            return result;
+
+        if (result == 0)
+            break;
+
+        sent += result;
     }
 
-    int err = uv_fs_symlink(uv_default_loop(), req, path, dest, req->flags, defaultCallback);
+    return sent;
+}
+
+int sendfile(lua_State* L)
+{
+    uv_file in = checkFileDescriptor(L, 1);
+    uv_file out = checkFileDescriptor(L, 2);
+
+    int64_t offset = optFilePosition(L, 3);
+    if (offset < 0)
+        offset = 0;
 
-    if (err)
+    int64_t length = -1;
+    if (!lua_isnoneornil(L, 4))
     {
-        luaL_errorL(L, "%s", uv_strerror(err));
+        double requested = luaL_checknumber(L, 4);
+        if (!(requested >= 0) || requested != std::floor(requested))
+            luaL_errorL(L, "length must be a non-negative integer");
+
+        length = static_cast<int64_t>(requested);
+    }
+
+    if (!lua_isyieldable(L))
+    {
+        int64_t sent = sendFileRange(out, in, offset, length);
+        if (sent < 0)
+            luaL_errorL(L, "Error sending file: %s", uv_strerror(static_cast<int>(sent)));
+
+        lua_pushnumber(L, static_cast<double>(sent));
+        return 1;
     }
 
+    ResumeToken token = getResumeToken(L);
+
+    token->runtime->runInWorkQueue(
+        [token, out, in, offset, length]
+        {
+            int64_t sent = sendFileRange(out, in, offset, length);
+
+            if (sent < 0)
+            {
+                token->fail(std::string("Error sending file: ") + uv_strerror(static_cast<int>(sent)));
+                return;
+            }
+
+            token->complete(
+                [sent](lua_State* L)
+                {
+                    lua_pushnumber(L, static_cast<double>(sent));
+                    return 1;
+                }
+            );
+        }
+    );
+
     return lua_yield(L, 0);
 }
 
-struct WatchHandle
+// Returns 0 on error, 1 otherwise
+std::optional<FileHandle> openHelper(lua_State* L, const char* path, const char* mode, int* openFlags)
 {
-    lua_State* L;
-    std::shared_ptr<Ref> callbackReference;
-    bool isClosed = false;
-    uv_fs_event_t handle;
+    std::optional<int> modeFlags = setFlags(mode, openFlags);
+    if (!modeFlags)
+        return std::nullopt;
 
-    void close()
+    uv_fs_t openReq;
+    int errcode = uv_fs_open(uv_default_loop(), &openReq, path, *openFlags, *modeFlags, nullptr);
+    if (openReq.result < 0)
+    {
+        luaL_errorL(L, "Error opening file %s\n", path);
+        return std::nullopt;
+    }
+
+    return FileHandle{openReq.result, errcode};
+}
+
+int open(lua_State* L)
+{
+    int nArgs = lua_gettop(L);
+    const char* path = luaL_checkstring(L, 1);
+    int openFlags = 0x0000;
+    // When the number of arguments is less 2
+    if (nArgs < 1)
+    {
+        luaL_errorL(L, "Error: no file supplied\n");
+        return 0;
+    }
+
+    if (nArgs < 2)
+    {
+        openFlags = O_RDONLY;
+    }
+
+    const char* mode = luaL_checkstring(L, 2);
+    std::optional<int> modeFlags = setFlags(mode, &openFlags);
+    if (!modeFlags)
+        return 0;
+
+    return runFsRequest(
+        L,
+        [path, openFlags, modeFlags](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_open(loop, req, path, openFlags, *modeFlags, cb);
+        },
+        [](lua_State* L, uv_fs_t* req)
+        {
+            createFileHandle(L, FileHandle{req->result, 0});
+            return 1;
+        },
+        /* handlesErrors */ false,
+        std::string("Error opening file ") + path
+    );
+}
+
+int fs_remove(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    return runFsRequest(
+        L,
+        [path](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_unlink(loop, req, path, cb);
+        },
+        noResults
+    );
+}
+
+int fs_mkdir(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+    int mode = luaL_optinteger(L, 2, 0777);
+
+    return runFsRequest(
+        L,
+        [path, mode](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_mkdir(loop, req, path, mode, cb);
+        },
+        noResults
+    );
+}
+
+int fs_rmdir(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    return runFsRequest(
+        L,
+        [path](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_rmdir(loop, req, path, cb);
+        },
+        noResults
+    );
+}
+
+static void pushFileMetadata(lua_State* L, const uv_stat_t& stat)
+{
+    lua_createtable(L, 0, 6);
+
+    auto type = fileModeToType(stat.st_mode);
+    lua_pushstring(L, type);
+    lua_setfield(L, -2, "type");
+
+    // this is fine unless the file is 9 petabytes
+    lua_pushnumber(L, static_cast<double>(stat.st_size));
+    lua_setfield(L, -2, "size");
+
+    createDurationFromTimespec32(L, stat.st_birthtim);
+    lua_setfield(L, -2, "created_at");
+
+    createDurationFromTimespec32(L, stat.st_atim);
+    lua_setfield(L, -2, "accessed_at");
+
+    createDurationFromTimespec32(L, stat.st_mtim);
+    lua_setfield(L, -2, "modified_at");
+
+    // permissions
+    lua_createtable(L, 0, 2);
+
+    // libuv writes this correctly cross-platform
+    bool canAnyWrite = stat.st_mode & 0222;
+    lua_pushboolean(L, !canAnyWrite);
+    lua_setfield(L, -2, "readonly");
+
+    lua_setfield(L, -2, "permissions");
+}
+
+int fs_stat(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    return runFsRequest(
+        L,
+        [path](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_stat(loop, req, path, cb);
+        },
+        [](lua_State* L, uv_fs_t* req)
+        {
+            pushFileMetadata(L, req->statbuf);
+            return 1;
+        }
+    );
+}
+
+// The stats of one fs.statmany call; every request of the batch finishes on the loop thread, so no locking is needed
+struct StatBatch
+{
+    ResumeToken token;
+    std::vector<uv_stat_t> stats;
+    std::vector<bool> found;
+    size_t remaining = 0;
+};
+
+static int pushStatBatch(lua_State* L, const StatBatch& batch)
+{
+    lua_createtable(L, static_cast<int>(batch.stats.size()), 0);
+
+    for (size_t i = 0; i < batch.stats.size(); i++)
+    {
+        if (batch.found[i])
+            pushFileMetadata(L, batch.stats[i]);
+        else
+            lua_pushboolean(L, false);
+
+        lua_rawseti(L, -2, static_cast<int>(i + 1));
+    }
+
+    return 1;
+}
+
+static void finishStatBatchEntry(const std::shared_ptr<StatBatch>& batch)
+{
+    if (--batch->remaining != 0)
+        return;
+
+    batch->token->complete(
+        [batch](lua_State* L)
+        {
+            return pushStatBatch(L, *batch);
+        }
+    );
+}
+
+static void onBatchStatDone(uv_fs_t* req)
+{
+    FsRequest* request = static_cast<FsRequest*>(req->data);
+    std::shared_ptr<StatBatch> batch = std::move(request->batch);
+
+    if (req->result >= 0)
+    {
+        batch->stats[request->batchIndex] = req->statbuf;
+        batch->found[request->batchIndex] = true;
+    }
+
+    releaseRequest(request);
+    finishStatBatchEntry(batch);
+}
+
+int statmany(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    int count = lua_objlen(L, 1);
+
+    std::vector<std::string> paths;
+    paths.reserve(count);
+
+    for (int i = 1; i <= count; i++)
+    {
+        lua_rawgeti(L, 1, i);
+        const char* path = lua_tostring(L, -1);
+        if (!path)
+            luaL_errorL(L, "statmany expects a list of paths, got %s at index %d", luaL_typename(L, -1), i);
+
+        paths.emplace_back(path);
+        lua_pop(L, 1);
+    }
+
+    auto batch = std::make_shared<StatBatch>();
+    batch->stats.resize(paths.size());
+    batch->found.resize(paths.size());
+
+    if (!lua_isyieldable(L) || paths.empty())
     {
-        if (!isClosed)
+        for (size_t i = 0; i < paths.size(); i++)
         {
-            int err = uv_fs_event_stop(&handle);
-            if (err)
+            uv_fs_t req;
+            if (uv_fs_stat(uv_default_loop(), &req, paths[i].c_str(), nullptr) >= 0)
             {
-                luaL_errorL(L, "Error stopping fs event: %s", uv_strerror(err));
+                batch->stats[i] = req.statbuf;
+                batch->found[i] = true;
             }
 
-            isClosed = true;
+            uv_fs_req_cleanup(&req);
+        }
 
-            getRuntime(L)->releasePendingToken();
+        return pushStatBatch(L, *batch);
+    }
+
+    batch->token = getResumeToken(L);
+    // one extra count for issuing, so the batch cannot finish before every request has been started
+    batch->remaining = paths.size() + 1;
+
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        FsRequest* request = acquireRequest();
+        request->batch = batch;
+        request->batchIndex = i;
 
-            callbackReference.reset();
+        if (uv_fs_stat(&getRuntime(L)->loop, &request->req, paths[i].c_str(), onBatchStatDone) < 0)
+        {
+            releaseRequest(request);
+            finishStatBatchEntry(batch);
         }
     }
 
-    ~WatchHandle()
+    finishStatBatchEntry(batch);
+
+    return lua_yield(L, 0);
+}
+
+int fs_copy(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+    const char* dest = luaL_checkstring(L, 2);
+
+    // By default copies share extents (reflink) where the file system supports it. Otherwise, or with clone = "never", libuv
+    // copies in the kernel with copy_file_range or sendfile
+    int flags = UV_FS_COPYFILE_FICLONE;
+
+    if (!lua_isnoneornil(L, 3))
     {
-        close();
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "clone");
+        if (!lua_isnil(L, -1))
+        {
+            const char* clone = luaL_checkstring(L, -1);
+
+            if (strcmp(clone, "auto") == 0)
+                flags = UV_FS_COPYFILE_FICLONE;
+            else if (strcmp(clone, "always") == 0)
+                flags = UV_FS_COPYFILE_FICLONE_FORCE;
+            else if (strcmp(clone, "never") == 0)
+                flags = 0;
+            else
+                luaL_errorL(L, "invalid clone mode '%s', expected 'auto', 'always' or 'never'", clone);
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 3, "overwrite");
+        if (!lua_isnil(L, -1) && !lua_toboolean(L, -1))
+            flags |= UV_FS_COPYFILE_EXCL;
+        lua_pop(L, 1);
     }
+
+    return runFsRequest(
+        L,
+        [path, dest, flags](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_copyfile(loop, req, path, dest, flags, cb);
+        },
+        noResults
+    );
+}
+
+int fs_link(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+    const char* dest = luaL_checkstring(L, 2);
+
+    return runFsRequest(
+        L,
+        [path, dest](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_link(loop, req, path, dest, cb);
+        },
+        noResults
+    );
+}
+
+int fs_symlink(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+    const char* dest = luaL_checkstring(L, 2);
+
+    int flags = std::filesystem::is_directory(path) ? UV_FS_SYMLINK_DIR : 0; // windows
+
+    return runFsRequest(
+        L,
+        [path, dest, flags](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_symlink(loop, req, path, dest, flags, cb);
+        },
+        noResults
+    );
+}
+
+struct WatchHandle;
+
+// A watched directory below the root of a recursive watch, for platforms where libuv cannot watch recursively
+struct WatchDirectory
+{
+    WatchHandle* owner = nullptr;
+    // Path of the directory relative to the watched root
+    std::string prefix;
+    uv_fs_event_t handle;
 };
 
-static int closeWatchHandle(lua_State* L)
+struct WatchHandle
+{
+    lua_State* L;
+    std::shared_ptr<Ref> callbackReference;
+    bool isClosed = false;
+    // Only set once the watch has started, a watch that failed to start never kept the runtime alive
+    bool holdsToken = false;
+    // Heap-owned like the directory watches, libuv still holds it after the userdata is collected until the close completes
+    uv_fs_event_t* handle = nullptr;
+
+    std::string rootPath;
+    // Set where libuv cannot watch recursively, so each directory below the root has its own entry in directories
+    bool watchEachDirectory = false;
+    // With debouncing, events are coalesced per path for debounceMs and then delivered together
+    bool debounced = false;
+    bool batch = false;
+    uint64_t debounceMs = 0;
+    uv_timer_t* timer = nullptr;
+    std::map<std::string, int> pendingEvents;
+    std::map<std::string, WatchDirectory*> directories;
+
+    // Safe to call on a watch that only got partway through fs_watch; never raises since it also runs from the finalizer,
+    // the error from stopping the root watch is returned instead
+    int close()
+    {
+        if (isClosed)
+            return 0;
+
+        isClosed = true;
+
+        int err = 0;
+
+        if (handle)
+        {
+            err = uv_fs_event_stop(handle);
+
+            handle->data = nullptr;
+            uv_close(
+                reinterpret_cast<uv_handle_t*>(handle),
+                [](uv_handle_t* handle)
+                {
+                    delete reinterpret_cast<uv_fs_event_t*>(handle);
+                }
+            );
+            handle = nullptr;
+        }
+
+        for (auto& [prefix, directory] : directories)
+        {
+            uv_fs_event_stop(&directory->handle);
+            uv_close(
+                reinterpret_cast<uv_handle_t*>(&directory->handle),
+                [](uv_handle_t* handle)
+                {
+                    delete static_cast<WatchDirectory*>(handle->data);
+                }
+            );
+        }
+        directories.clear();
+
+        if (timer)
+        {
+            uv_timer_stop(timer);
+            uv_close(
+                reinterpret_cast<uv_handle_t*>(timer),
+                [](uv_handle_t* handle)
+                {
+                    delete reinterpret_cast<uv_timer_t*>(handle);
+                }
+            );
+            timer = nullptr;
+        }
+
+        pendingEvents.clear();
+
+        if (holdsToken)
+        {
+            holdsToken = false;
+            getRuntime(L)->releasePendingToken();
+        }
+
+        callbackReference.reset();
+
+        return err;
+    }
+
+    ~WatchHandle()
+    {
+        close();
+    }
+};
+
+static int closeWatchHandle(lua_State* L)
 {
     luaL_checktype(L, 1, LUA_TUSERDATA);
     auto* handle = static_cast<WatchHandle*>(lua_touserdatatagged(L, 1, kWatchHandleTag));
 
-    if (!handle)
-    {
-        luaL_errorL(L, "Invalid fs event handle");
-        return 0;
-    }
+    if (!handle)
+    {
+        luaL_errorL(L, "Invalid fs event handle");
+        return 0;
+    }
+
+    int err = handle->close();
+    if (err)
+    {
+        luaL_errorL(L, "Error stopping fs event: %s", uv_strerror(err));
+    }
+
+    return 0;
+}
+
+static void pushWatchEvent(lua_State* L, int events)
+{
+    lua_createtable(L, 0, 2);
+
+    lua_pushboolean(L, (events & UV_RENAME) == UV_RENAME);
+    lua_setfield(L, -2, "rename");
+
+    lua_pushboolean(L, (events & UV_CHANGE) == UV_CHANGE);
+    lua_setfield(L, -2, "change");
+}
+
+// Runs the watch callback on a fresh thread with the arguments pushed by pushArgs
+static void scheduleWatchCallback(WatchHandle* watch, std::function<int(lua_State*)> pushArgs)
+{
+    lua_State* newThread = lua_newthread(watch->L);
+    std::shared_ptr<Ref> ref = getRefForThread(newThread);
+    lua_pop(watch->L, 1);
+
+    Runtime* runtime = getRuntime(newThread);
+
+    runtime->scheduleLuauResume(
+        ref,
+        [callbackReference = watch->callbackReference, pushArgs = std::move(pushArgs)](lua_State* L)
+        {
+            // the function to the back of the stack, omit from nret
+            callbackReference->push(L);
+
+            return pushArgs(L);
+        }
+    );
+}
+
+static void flushWatchEvents(WatchHandle* watch)
+{
+    std::map<std::string, int> events = std::move(watch->pendingEvents);
+    watch->pendingEvents.clear();
+
+    if (events.empty())
+        return;
+
+    if (watch->batch)
+    {
+        scheduleWatchCallback(
+            watch,
+            [events = std::move(events)](lua_State* L)
+            {
+                lua_createtable(L, int(events.size()), 0);
+
+                int index = 0;
+                for (const auto& [filename, flags] : events)
+                {
+                    pushWatchEvent(L, flags);
+
+                    lua_pushlstring(L, filename.data(), filename.size());
+                    lua_setfield(L, -2, "filename");
+
+                    lua_rawseti(L, -2, ++index);
+                }
+
+                return 1;
+            }
+        );
+    }
+    else
+    {
+        for (const auto& [filename, flags] : events)
+        {
+            scheduleWatchCallback(
+                watch,
+                [filename, flags = flags](lua_State* L)
+                {
+                    lua_pushlstring(L, filename.data(), filename.size());
+                    pushWatchEvent(L, flags);
+                    return 2;
+                }
+            );
+        }
+    }
+}
+
+static void onDirectoryWatchEvent(uv_fs_event_t* handle, const char* filenamePtr, int events, int status);
+
+// Starts watching a directory below the root of a recursive watch, and everything below it
+static void watchDirectory(WatchHandle* watch, const std::string& prefix)
+{
+    if (watch->directories.count(prefix))
+        return;
+
+    auto* directory = new WatchDirectory();
+    directory->owner = watch;
+    directory->prefix = prefix;
+    directory->handle.data = directory;
+
+    std::string path = watch->rootPath + "/" + prefix;
+
+    if (uv_fs_event_init(watch->handle->loop, &directory->handle) != 0 ||
+        uv_fs_event_start(&directory->handle, onDirectoryWatchEvent, path.c_str(), 0) != 0)
+    {
+        uv_close(
+            reinterpret_cast<uv_handle_t*>(&directory->handle),
+            [](uv_handle_t* handle)
+            {
+                delete static_cast<WatchDirectory*>(handle->data);
+            }
+        );
+        return;
+    }
+
+    watch->directories[prefix] = directory;
+
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(path, ec))
+    {
+        if (entry.is_directory(ec) && !entry.is_symlink(ec))
+            watchDirectory(watch, prefix + "/" + entry.path().filename().string());
+    }
+}
+
+static void unwatchDirectory(WatchHandle* watch, const std::string& prefix)
+{
+    auto it = watch->directories.lower_bound(prefix);
+    while (it != watch->directories.end() && (it->first == prefix || it->first.rfind(prefix + "/", 0) == 0))
+    {
+        uv_fs_event_stop(&it->second->handle);
+        uv_close(
+            reinterpret_cast<uv_handle_t*>(&it->second->handle),
+            [](uv_handle_t* handle)
+            {
+                delete static_cast<WatchDirectory*>(handle->data);
+            }
+        );
+        it = watch->directories.erase(it);
+    }
+}
+
+static void handleWatchEvent(WatchHandle* watch, uv_loop_t* loop, std::string filename, int events)
+{
+    if (watch->isClosed)
+        return;
+
+    // Directories created or removed below a recursive watch gain or lose their own watch
+    if (watch->watchEachDirectory && (events & UV_RENAME) == UV_RENAME && !filename.empty())
+    {
+        std::error_code ec;
+        std::filesystem::path path = std::filesystem::path(watch->rootPath) / filename;
+
+        if (std::filesystem::is_directory(path, ec) && !std::filesystem::is_symlink(path, ec))
+            watchDirectory(watch, filename);
+        else
+            unwatchDirectory(watch, filename);
+    }
+
+    if (!watch->debounced)
+    {
+        scheduleWatchCallback(
+            watch,
+            [filename = std::move(filename), events](lua_State* L)
+            {
+                lua_pushstring(L, filename.c_str());
+                pushWatchEvent(L, events);
+                return 2;
+            }
+        );
+
+        uv_stop(loop);
+        return;
+    }
+
+    watch->pendingEvents[filename] |= events;
+
+    // The window starts with the first event, so a steady stream of events is still delivered every debounceMs
+    if (!uv_is_active(reinterpret_cast<uv_handle_t*>(watch->timer)))
+    {
+        uv_timer_start(
+            watch->timer,
+            [](uv_timer_t* timer)
+            {
+                auto* watch = static_cast<WatchHandle*>(timer->data);
+                flushWatchEvents(watch);
+                uv_stop(timer->loop);
+            },
+            watch->debounceMs,
+            0
+        );
+    }
+}
+
+static void onRootWatchEvent(uv_fs_event_t* handle, const char* filenamePtr, int events, int status)
+{
+    handleWatchEvent(static_cast<WatchHandle*>(handle->data), handle->loop, filenamePtr ? filenamePtr : "", events);
+}
+
+static void onDirectoryWatchEvent(uv_fs_event_t* handle, const char* filenamePtr, int events, int status)
+{
+    auto* directory = static_cast<WatchDirectory*>(handle->data);
+
+    // Report paths relative to the watched root
+    std::string filename = directory->prefix;
+    if (filenamePtr && *filenamePtr)
+        filename += std::string("/") + filenamePtr;
+
+    handleWatchEvent(directory->owner, handle->loop, std::move(filename), events);
+}
+
+int fs_watch(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    bool recursive = false;
+    bool batch = false;
+    double debounce = 0.0;
+
+    if (!lua_isnoneornil(L, 3))
+    {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "recursive");
+        recursive = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 3, "batch");
+        batch = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 3, "debounce");
+        if (lua_isnumber(L, -1))
+            debounce = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        if (debounce < 0)
+            luaL_errorL(L, "debounce cannot be negative");
+    }
+
+    auto* event = new (static_cast<WatchHandle*>(lua_newuserdatataggedwithmetatable(L, sizeof(WatchHandle), kWatchHandleTag))) WatchHandle{};
+
+    event->L = L;
+    event->callbackReference = std::make_shared<Ref>(L, 2);
+    event->handle = new uv_fs_event_t();
+    event->handle->data = event;
+    event->rootPath = path;
+    event->batch = batch;
+    event->debounced = batch || debounce > 0;
+    event->debounceMs = static_cast<uint64_t>(debounce);
+
+    int init_err = uv_fs_event_init(&getRuntime(L)->loop, event->handle);
+
+    if (init_err)
+    {
+        // An uninitialized handle was never registered with the loop, so it can be freed without closing it
+        delete event->handle;
+        event->handle = nullptr;
+        event->close();
+        luaL_errorL(L, "%s", uv_strerror(init_err));
+    }
+
+    if (event->debounced)
+    {
+        event->timer = new uv_timer_t();
+        uv_timer_init(&getRuntime(L)->loop, event->timer);
+        event->timer->data = event;
+    }
+
+    // libuv only watches recursively on macOS and Windows; elsewhere every directory below the root gets its own watch
+#if defined(_WIN32) || defined(__APPLE__)
+    unsigned int flags = recursive ? UV_FS_EVENT_RECURSIVE : 0;
+#else
+    unsigned int flags = 0;
+    event->watchEachDirectory = recursive;
+#endif
+
+    int event_start_err = uv_fs_event_start(event->handle, onRootWatchEvent, path, flags);
+
+    if (event_start_err)
+    {
+        event->close();
+        luaL_errorL(L, "%s", uv_strerror(event_start_err));
+    }
+
+    if (event->watchEachDirectory)
+    {
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(path, ec))
+        {
+            if (entry.is_directory(ec) && !entry.is_symlink(ec))
+                watchDirectory(event, entry.path().filename().string());
+        }
+    }
+
+    getRuntime(L)->addPendingToken();
+    event->holdsToken = true;
+
+    return 1; // return the watch handle
+}
+
+int fs_exists(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    return runFsRequest(
+        L,
+        [path](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_stat(loop, req, path, cb);
+        },
+        [](lua_State* L, uv_fs_t* req)
+        {
+            lua_pushboolean(L, req->result != UV_ENOENT);
+            return 1;
+        },
+        /* handlesErrors */ true
+    );
+}
+
+int type(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    return runFsRequest(
+        L,
+        [path](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_stat(loop, req, path, cb);
+        },
+        [](lua_State* L, uv_fs_t* req)
+        {
+            lua_pushstring(L, fileModeToType(req->statbuf.st_mode));
+            return 1;
+        }
+    );
+}
+
+int listdir(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    return runFsRequest(
+        L,
+        [path](uv_loop_t* loop, uv_fs_t* req, uv_fs_cb cb)
+        {
+            return uv_fs_scandir(loop, req, path, 0, cb);
+        },
+        [](lua_State* L, uv_fs_t* req)
+        {
+            lua_createtable(L, 1, 0);
+
+            uv_dirent_t dir;
+            int i = 0;
+            int err = 0;
+            while ((err = uv_fs_scandir_next(req, &dir)) >= 0)
+            {
+                lua_pushinteger(L, ++i);
+
+                lua_createtable(L, 0, 2);
+
+                lua_pushstring(L, dir.name);
+                lua_setfield(L, -2, "name");
+
+                lua_pushstring(L, UV_DIRENT_TYPES[dir.type]);
+                lua_setfield(L, -2, "type");
+
+                lua_settable(L, -3);
+            }
+
+            if (err != UV_EOF)
+                luaL_errorL(L, "%s", uv_strerror(err));
+
+            return 1;
+        }
+    );
+}
+
+int readfiletostring(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+    const char openMode[] = "r";
+    int openFlags = 0x0000;
+    std::optional<FileHandle> handle = openHelper(L, path, openMode, &openFlags);
+    if (!handle)
+    {
+        luaL_errorL(L, "Error opening file for reading at %s\n", path);
+        return 0;
+    }
+
+    // discard any extra arguments passed in
+    lua_settop(L, 1);
+
+    int err = pushRemainingContents(L, handle->fileDescriptor);
+
+    uv_fs_t closeReq;
+    uv_fs_close(uv_default_loop(), &closeReq, handle->fileDescriptor, nullptr);
+
+    if (err < 0)
+        luaL_errorL(L, "Error reading: %s. Closing file.\n", uv_err_name(err));
+
+    return 1;
+}
+
+int writestringtofile(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+    const char openMode[] = "w+";
+    int openFlags = 0x0000;
+    std::optional<FileHandle> handle = openHelper(L, path, openMode, &openFlags);
+    if (!handle)
+    {
+        luaL_errorL(L, "Error opening file for reading at %s\n", path);
+        return 0;
+    }
+
+    size_t len;
+    const char* data = checkWriteSource(L, 2, len);
+
+    // Written straight from the source memory
+    uv_buf_t iov = uv_buf_init(const_cast<char*>(data), static_cast<unsigned int>(len));
+    int err = writeBuffers(handle->fileDescriptor, &iov, 1, -1);
+
+    uv_fs_t closeReq;
+    uv_fs_close(uv_default_loop(), &closeReq, handle->fileDescriptor, nullptr);
+
+    if (err < 0)
+        luaL_errorHandle(L, *handle);
+
+    return 0;
+}
+
+// Reads a whole file without touching the VM, so it can run on the thread pool; sized from fstat like pushRemainingContents.
+// Returns 0 on success or a libuv error code
+static int readFileContents(const char* path, std::string& contents)
+{
+    uv_fs_t req;
+    int fd = uv_fs_open(uv_default_loop(), &req, path, O_RDONLY, 0, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    if (fd < 0)
+        return fd;
+
+    size_t expected = 0;
+    int err = uv_fs_fstat(uv_default_loop(), &req, fd, nullptr);
+    if (err == 0 && S_ISREG(req.statbuf.st_mode))
+        expected = static_cast<size_t>(req.statbuf.st_size);
+    uv_fs_req_cleanup(&req);
+
+    if (expected > kMaxReadSize)
+    {
+        uv_fs_close(uv_default_loop(), &req, fd, nullptr);
+        uv_fs_req_cleanup(&req);
+        return UV_EFBIG;
+    }
+
+    contents.resize(expected);
+    err = 0;
+
+    size_t size = 0;
+    for (;;)
+    {
+        // Once the size from fstat is used up, probe for EOF into a scratch buffer instead of growing the string
+        char chunk[16 * 1024];
+        bool full = size == contents.size();
+
+        uv_buf_t iov = full ? uv_buf_init(chunk, sizeof(chunk)) : uv_buf_init(contents.data() + size, static_cast<unsigned int>(contents.size() - size));
+
+        int numBytesRead = uv_fs_read(uv_default_loop(), &req, fd, &iov, 1, -1, nullptr);
+        uv_fs_req_cleanup(&req);
+
+        if (numBytesRead <= 0)
+        {
+            err = numBytesRead;
+            break;
+        }
+
+        if (full)
+            contents.append(chunk, numBytesRead);
+
+        size += numBytesRead;
+    }
+
+    contents.resize(size);
+
+    uv_fs_close(uv_default_loop(), &req, fd, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    if (err == 0 && size > kMaxReadSize)
+        err = UV_EFBIG;
+
+    return err;
+}
+
+// Writes all of data to path, looping over short writes. Returns 0 on success or a libuv error code
+static int writeFileContents(const char* path, int flags, const char* data, size_t size)
+{
+    uv_fs_t req;
+    int fd = uv_fs_open(uv_default_loop(), &req, path, flags, 0666, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    if (fd < 0)
+        return fd;
+
+    uv_buf_t iov = uv_buf_init(const_cast<char*>(data), static_cast<unsigned int>(size));
+    int err = writeBuffers(fd, &iov, 1, -1);
+
+    int closeErr = uv_fs_close(uv_default_loop(), &req, fd, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    return err != 0 ? err : closeErr;
+}
+
+// On Linux, libuv (1.45+) can submit fs requests that have a callback to io_uring instead of the thread pool when UV_USE_IO_URING
+// is set, batching the submissions of a loop turn. The whole-file reads and writes below are a single job on the thread pool
+// by default; with io_uring they are chained as separate requests instead, so each step goes through the ring. libuv still
+// falls back to its thread pool per request when the kernel does not support the ring.
+static bool useChainedRequests()
+{
+#ifdef __linux__
+    static const bool enabled = []
+    {
+        char value[16];
+        size_t size = sizeof(value);
+        return uv_os_getenv("UV_USE_IO_URING", value, &size) == 0 && atoi(value) > 0;
+    }();
+
+    return enabled;
+#else
+    return false;
+#endif
+}
+
+// A whole-file read or write as a chain of libuv requests: open, (fstat,) read or write until done, close
+struct ChainedFileJob
+{
+    uv_fs_t req;
+    ResumeToken token;
+    std::string path;
+    uv_file fd = -1;
+    int err = 0;
+
+    // read: the contents, sized from fstat and probed for EOF through chunk
+    std::string contents;
+    size_t size = 0;
+    char chunk[16 * 1024];
+
+    // write: the source, kept alive by contentsRef until the thread is resumed
+    const char* data = nullptr;
+    size_t remaining = 0;
+    std::shared_ptr<Ref> contentsRef;
+};
+
+static void finishChainedRead(uv_fs_t* req)
+{
+    auto* job = static_cast<ChainedFileJob*>(req->data);
+    uv_fs_req_cleanup(req);
+
+    if (job->err < 0)
+    {
+        job->token->fail("Error reading file " + job->path + ": " + uv_strerror(job->err));
+    }
+    else
+    {
+        job->contents.resize(job->size);
+        job->token->complete(
+            [contents = std::move(job->contents)](lua_State* L)
+            {
+                lua_pushlstring(L, contents.data(), contents.size());
+                return 1;
+            }
+        );
+    }
+
+    delete job;
+}
+
+static void finishChainedWrite(uv_fs_t* req)
+{
+    auto* job = static_cast<ChainedFileJob*>(req->data);
+    int closeErr = static_cast<int>(req->result);
+    uv_fs_req_cleanup(req);
+
+    int err = job->err != 0 ? job->err : closeErr;
+
+    if (err < 0)
+    {
+        job->token->fail("Error writing file " + job->path + ": " + uv_strerror(err));
+    }
+    else
+    {
+        job->token->complete(
+            [contentsRef = std::move(job->contentsRef)](lua_State* L)
+            {
+                return 0;
+            }
+        );
+    }
+
+    delete job;
+}
+
+static void closeChainedJob(ChainedFileJob* job, uv_fs_cb done)
+{
+    if (job->fd < 0)
+    {
+        job->req.result = 0;
+        done(&job->req);
+        return;
+    }
+
+    int err = uv_fs_close(&job->token->runtime->loop, &job->req, job->fd, done);
+    if (err < 0)
+    {
+        job->req.result = err;
+        done(&job->req);
+    }
+}
+
+static void onChainedRead(uv_fs_t* req);
+
+static void readNextChunk(ChainedFileJob* job)
+{
+    bool full = job->size == job->contents.size();
+    uv_buf_t iov = full ? uv_buf_init(job->chunk, sizeof(job->chunk))
+                        : uv_buf_init(job->contents.data() + job->size, static_cast<unsigned int>(job->contents.size() - job->size));
+
+    int err = uv_fs_read(&job->token->runtime->loop, &job->req, job->fd, &iov, 1, -1, onChainedRead);
+    if (err < 0)
+    {
+        job->err = err;
+        closeChainedJob(job, finishChainedRead);
+    }
+}
+
+static void onChainedRead(uv_fs_t* req)
+{
+    auto* job = static_cast<ChainedFileJob*>(req->data);
+    ssize_t numBytesRead = req->result;
+    uv_fs_req_cleanup(req);
+
+    if (numBytesRead <= 0)
+    {
+        job->err = static_cast<int>(numBytesRead);
+        closeChainedJob(job, finishChainedRead);
+        return;
+    }
+
+    if (job->size == job->contents.size())
+        job->contents.append(job->chunk, numBytesRead);
+
+    job->size += numBytesRead;
+
+    if (job->size > kMaxReadSize)
+    {
+        job->err = UV_EFBIG;
+        closeChainedJob(job, finishChainedRead);
+        return;
+    }
+
+    readNextChunk(job);
+}
+
+static void onChainedReadStat(uv_fs_t* req)
+{
+    auto* job = static_cast<ChainedFileJob*>(req->data);
+
+    size_t expected = 0;
+    if (req->result == 0 && S_ISREG(req->statbuf.st_mode))
+        expected = static_cast<size_t>(req->statbuf.st_size);
+    uv_fs_req_cleanup(req);
+
+    if (expected > kMaxReadSize)
+    {
+        job->err = UV_EFBIG;
+        closeChainedJob(job, finishChainedRead);
+        return;
+    }
+
+    job->contents.resize(expected);
+
+    readNextChunk(job);
+}
+
+static void onChainedReadOpen(uv_fs_t* req)
+{
+    auto* job = static_cast<ChainedFileJob*>(req->data);
+    ssize_t fd = req->result;
+    uv_fs_req_cleanup(req);
+
+    if (fd < 0)
+    {
+        job->err = static_cast<int>(fd);
+        closeChainedJob(job, finishChainedRead);
+        return;
+    }
+
+    job->fd = static_cast<uv_file>(fd);
+
+    int err = uv_fs_fstat(&job->token->runtime->loop, &job->req, job->fd, onChainedReadStat);
+    if (err < 0)
+    {
+        job->err = err;
+        closeChainedJob(job, finishChainedRead);
+    }
+}
+
+static void onChainedWrite(uv_fs_t* req);
+
+static void writeNextPart(ChainedFileJob* job)
+{
+    if (job->remaining == 0)
+    {
+        closeChainedJob(job, finishChainedWrite);
+        return;
+    }
+
+    uv_buf_t iov = uv_buf_init(const_cast<char*>(job->data), static_cast<unsigned int>(job->remaining));
+
+    int err = uv_fs_write(&job->token->runtime->loop, &job->req, job->fd, &iov, 1, -1, onChainedWrite);
+    if (err < 0)
+    {
+        job->err = err;
+        closeChainedJob(job, finishChainedWrite);
+    }
+}
+
+static void onChainedWrite(uv_fs_t* req)
+{
+    auto* job = static_cast<ChainedFileJob*>(req->data);
+    ssize_t written = req->result;
+    uv_fs_req_cleanup(req);
+
+    if (written < 0)
+    {
+        job->err = static_cast<int>(written);
+        closeChainedJob(job, finishChainedWrite);
+        return;
+    }
+
+    job->data += written;
+    job->remaining -= written;
+
+    writeNextPart(job);
+}
+
+static void onChainedWriteOpen(uv_fs_t* req)
+{
+    auto* job = static_cast<ChainedFileJob*>(req->data);
+    ssize_t fd = req->result;
+    uv_fs_req_cleanup(req);
+
+    if (fd < 0)
+    {
+        job->err = static_cast<int>(fd);
+        closeChainedJob(job, finishChainedWrite);
+        return;
+    }
+
+    job->fd = static_cast<uv_file>(fd);
+
+    writeNextPart(job);
+}
+
+static void startChainedJob(ChainedFileJob* job, int flags, int mode, uv_fs_cb onOpen, uv_fs_cb done)
+{
+    job->req.data = job;
+
+    int err = uv_fs_open(&job->token->runtime->loop, &job->req, job->path.c_str(), flags, mode, onOpen);
+    if (err < 0)
+    {
+        job->err = err;
+        closeChainedJob(job, done);
+    }
+}
+
+int readasync(lua_State* L)
+{
+    std::string path = luaL_checkstring(L, 1);
+    ResumeToken token = getResumeToken(L);
+
+    if (useChainedRequests())
+    {
+        auto* job = new ChainedFileJob();
+        job->token = std::move(token);
+        job->path = std::move(path);
+
+        startChainedJob(job, O_RDONLY, 0, onChainedReadOpen, finishChainedRead);
+        return lua_yield(L, 0);
+    }
+
+    // open, fstat, read and close all happen in one job on the thread pool, so large files never stall the loop
+    token->runtime->runInWorkQueue(
+        [token, path = std::move(path)]
+        {
+            std::string contents;
+            int err = readFileContents(path.c_str(), contents);
+
+            if (err < 0)
+            {
+                token->fail("Error reading file " + path + ": " + uv_strerror(err));
+                return;
+            }
+
+            token->complete(
+                [contents = std::move(contents)](lua_State* L)
+                {
+                    lua_pushlstring(L, contents.data(), contents.size());
+                    return 1;
+                }
+            );
+        }
+    );
+
+    return lua_yield(L, 0);
+}
+
+static int writeFileAsync(lua_State* L, int flags)
+{
+    std::string path = luaL_checkstring(L, 1);
+    size_t size = 0;
+    const char* data = luaL_checklstring(L, 2, &size);
+
+    // The job writes straight from the Lua string, which the reference keeps alive until the thread is resumed
+    auto contentsRef = std::make_shared<Ref>(L, 2);
+    ResumeToken token = getResumeToken(L);
+
+    if (useChainedRequests())
+    {
+        auto* job = new ChainedFileJob();
+        job->token = std::move(token);
+        job->path = std::move(path);
+        job->data = data;
+        job->remaining = size;
+        job->contentsRef = std::move(contentsRef);
+
+        startChainedJob(job, flags, 0666, onChainedWriteOpen, finishChainedWrite);
+        return lua_yield(L, 0);
+    }
+
+    token->runtime->runInWorkQueue(
+        [token, path = std::move(path), flags, data, size, contentsRef]
+        {
+            int err = writeFileContents(path.c_str(), flags, data, size);
+
+            if (err < 0)
+            {
+                token->fail("Error writing file " + path + ": " + uv_strerror(err));
+                return;
+            }
+
+            token->complete(
+                [contentsRef](lua_State* L)
+                {
+                    return 0;
+                }
+            );
+        }
+    );
+
+    return lua_yield(L, 0);
+}
+
+int writeasync(lua_State* L)
+{
+    return writeFileAsync(L, O_WRONLY | O_CREAT | O_TRUNC);
+}
+
+int appendasync(lua_State* L)
+{
+    return writeFileAsync(L, O_WRONLY | O_CREAT | O_APPEND);
+}
+
+struct MappedFile
+{
+    // The mapping starts at an offset aligned down to the page size (allocation granularity on Windows), data points at the
+    // first byte that was asked for
+    char* base = nullptr;
+    size_t mappedLength = 0;
+    char* data = nullptr;
+    size_t length = 0;
+    bool writable = false;
+
+    void close()
+    {
+        if (!base)
+            return;
+
+#ifdef _WIN32
+        UnmapViewOfFile(base);
+#else
+        munmap(base, mappedLength);
+#endif
+
+        base = nullptr;
+        data = nullptr;
+        length = 0;
+    }
+
+    ~MappedFile()
+    {
+        close();
+    }
+};
+
+static size_t mappingGranularity()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+#else
+    return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// Maps length bytes of fd starting at the aligned offset; returns nullptr on failure
+static char* mapFileRange(uv_file fd, bool writable, uint64_t alignedOffset, size_t mappedLength)
+{
+#ifdef _WIN32
+    HANDLE file = reinterpret_cast<HANDLE>(uv_get_osfhandle(fd));
+    uint64_t end = alignedOffset + mappedLength;
+
+    HANDLE mapping = CreateFileMappingW(
+        file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, static_cast<DWORD>(end >> 32), static_cast<DWORD>(end), nullptr
+    );
+    if (!mapping)
+        return nullptr;
+
+    // The view keeps the mapping object alive
+    void* view = MapViewOfFile(
+        mapping,
+        writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+        static_cast<DWORD>(alignedOffset >> 32),
+        static_cast<DWORD>(alignedOffset),
+        mappedLength
+    );
+    CloseHandle(mapping);
+
+    return static_cast<char*>(view);
+#else
+    void* view = mmap(nullptr, mappedLength, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, static_cast<off_t>(alignedOffset));
+    return view == MAP_FAILED ? nullptr : static_cast<char*>(view);
+#endif
+}
+
+static MappedFile* checkMappedFile(lua_State* L, bool write = false)
+{
+    auto* file = static_cast<MappedFile*>(lua_touserdatatagged(L, 1, kMappedFileTag));
+
+    if (!file)
+        luaL_typeerrorL(L, 1, "MappedFile");
+
+    if (!file->base)
+        luaL_errorL(L, "mapped file is closed");
+
+    if (write && !file->writable)
+        luaL_errorL(L, "mapped file is read-only");
+
+    return file;
+}
+
+// Offsets are checked as doubles rather than ints so mappings larger than 2 GiB can be addressed
+static size_t checkMappedRange(lua_State* L, const MappedFile& file, int arg, size_t size)
+{
+    double offset = luaL_checknumber(L, arg);
+
+    if (size > file.length || !(offset >= 0) || offset != std::floor(offset) || offset > static_cast<double>(file.length - size))
+        luaL_errorL(L, "mapped file access out of bounds");
+
+    return static_cast<size_t>(offset);
+}
+
+template<typename T>
+static int mappedRead(lua_State* L)
+{
+    MappedFile* file = checkMappedFile(L);
+    size_t offset = checkMappedRange(L, *file, 2, sizeof(T));
+
+    T value;
+    memcpy(&value, file->data + offset, sizeof(T));
+
+    lua_pushnumber(L, static_cast<double>(value));
+    return 1;
+}
+
+template<typename T>
+static int mappedWrite(lua_State* L)
+{
+    MappedFile* file = checkMappedFile(L, /* write */ true);
+    size_t offset = checkMappedRange(L, *file, 2, sizeof(T));
+
+    // Integers wrap around like the buffer library does
+    T value;
+    if constexpr (std::is_floating_point_v<T>)
+        value = static_cast<T>(luaL_checknumber(L, 3));
+    else
+        value = static_cast<T>(luaL_checkunsigned(L, 3));
+
+    memcpy(file->data + offset, &value, sizeof(T));
+    return 0;
+}
+
+static int mappedReadString(lua_State* L)
+{
+    MappedFile* file = checkMappedFile(L);
+    int count = luaL_checkinteger(L, 3);
+    if (count < 0)
+        luaL_errorL(L, "count cannot be negative");
+
+    size_t offset = checkMappedRange(L, *file, 2, size_t(count));
+
+    lua_pushlstring(L, file->data + offset, size_t(count));
+    return 1;
+}
+
+static int mappedWriteString(lua_State* L)
+{
+    MappedFile* file = checkMappedFile(L, /* write */ true);
+
+    size_t size = 0;
+    const char* value = luaL_checklstring(L, 3, &size);
+
+    int count = luaL_optinteger(L, 4, int(size));
+    if (count < 0 || size_t(count) > size)
+        luaL_errorL(L, "count must be between 0 and the string length");
+
+    size_t offset = checkMappedRange(L, *file, 2, size_t(count));
+
+    memcpy(file->data + offset, value, size_t(count));
+    return 0;
+}
+
+static int mappedLen(lua_State* L)
+{
+    MappedFile* file = checkMappedFile(L);
+
+    lua_pushnumber(L, static_cast<double>(file->length));
+    return 1;
+}
+
+static int mappedSync(lua_State* L)
+{
+    MappedFile* file = checkMappedFile(L, /* write */ true);
+
+#ifdef _WIN32
+    if (!FlushViewOfFile(file->base, file->mappedLength))
+        luaL_errorL(L, "Error syncing mapped file: %lu", GetLastError());
+#else
+    if (msync(file->base, file->mappedLength, MS_SYNC) != 0)
+        luaL_errorL(L, "Error syncing mapped file: %s", strerror(errno));
+#endif
+
+    return 0;
+}
+
+static int mappedClose(lua_State* L)
+{
+    auto* file = static_cast<MappedFile*>(lua_touserdatatagged(L, 1, kMappedFileTag));
+
+    if (!file)
+        luaL_typeerrorL(L, 1, "MappedFile");
+
+    file->close();
+    return 0;
+}
+
+static const luaL_Reg mappedFileMethods[] = {
+    {"len", mappedLen},
+    {"readi8", mappedRead<int8_t>},
+    {"readu8", mappedRead<uint8_t>},
+    {"readi16", mappedRead<int16_t>},
+    {"readu16", mappedRead<uint16_t>},
+    {"readi32", mappedRead<int32_t>},
+    {"readu32", mappedRead<uint32_t>},
+    {"readf32", mappedRead<float>},
+    {"readf64", mappedRead<double>},
+    {"readstring", mappedReadString},
+    {"writei8", mappedWrite<int8_t>},
+    {"writeu8", mappedWrite<uint8_t>},
+    {"writei16", mappedWrite<int16_t>},
+    {"writeu16", mappedWrite<uint16_t>},
+    {"writei32", mappedWrite<int32_t>},
+    {"writeu32", mappedWrite<uint32_t>},
+    {"writef32", mappedWrite<float>},
+    {"writef64", mappedWrite<double>},
+    {"writestring", mappedWriteString},
+    {"sync", mappedSync},
+    {"close", mappedClose},
+    {nullptr, nullptr},
+};
+
+int fs_mmap(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    bool writable = false;
+    double offsetOption = 0.0;
+    std::optional<double> lengthOption;
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "mode");
+        if (lua_isstring(L, -1))
+        {
+            const char* mode = lua_tostring(L, -1);
+            if (strcmp(mode, "rw") == 0)
+                writable = true;
+            else if (strcmp(mode, "r") != 0)
+                luaL_errorL(L, "mode must be 'r' or 'rw'");
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "offset");
+        if (lua_isnumber(L, -1))
+            offsetOption = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "length");
+        if (lua_isnumber(L, -1))
+            lengthOption = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+
+    if (!(offsetOption >= 0) || offsetOption != std::floor(offsetOption))
+        luaL_errorL(L, "offset must be a non-negative integer");
+
+    if (lengthOption && (!(*lengthOption > 0) || *lengthOption != std::floor(*lengthOption)))
+        luaL_errorL(L, "length must be a positive integer");
+
+    uv_fs_t req;
+    int fd = uv_fs_open(uv_default_loop(), &req, path, writable ? O_RDWR : O_RDONLY, 0, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    if (fd < 0)
+        luaL_errorL(L, "Error opening file %s: %s", path, uv_strerror(fd));
+
+    int err = uv_fs_fstat(uv_default_loop(), &req, fd, nullptr);
+    uint64_t fileSize = static_cast<uint64_t>(req.statbuf.st_size);
+    uv_fs_req_cleanup(&req);
+
+    uint64_t offset = static_cast<uint64_t>(offsetOption);
+    uint64_t length = lengthOption ? static_cast<uint64_t>(*lengthOption) : (offset < fileSize ? fileSize - offset : 0);
+
+    const char* error = nullptr;
+    if (err < 0)
+        error = uv_strerror(err);
+    else if (length == 0)
+        error = "cannot map an empty range";
+    else if (offset > fileSize || length > fileSize - offset)
+        error = "range is past the end of the file";
+    else if (length > SIZE_MAX)
+        error = "range is too large to map";
+
+    char* base = nullptr;
+    uint64_t alignedOffset = offset - offset % mappingGranularity();
+    size_t mappedLength = static_cast<size_t>(length + (offset - alignedOffset));
+
+    if (!error)
+    {
+        base = mapFileRange(fd, writable, alignedOffset, mappedLength);
+        if (!base)
+            error = "the system refused the mapping";
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    uv_fs_close(uv_default_loop(), &req, fd, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    if (error)
+        luaL_errorL(L, "Error mapping file %s: %s", path, error);
+
+    auto* file = new (lua_newuserdatataggedwithmetatable(L, sizeof(MappedFile), kMappedFileTag)) MappedFile{};
+    file->base = base;
+    file->mappedLength = mappedLength;
+    file->data = base + (offset - alignedOffset);
+    file->length = static_cast<size_t>(length);
+    file->writable = writable;
+
+    return 1;
+}
+
+static constexpr size_t kDefaultWriterBufferSize = 64 * 1024;
+
+struct FileWriter;
+
+// The flush timer of a writer, freed by its close callback. It does not keep the writer alive
+struct WriterTimer
+{
+    uv_timer_t handle;
+    std::weak_ptr<FileWriter> writer;
+};
+
+// State of fs.writer, shared with the thread pool jobs that flush it in the background
+struct FileWriter : std::enable_shared_from_this<FileWriter>
+{
+    Runtime* runtime = nullptr;
+    uv_file fd = -1;
+    size_t capacity = kDefaultWriterBufferSize;
+    bool fsync = false;
+    bool background = false;
+    bool closed = false;
+
+    // Collects writes until the next flush
+    std::vector<char> buffer;
+
+    // Owned by the background flush while one is running; the writer waits for it before reusing it or closing the file
+    std::vector<char> inflight;
+    std::mutex mutex;
+    std::condition_variable flushed;
+    bool flushing = false;
+    // First error of a background flush, reported by the next call on the writer
+    int flushError = 0;
+
+    WriterTimer* timer = nullptr;
+};
+
+// Waits for a background flush to finish and returns (and clears) the error it left behind
+static int waitForFlush(FileWriter& writer)
+{
+    std::unique_lock lock(writer.mutex);
+    writer.flushed.wait(
+        lock,
+        [&writer]
+        {
+            return !writer.flushing;
+        }
+    );
+
+    return std::exchange(writer.flushError, 0);
+}
+
+static int writeAndSync(uv_file fd, std::vector<char>& data, bool fsync)
+{
+    uv_buf_t iov = uv_buf_init(data.data(), static_cast<unsigned int>(data.size()));
+    int err = writeBuffers(fd, &iov, 1, -1);
+
+    if (err == 0 && fsync)
+    {
+        uv_fs_t syncReq;
+        err = uv_fs_fsync(uv_default_loop(), &syncReq, fd, nullptr);
+        uv_fs_req_cleanup(&syncReq);
+    }
+
+    data.clear();
+    return err;
+}
+
+// Writes out the buffered data, on the thread pool if the writer flushes in the background and wait is not set.
+// Returns 0 or a libuv error code, which may come from an earlier background flush
+static int flushWriter(FileWriter& writer, bool wait)
+{
+    int err = waitForFlush(writer);
+    if (err < 0 || writer.buffer.empty())
+        return err;
+
+    if (!writer.background || wait)
+        return writeAndSync(writer.fd, writer.buffer, writer.fsync);
+
+    // Writes keep going into the other vector while this one is written out
+    std::swap(writer.buffer, writer.inflight);
+
+    {
+        std::lock_guard lock(writer.mutex);
+        writer.flushing = true;
+    }
+
+    writer.runtime->runInWorkQueue(
+        [writer = writer.shared_from_this()]
+        {
+            int err = writeAndSync(writer->fd, writer->inflight, writer->fsync);
+
+            std::lock_guard lock(writer->mutex);
+            writer->flushing = false;
+            if (err < 0 && writer->flushError == 0)
+                writer->flushError = err;
+            writer->flushed.notify_all();
+        }
+    );
+
+    return 0;
+}
+
+static void stopWriterTimer(FileWriter& writer)
+{
+    if (!writer.timer)
+        return;
+
+    uv_timer_stop(&writer.timer->handle);
+    uv_close(
+        reinterpret_cast<uv_handle_t*>(&writer.timer->handle),
+        [](uv_handle_t* handle)
+        {
+            delete static_cast<WriterTimer*>(handle->data);
+        }
+    );
+    writer.timer = nullptr;
+}
+
+// Writes out what is left and closes the file. Blocks, so it runs on the thread pool when the writer was collected
+static int finishWriter(FileWriter& writer)
+{
+    int err = flushWriter(writer, /* wait */ true);
+
+    uv_fs_t closeReq;
+    int closeErr = uv_fs_close(uv_default_loop(), &closeReq, writer.fd, nullptr);
+    uv_fs_req_cleanup(&closeReq);
+
+    return err < 0 ? err : closeErr;
+}
+
+static int closeWriter(FileWriter& writer)
+{
+    if (writer.closed)
+        return 0;
+
+    writer.closed = true;
+    stopWriterTimer(writer);
+
+    return finishWriter(writer);
+}
+
+// Called when an open writer is collected. The garbage collector must not wait for the disk, so the last flush and the
+// close run on the thread pool, which keeps the writer alive until they are done. Nobody is left to see an error, so it
+// is printed
+static void releaseWriter(const std::shared_ptr<FileWriter>& writer)
+{
+    if (writer->closed)
+        return;
+
+    writer->closed = true;
+    stopWriterTimer(*writer);
+
+    writer->runtime->runInWorkQueue(
+        [writer]
+        {
+            int err = finishWriter(*writer);
+            if (err < 0)
+                fprintf(stderr, "Error closing a collected writer: %s\n", uv_strerror(err));
+        }
+    );
+}
+
+static FileWriter& checkWriter(lua_State* L)
+{
+    auto* writer = static_cast<std::shared_ptr<FileWriter>*>(lua_touserdatatagged(L, 1, kFileWriterTag));
+
+    if (!writer)
+        luaL_typeerrorL(L, 1, "FileWriter");
+
+    if ((*writer)->closed)
+        luaL_errorL(L, "writer is closed");
+
+    return **writer;
+}
+
+static int writerWrite(lua_State* L)
+{
+    FileWriter& writer = checkWriter(L);
+
+    size_t size = 0;
+    const char* data = checkWriteSource(L, 2, size);
+
+    int err = 0;
+    {
+        std::lock_guard lock(writer.mutex);
+        err = std::exchange(writer.flushError, 0);
+    }
+
+    if (err == 0 && writer.buffer.size() + size > writer.capacity)
+    {
+        err = flushWriter(writer, /* wait */ false);
+
+        // Pieces that do not fit the buffer at all go straight to the file, after whatever was buffered before them
+        if (err == 0 && size >= writer.capacity)
+        {
+            err = waitForFlush(writer);
+
+            uv_buf_t iov = uv_buf_init(const_cast<char*>(data), static_cast<unsigned int>(size));
+            if (err == 0)
+                err = writeBuffers(writer.fd, &iov, 1, -1);
+
+            size = 0;
+        }
+    }
+
+    if (err < 0)
+        luaL_errorL(L, "Error writing: %s", uv_strerror(err));
+
+    writer.buffer.insert(writer.buffer.end(), data, data + size);
+    return 0;
+}
+
+static int writerFlush(lua_State* L)
+{
+    FileWriter& writer = checkWriter(L);
+
+    int err = flushWriter(writer, /* wait */ true);
+    if (err < 0)
+        luaL_errorL(L, "Error flushing: %s", uv_strerror(err));
+
+    return 0;
+}
+
+static int writerClose(lua_State* L)
+{
+    auto* writer = static_cast<std::shared_ptr<FileWriter>*>(lua_touserdatatagged(L, 1, kFileWriterTag));
+
+    if (!writer)
+        luaL_typeerrorL(L, 1, "FileWriter");
+
+    int err = closeWriter(**writer);
+    if (err < 0)
+        luaL_errorL(L, "Error closing writer: %s", uv_strerror(err));
+
+    return 0;
+}
+
+static const luaL_Reg fileWriterMethods[] = {
+    {"write", writerWrite},
+    {"flush", writerFlush},
+    {"close", writerClose},
+    {nullptr, nullptr},
+};
+
+int writer(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    auto writer = std::make_shared<FileWriter>();
+    writer->runtime = getRuntime(L);
+
+    double flushInterval = 0.0;
+    bool truncate = false;
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "buffersize");
+        if (lua_isnumber(L, -1))
+        {
+            double size = lua_tonumber(L, -1);
+            if (!(size >= 1))
+                luaL_errorL(L, "buffersize must be at least 1");
+            writer->capacity = static_cast<size_t>(std::min(size, double(kMaxReadSize)));
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "flushinterval");
+        if (lua_isnumber(L, -1))
+            flushInterval = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "fsync");
+        writer->fsync = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "background");
+        writer->background = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "truncate");
+        truncate = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    uv_fs_t openReq;
+    int fd = uv_fs_open(uv_default_loop(), &openReq, path, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : O_APPEND), 0666, nullptr);
+    uv_fs_req_cleanup(&openReq);
+
+    if (fd < 0)
+        luaL_errorL(L, "Error opening file %s: %s", path, uv_strerror(fd));
+
+    writer->fd = fd;
+    writer->buffer.reserve(writer->capacity);
+    writer->inflight.reserve(writer->background ? writer->capacity : 0);
+
+    if (flushInterval > 0)
+    {
+        uint64_t intervalMs = std::max(uint64_t(1), static_cast<uint64_t>(flushInterval * 1000));
+
+        writer->timer = new WriterTimer{{}, writer};
+        uv_timer_init(&getRuntime(L)->loop, &writer->timer->handle);
+        writer->timer->handle.data = writer->timer;
+
+        uv_timer_start(
+            &writer->timer->handle,
+            [](uv_timer_t* handle)
+            {
+                std::shared_ptr<FileWriter> writer = static_cast<WriterTimer*>(handle->data)->writer.lock();
+                if (!writer || writer->closed)
+                    return;
+
+                int err = flushWriter(*writer, /* wait */ false);
+                if (err < 0)
+                {
+                    std::lock_guard lock(writer->mutex);
+                    if (writer->flushError == 0)
+                        writer->flushError = err;
+                }
+            },
+            intervalMs,
+            intervalMs
+        );
+
+        // The timer alone should not keep the process running
+        uv_unref(reinterpret_cast<uv_handle_t*>(&writer->timer->handle));
+    }
+
+    new (lua_newuserdatataggedwithmetatable(L, sizeof(std::shared_ptr<FileWriter>), kFileWriterTag)) std::shared_ptr<FileWriter>(std::move(writer));
+    return 1;
+}
+
+static constexpr size_t kDefaultLineReadAhead = 64 * 1024;
+// Chunks read ahead of the one being consumed
+static constexpr size_t kReaderReadAheadChunks = 4;
+
+// State behind fs.lines and fs.chunks: the iterator consumes one chunk while a thread pool job reads up to
+// kReaderReadAheadChunks more, so memory stays bounded regardless of the file size. The iterator only waits when it
+// consumes chunks faster than they can be read: a caller that can yield is suspended until the job delivers the chunk,
+// anything else (e.g. a generic for loop) blocks the runtime thread
+struct FileReader : std::enable_shared_from_this<FileReader>
+{
+    Runtime* runtime = nullptr;
+    uv_file fd = -1;
+    size_t chunkSize = kDefaultLineReadAhead;
+    bool eof = false;
+    bool closed = false;
+
+    std::vector<char> current;
+    size_t position = 0;
+
+    // Filled by the read-ahead job; an empty chunk marks the end of the file
+    std::deque<std::vector<char>> ahead;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool prefetching = false;
+    bool reachedEnd = false;
+    bool stopping = false;
+    int prefetchError = 0;
+    // Thread suspended until the job delivers a chunk or an error
+    ResumeToken waiter;
+
+    // Start of a line that continues in the next chunk
+    std::string carry;
+};
+
+// Fills data with up to size bytes, retrying short reads so only the last chunk of a file comes back shorter
+static int readChunk(uv_file fd, std::vector<char>& data, size_t size)
+{
+    data.resize(size);
+
+    size_t total = 0;
+    while (total < size)
+    {
+        uv_fs_t readReq;
+        uv_buf_t iov = uv_buf_init(data.data() + total, static_cast<unsigned int>(size - total));
+        int numBytesRead = uv_fs_read(uv_default_loop(), &readReq, fd, &iov, 1, -1, nullptr);
+        uv_fs_req_cleanup(&readReq);
+
+        if (numBytesRead < 0)
+            return numBytesRead;
+
+        if (numBytesRead == 0)
+            break;
+
+        total += numBytesRead;
+    }
+
+    data.resize(total);
+    return 0;
+}
+
+// Starts the read-ahead job unless it is running or has nothing left to do. Must be called on the runtime thread with the
+// mutex held
+static void startPrefetch(FileReader& reader)
+{
+    if (reader.prefetching || reader.reachedEnd || reader.stopping || reader.prefetchError != 0)
+        return;
+
+    if (reader.ahead.size() >= kReaderReadAheadChunks)
+        return;
+
+    reader.prefetching = true;
+
+    reader.runtime->runInWorkQueue(
+        [reader = reader.shared_from_this()]
+        {
+            for (;;)
+            {
+                std::vector<char> chunk;
+                int err = readChunk(reader->fd, chunk, reader->chunkSize);
+
+                ResumeToken waiter;
+                bool closeFile = false;
+                bool done = false;
+
+                {
+                    std::lock_guard lock(reader->mutex);
+
+                    if (reader->stopping)
+                    {
+                        // The reader was closed while this chunk was being read, the descriptor is left to the job
+                        closeFile = true;
+                        done = true;
+                    }
+                    else
+                    {
+                        if (err < 0)
+                            reader->prefetchError = err;
+                        else if (chunk.empty())
+                            reader->reachedEnd = true;
+
+                        if (err == 0)
+                            reader->ahead.push_back(std::move(chunk));
+
+                        done = err < 0 || reader->reachedEnd || reader->ahead.size() >= kReaderReadAheadChunks;
+                        waiter = std::move(reader->waiter);
+                    }
+
+                    if (done)
+                        reader->prefetching = false;
+
+                    reader->ready.notify_all();
+                }
+
+                // The suspended iterator reads the chunk from its continuation
+                if (waiter)
+                {
+                    waiter->complete(
+                        [](lua_State*)
+                        {
+                            return 0;
+                        }
+                    );
+                }
+
+                if (closeFile)
+                {
+                    uv_fs_t closeReq;
+                    uv_fs_close(uv_default_loop(), &closeReq, reader->fd, nullptr);
+                    uv_fs_req_cleanup(&closeReq);
+                }
+
+                if (done)
+                    return;
+            }
+        }
+    );
+}
+
+// Returned by advanceReader when the caller was suspended until the next chunk is read
+static constexpr int kReaderSuspended = 1;
+
+// Moves on to the next chunk, waiting for the read-ahead job if it has not read it yet. Returns 0, a libuv error code, or
+// kReaderSuspended when L can yield, in which case it has to yield and call advanceReader again once resumed
+static int advanceReader(lua_State* L, FileReader& reader)
+{
+    std::unique_lock lock(reader.mutex);
+
+    startPrefetch(reader);
+
+    if (reader.ahead.empty() && reader.prefetchError == 0)
+    {
+        if (lua_isyieldable(L))
+        {
+            reader.waiter = getResumeToken(L);
+            return kReaderSuspended;
+        }
+
+        reader.ready.wait(
+            lock,
+            [&reader]
+            {
+                return !reader.ahead.empty() || reader.prefetchError != 0;
+            }
+        );
+    }
+
+    // Chunks read before an error are still handed out first
+    if (reader.ahead.empty())
+        return std::exchange(reader.prefetchError, 0);
+
+    reader.current = std::move(reader.ahead.front());
+    reader.ahead.pop_front();
+    reader.position = 0;
+
+    if (reader.current.empty())
+        reader.eof = true;
+    else
+        startPrefetch(reader);
+
+    return 0;
+}
+
+// Never waits, as it also runs from the finalizer: a job that is still reading closes the descriptor once it is done
+static void closeReader(FileReader& reader)
+{
+    if (reader.closed)
+        return;
+
+    reader.closed = true;
+
+    bool closeFile = false;
+
+    {
+        std::lock_guard lock(reader.mutex);
+        reader.stopping = true;
+        closeFile = !reader.prefetching;
+        reader.ahead = {};
+    }
+
+    if (closeFile)
+    {
+        uv_fs_t closeReq;
+        uv_fs_close(uv_default_loop(), &closeReq, reader.fd, nullptr);
+        uv_fs_req_cleanup(&closeReq);
+    }
+
+    reader.current = {};
+    reader.carry = {};
+}
+
+static FileReader& upvalueReader(lua_State* L)
+{
+    auto* reader = static_cast<std::shared_ptr<FileReader>*>(lua_touserdatatagged(L, lua_upvalueindex(1), kFileReaderTag));
+
+    if (!reader)
+        luaL_errorL(L, "invalid file reader");
+
+    return **reader;
+}
+
+static l_noret readerError(lua_State* L, FileReader& reader, int err)
+{
+    closeReader(reader);
+    luaL_errorL(L, "Error reading: %s", uv_strerror(err));
+}
+
+static int nextLine(lua_State* L)
+{
+    FileReader& reader = upvalueReader(L);
+
+    if (reader.closed)
+        return 0;
+
+    for (;;)
+    {
+        if (reader.position < reader.current.size())
+        {
+            const char* start = reader.current.data() + reader.position;
+            size_t available = reader.current.size() - reader.position;
+
+            // memchr is vectorized by the C library, which makes it the fastest newline scan available here
+            if (const char* newline = static_cast<const char*>(memchr(start, '\n', available)))
+            {
+                size_t length = newline - start;
+
+                if (reader.carry.empty())
+                {
+                    lua_pushlstring(L, start, length);
+                }
+                else
+                {
+                    reader.carry.append(start, length);
+                    lua_pushlstring(L, reader.carry.data(), reader.carry.size());
+                    reader.carry.clear();
+                }
+
+                reader.position += length + 1;
+                return 1;
+            }
+
+            reader.carry.append(start, available);
+            reader.position = reader.current.size();
+        }
+
+        if (reader.eof)
+        {
+            // The last line does not need a trailing newline
+            if (!reader.carry.empty())
+            {
+                lua_pushlstring(L, reader.carry.data(), reader.carry.size());
+                reader.carry.clear();
+                return 1;
+            }
+
+            closeReader(reader);
+            return 0;
+        }
+
+        int err = advanceReader(L, reader);
+        if (err == kReaderSuspended)
+            return lua_yield(L, 0);
+        if (err < 0)
+            readerError(L, reader, err);
+    }
+}
+
+// Picks up where nextLine or nextChunk left off when they were suspended waiting for a chunk
+static int nextLineCont(lua_State* L, int status)
+{
+    return nextLine(L);
+}
+
+static int nextChunk(lua_State* L)
+{
+    FileReader& reader = upvalueReader(L);
+
+    if (reader.closed)
+        return 0;
+
+    int err = advanceReader(L, reader);
+    if (err == kReaderSuspended)
+        return lua_yield(L, 0);
+    if (err < 0)
+        readerError(L, reader, err);
+
+    if (reader.eof)
+    {
+        closeReader(reader);
+        return 0;
+    }
+
+    lua_pushlstring(L, reader.current.data(), reader.current.size());
+    reader.position = reader.current.size();
+    return 1;
+}
+
+static int nextChunkCont(lua_State* L, int status)
+{
+    return nextChunk(L);
+}
+
+// Opens path and returns an iterator closure over it, with the first chunks already being read in the background
+static int pushReaderIterator(lua_State* L, const char* path, size_t chunkSize, lua_CFunction next, lua_Continuation cont, const char* debugname)
+{
+    uv_fs_t openReq;
+    int fd = uv_fs_open(uv_default_loop(), &openReq, path, O_RDONLY, 0, nullptr);
+    uv_fs_req_cleanup(&openReq);
+
+    if (fd < 0)
+        luaL_errorL(L, "Error opening file %s: %s", path, uv_strerror(fd));
+
+    auto reader = std::make_shared<FileReader>();
+    reader->runtime = getRuntime(L);
+    reader->fd = fd;
+    reader->chunkSize = chunkSize;
+
+    new (lua_newuserdatatagged(L, sizeof(std::shared_ptr<FileReader>), kFileReaderTag)) std::shared_ptr<FileReader>(reader);
 
-    int err = uv_fs_event_stop(&handle->handle);
-    if (err)
     {
-        luaL_errorL(L, "Error stopping fs event: %s", uv_strerror(err));
+        std::lock_guard lock(reader->mutex);
+        startPrefetch(*reader);
     }
 
-    handle->close();
-
-    return 0;
+    lua_pushcclosurek(L, next, debugname, 1, cont);
+    return 1;
 }
 
-int fs_watch(lua_State* L)
+int lines(lua_State* L)
 {
     const char* path = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
+    return pushReaderIterator(L, path, kDefaultLineReadAhead, nextLine, nextLineCont, "lines_next");
+}
 
-    auto* event = new (static_cast<WatchHandle*>(lua_newuserdatataggedwithmetatable(L, sizeof(WatchHandle), kWatchHandleTag))) WatchHandle{};
+int chunks(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
 
-    event->L = L;
-    event->callbackReference = std::make_shared<Ref>(L, 2);
-    event->handle.data = event;
+    double size = luaL_optnumber(L, 2, double(kDefaultLineReadAhead));
+    if (!(size >= 1) || size > double(kMaxReadSize))
+        luaL_errorL(L, "chunk size must be between 1 and %d bytes", int(kMaxReadSize));
 
-    int init_err = uv_fs_event_init(uv_default_loop(), &event->handle);
+    return pushReaderIterator(L, path, static_cast<size_t>(size), nextChunk, nextChunkCont, "chunks_next");
+}
 
-    if (init_err)
-    {
-        luaL_errorL(L, "%s", uv_strerror(init_err));
-    }
+// Directories scanned at the same time; matches the default size of the libuv thread pool
+static constexpr int kWalkParallelism = 4;
+static constexpr size_t kWalkBatchSize = 512;
 
-    int event_start_err = uv_fs_event_start(
-        &event->handle,
-        [](uv_fs_event_t* handle, const char* filenamePtr, int events, int status)
-        {
-            auto* eventHandle = static_cast<WatchHandle*>(handle->data);
+struct WalkEntry
+{
+    std::string path;
+    std::string name;
+    const char* type = UV_TYPENAME_UNKNOWN;
+    int depth = 0;
+    std::optional<uv_stat_t> stat;
+};
 
-            lua_State* newThread = lua_newthread(eventHandle->L);
-            std::shared_ptr<Ref> ref = getRefForThread(newThread);
-            Runtime* runtime = getRuntime(newThread);
+struct WalkDirectory
+{
+    std::string path;
+    std::string relative;
+    int depth = 0;
+};
 
-            std::string filename = filenamePtr ? filenamePtr : "";
+// State of an fs.walk iteration. Directories are scanned (and their entries stat'ed) by up to kWalkParallelism thread pool jobs,
+// which hand the entries to the iterator in batches
+struct DirectoryWalk : std::enable_shared_from_this<DirectoryWalk>
+{
+    Runtime* runtime = nullptr;
+
+    std::string glob;
+    int maxDepth = -1;
+    bool followSymlinks = false;
+    bool withStat = false;
+
+    std::mutex mutex;
+    std::deque<WalkDirectory> pending;
+    int activeJobs = 0;
+    // Set while a pump is queued on the runtime, so finished scans do not queue one each
+    bool pumpScheduled = false;
+    // Directories entered through symlinks, by device and inode, so link cycles are only walked once
+    std::set<std::pair<uint64_t, uint64_t>> visited;
+
+    std::vector<WalkEntry> batch;
+    std::deque<std::vector<WalkEntry>> ready;
+    ResumeToken waiter;
+    // Signalled whenever a scan finishes, for iterator calls that cannot yield
+    std::condition_variable scanned;
+
+    bool finished = false;
+    bool cancelled = false;
+    std::string error;
+};
 
-            runtime->scheduleLuauResume(
-                ref,
-                [=, filename = std::move(filename)](lua_State* L)
-                {
-                    // the function to the back of the stack, omit from nret
-                    eventHandle->callbackReference->push(L);
+// Matches a glob with '*' (within a path segment), '**' (across segments) and '?' against a relative path
+static bool globMatches(std::string_view pattern, std::string_view path)
+{
+    size_t p = 0;
+    size_t s = 0;
 
-                    // filename
-                    lua_pushstring(L, filename.c_str());
+    while (p < pattern.size())
+    {
+        if (pattern[p] == '*')
+        {
+            bool crossesSegments = p + 1 < pattern.size() && pattern[p + 1] == '*';
+            size_t rest = p + (crossesSegments ? 2 : 1);
 
-                    // events
-                    lua_createtable(L, 0, 2);
+            // '**/' also matches no directory at all
+            if (crossesSegments && rest < pattern.size() && pattern[rest] == '/' && globMatches(pattern.substr(rest + 1), path.substr(s)))
+                return true;
 
-                    if ((events & UV_RENAME) == UV_RENAME)
-                    {
-                        lua_pushboolean(L, true);
-                        lua_setfield(L, -2, "rename");
-                    }
-                    else
-                    {
-                        lua_pushboolean(L, false);
-                        lua_setfield(L, -2, "rename");
-                    }
+            for (size_t i = s; i <= path.size(); i++)
+            {
+                if (globMatches(pattern.substr(rest), path.substr(i)))
+                    return true;
 
-                    if ((events & UV_CHANGE) == UV_CHANGE)
-                    {
-                        lua_pushboolean(L, true);
-                        lua_setfield(L, -2, "change");
-                    }
-                    else
-                    {
-                        lua_pushboolean(L, false);
-                        lua_setfield(L, -2, "change");
-                    }
+                if (i < path.size() && path[i] == '/' && !crossesSegments)
+                    break;
+            }
 
-                    return 2;
-                }
-            );
+            return false;
+        }
 
-            uv_stop(handle->loop);
-        },
-        path,
-        0
-    );
+        if (s >= path.size() || (pattern[p] != '?' && pattern[p] != path[s]) || (pattern[p] == '?' && path[s] == '/'))
+            return false;
 
-    if (event_start_err)
-    {
-        luaL_errorL(L, "%s", uv_strerror(event_start_err));
+        p++;
+        s++;
     }
 
-    getRuntime(L)->addPendingToken();
-
-    return 1; // return the watch handle
+    return s == path.size();
 }
 
-int fs_exists(lua_State* L)
+static void pushWalkBatch(lua_State* L, const std::vector<WalkEntry>& entries)
 {
-    const char* path = luaL_checkstring(L, 1);
+    lua_createtable(L, int(entries.size()), 0);
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const WalkEntry& entry = entries[i];
+
+        lua_createtable(L, 0, 5);
 
-    auto* req = new uv_fs_t();
-    req->data = new ResumeToken(getResumeToken(L));
+        lua_pushlstring(L, entry.path.data(), entry.path.size());
+        lua_setfield(L, -2, "path");
 
-    int err = uv_fs_stat(
-        uv_default_loop(),
-        req,
-        path,
-        [](uv_fs_t* req)
+        lua_pushlstring(L, entry.name.data(), entry.name.size());
+        lua_setfield(L, -2, "name");
+
+        lua_pushstring(L, entry.type);
+        lua_setfield(L, -2, "type");
+
+        lua_pushinteger(L, entry.depth);
+        lua_setfield(L, -2, "depth");
+
+        if (entry.stat)
         {
-            auto* request_state = static_cast<ResumeToken*>(req->data);
+            pushFileMetadata(L, *entry.stat);
+            lua_setfield(L, -2, "stat");
+        }
 
-            request_state->get()->complete(
-                [req](lua_State* L)
-                {
-                    if (req->result == UV_ENOENT)
-                    {
-                        lua_pushboolean(L, false); // does not exist
-                    }
-                    else
-                    {
-                        lua_pushboolean(L, true);
-                    }
+        lua_rawseti(L, -2, int(i + 1));
+    }
+}
+
+static void pumpWalk(DirectoryWalk& walk);
+
+// Hands a batch (or the end of the walk) to an iterator call that is waiting for one. Must be called with the mutex held
+static void deliverWalkBatch(DirectoryWalk& walk)
+{
+    if (!walk.waiter)
+        return;
 
-                    uv_fs_req_cleanup(req);
+    if (!walk.error.empty())
+    {
+        std::exchange(walk.waiter, nullptr)->fail(walk.error);
+        return;
+    }
 
-                    delete req;
+    if (!walk.ready.empty())
+    {
+        std::vector<WalkEntry> entries = std::move(walk.ready.front());
+        walk.ready.pop_front();
 
+        std::exchange(walk.waiter, nullptr)
+            ->complete(
+                [entries = std::move(entries)](lua_State* L)
+                {
+                    pushWalkBatch(L, entries);
                     return 1;
                 }
             );
-        }
-    );
-
-    if (err)
+    }
+    else if (walk.finished)
     {
-        luaL_errorL(L, "%s", uv_strerror(err));
+        std::exchange(walk.waiter, nullptr)
+            ->complete(
+                [](lua_State* L)
+                {
+                    return 0;
+                }
+            );
     }
-
-    return lua_yield(L, 0);
 }
 
-int type(lua_State* L)
+static void scanDirectory(const std::shared_ptr<DirectoryWalk>& walk, const WalkDirectory& directory)
 {
-    const char* path = luaL_checkstring(L, 1);
+    std::vector<WalkEntry> entries;
+    std::vector<WalkDirectory> subdirectories;
 
-    uv_fs_t req;
+    uv_fs_t scanReq;
+    int err = uv_fs_scandir(uv_default_loop(), &scanReq, directory.path.c_str(), 0, nullptr);
 
-    int err = uv_fs_stat(uv_default_loop(), &req, path, nullptr);
+    if (err >= 0)
+    {
+        uv_dirent_t dirent;
+        while (uv_fs_scandir_next(&scanReq, &dirent) >= 0)
+        {
+            WalkEntry entry;
+            entry.name = dirent.name;
+            entry.path = directory.path + "/" + entry.name;
+            entry.type = UV_DIRENT_TYPES[dirent.type];
+            entry.depth = directory.depth + 1;
 
-    if (err)
-        luaL_errorL(L, "%s", uv_strerror(err));
+            std::string relative = directory.relative.empty() ? entry.name : directory.relative + "/" + entry.name;
 
-    auto type = fileModeToType(req.statbuf.st_mode);
-    lua_pushstring(L, type);
-    uv_fs_req_cleanup(&req);
+            bool isLink = dirent.type == UV_DIRENT_LINK;
+            bool unknownType = dirent.type == UV_DIRENT_UNKNOWN;
 
-    return 1;
-}
+            if (walk->withStat || unknownType || (isLink && walk->followSymlinks))
+            {
+                uv_fs_t statReq;
+                int statErr = (isLink && !walk->followSymlinks) ? uv_fs_lstat(uv_default_loop(), &statReq, entry.path.c_str(), nullptr)
+                                                                : uv_fs_stat(uv_default_loop(), &statReq, entry.path.c_str(), nullptr);
 
-int listdir(lua_State* L)
-{
-    const char* path = luaL_checkstring(L, 1);
+                if (statErr == 0)
+                {
+                    entry.stat = statReq.statbuf;
+                    entry.type = fileModeToType(statReq.statbuf.st_mode);
+                }
 
-    auto* req = new uv_fs_t();
-    req->data = new ResumeToken(getResumeToken(L));
+                uv_fs_req_cleanup(&statReq);
+            }
 
-    int err = uv_fs_scandir(
-        uv_default_loop(),
-        req,
-        path,
-        0,
-        [](uv_fs_t* req)
-        {
-            auto* request_state = static_cast<ResumeToken*>(req->data);
+            bool isDirectory = entry.type == UV_TYPENAME_DIR;
+            if (isDirectory && (walk->maxDepth < 0 || entry.depth < walk->maxDepth))
+            {
+                bool enter = true;
 
-            request_state->get()->complete(
-                [req](lua_State* L)
+                if (isLink && entry.stat)
                 {
-                    lua_createtable(L, 1, 0);
+                    std::lock_guard lock(walk->mutex);
+                    enter = walk->visited.insert({entry.stat->st_dev, entry.stat->st_ino}).second;
+                }
 
-                    uv_dirent_t dir;
-                    int i = 0;
-                    int err = 0;
-                    while ((err = uv_fs_scandir_next(req, &dir)) >= 0)
-                    {
-                        lua_pushinteger(L, ++i);
+                if (enter)
+                    subdirectories.push_back({entry.path, relative, entry.depth});
+            }
 
-                        lua_createtable(L, 0, 2);
+            // Patterns without a '/' match the entry name, anything else matches the path relative to the root
+            if (!walk->glob.empty())
+            {
+                bool matchesName = walk->glob.find('/') == std::string::npos;
+                if (!globMatches(walk->glob, matchesName ? entry.name : relative))
+                    continue;
+            }
 
-                        lua_pushstring(L, dir.name);
-                        lua_setfield(L, -2, "name");
+            if (!walk->withStat)
+                entry.stat.reset();
 
-                        lua_pushstring(L, UV_DIRENT_TYPES[dir.type]);
-                        lua_setfield(L, -2, "type");
+            entries.push_back(std::move(entry));
+        }
+    }
 
-                        lua_settable(L, -3);
-                    }
+    uv_fs_req_cleanup(&scanReq);
 
-                    uv_fs_req_cleanup(req);
+    std::lock_guard lock(walk->mutex);
+    walk->activeJobs--;
 
-                    delete req;
+    // Directories that cannot be read below the root are skipped, like find does
+    if (err < 0 && directory.depth == 0)
+        walk->error = "Error walking " + directory.path + ": " + uv_strerror(err);
 
-                    if (err != UV_EOF)
-                        luaL_errorL(L, "%s", uv_strerror(err));
+    for (WalkEntry& entry : entries)
+    {
+        walk->batch.push_back(std::move(entry));
 
-                    return 1;
-                }
-            );
-        }
-    );
+        if (walk->batch.size() >= kWalkBatchSize)
+            walk->ready.push_back(std::exchange(walk->batch, {}));
+    }
 
-    if (err)
-        luaL_errorL(L, "%s", uv_strerror(err));
+    for (WalkDirectory& subdirectory : subdirectories)
+        walk->pending.push_back(std::move(subdirectory));
 
-    return lua_yield(L, 0);
+    if (walk->activeJobs == 0 && (walk->pending.empty() || walk->cancelled || !walk->error.empty()))
+    {
+        walk->finished = true;
+
+        if (!walk->batch.empty())
+            walk->ready.push_back(std::exchange(walk->batch, {}));
+    }
+
+    deliverWalkBatch(*walk);
+    walk->scanned.notify_all();
+
+    // Only the runtime thread may queue thread pool work
+    if (!walk->pending.empty() && !walk->finished && !walk->pumpScheduled)
+    {
+        walk->pumpScheduled = true;
+        walk->runtime->schedule(
+            [walk]
+            {
+                std::lock_guard lock(walk->mutex);
+                walk->pumpScheduled = false;
+                pumpWalk(*walk);
+            }
+        );
+    }
 }
 
-int readfiletostring(lua_State* L)
+// Starts scanning pending directories up to the parallelism limit. Must be called on the runtime thread with the mutex held
+static void pumpWalk(DirectoryWalk& walk)
 {
-    const char* path = luaL_checkstring(L, 1);
-    const char openMode[] = "r";
-    int openFlags = 0x0000;
-    std::optional<FileHandle> handle = openHelper(L, path, openMode, &openFlags);
-    if (!handle)
+    while (walk.activeJobs < kWalkParallelism && !walk.pending.empty() && !walk.cancelled)
     {
-        luaL_errorL(L, "Error opening file for reading at %s\n", path);
-        return 0;
+        WalkDirectory directory = std::move(walk.pending.front());
+        walk.pending.pop_front();
+        walk.activeJobs++;
+
+        walk.runtime->runInWorkQueue(
+            [walk = walk.shared_from_this(), directory = std::move(directory)]
+            {
+                scanDirectory(walk, directory);
+            }
+        );
     }
+}
 
-    memset(readBuffer, 0, sizeof(readBuffer));
-    // discard any extra arguments passed in
-    lua_settop(L, 1);
+static int nextWalkBatch(lua_State* L)
+{
+    auto* walkPtr = static_cast<std::shared_ptr<DirectoryWalk>*>(lua_touserdatatagged(L, lua_upvalueindex(1), kDirectoryWalkTag));
+    if (!walkPtr)
+        luaL_errorL(L, "invalid directory walk");
 
-    int numBytesRead = 0;
-    uv_fs_t readReq;
-    uv_buf_t iov = uv_buf_init(readBuffer, sizeof(readBuffer));
-    // Output data
-    std::vector<char> resultData;
-    do
-    {
-        uv_fs_read(uv_default_loop(), &readReq, handle->fileDescriptor, &iov, 1, -1, nullptr);
+    DirectoryWalk& walk = **walkPtr;
 
-        numBytesRead = readReq.result;
+    std::unique_lock lock(walk.mutex);
 
-        if (numBytesRead < 0)
+    for (;;)
+    {
+        if (!walk.error.empty())
         {
-            luaL_errorL(L, "Error reading: %s. Closing file.\n", uv_err_name(numBytesRead));
-            cleanup(readBuffer, sizeof(readBuffer), *handle);
-            return 0;
+            std::string error = walk.error;
+            lock.unlock();
+            luaL_errorL(L, "%s", error.c_str());
         }
 
-        for (int i = 0; i < numBytesRead; i++)
-            resultData.push_back(readBuffer[i]);
+        if (!walk.ready.empty())
+        {
+            std::vector<WalkEntry> entries = std::move(walk.ready.front());
+            walk.ready.pop_front();
+            lock.unlock();
 
-    } while (numBytesRead > 0);
+            pushWalkBatch(L, entries);
+            return 1;
+        }
 
-    lua_pushlstring(L, resultData.data(), resultData.size());
+        if (walk.finished)
+            return 0;
 
-    // Clean up the scratch space
-    cleanup(readBuffer, sizeof(readBuffer), *handle);
-    return 1;
-}
+        // Wait for the scanning jobs to produce the next batch
+        if (lua_isyieldable(L))
+        {
+            walk.waiter = getResumeToken(L);
+            return lua_yield(L, 0);
+        }
 
-int writestringtofile(lua_State* L)
-{
-    char writeBuffer[4096];
+        // Generic for loops call the iterator where it cannot yield. The runtime thread is blocked here, so the pumps
+        // scheduled by finished scans cannot run; the iterator keeps the jobs going itself and scans any directory left
+        // over on this thread rather than sitting idle
+        pumpWalk(walk);
 
-    const char* path = luaL_checkstring(L, 1);
-    const char openMode[] = "w+";
-    int openFlags = 0x0000;
-    std::optional<FileHandle> handle = openHelper(L, path, openMode, &openFlags);
-    if (!handle)
-    {
-        luaL_errorL(L, "Error opening file for reading at %s\n", path);
-        return 0;
+        if (!walk.pending.empty())
+        {
+            WalkDirectory directory = std::move(walk.pending.front());
+            walk.pending.pop_front();
+            walk.activeJobs++;
+
+            lock.unlock();
+            scanDirectory(walk.shared_from_this(), directory);
+            lock.lock();
+            continue;
+        }
+
+        walk.scanned.wait(lock);
     }
+}
 
-    int wbSize = sizeof(writeBuffer);
-    memset(writeBuffer, 0, sizeof(writeBuffer));
-    size_t len;
-    const char* stringToWrite = luaL_checklstring(L, 2, &len);
+int walk(lua_State* L)
+{
+    const char* root = luaL_checkstring(L, 1);
 
-    // Set up the buffer to write
-    int numBytesLeftToWrite = len;
-    int offset = 0;
-    uv_buf_t iov;
-    do
-    {
-        // copy stringToWrite[0], numBytesLeftToWrite into write buffer
+    auto walk = std::make_shared<DirectoryWalk>();
+    walk->runtime = getRuntime(L);
 
-        int sizeToWrite = std::min(wbSize, numBytesLeftToWrite);
-        memcpy(writeBuffer, stringToWrite + offset, sizeToWrite);
-        iov = uv_buf_init(writeBuffer, sizeToWrite);
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
 
-        uv_fs_t writeReq;
-        int bytesWritten = 0;
-        uv_fs_write(uv_default_loop(), &writeReq, handle->fileDescriptor, &iov, 1, -1, nullptr);
-        bytesWritten = writeReq.result;
+        lua_getfield(L, 2, "glob");
+        if (lua_isstring(L, -1))
+            walk->glob = lua_tostring(L, -1);
+        lua_pop(L, 1);
 
-        if (bytesWritten < 0)
+        lua_getfield(L, 2, "maxdepth");
+        if (lua_isnumber(L, -1))
         {
-            // Error case.
-            luaL_errorHandle(L, *handle);
-            cleanup(writeBuffer, sizeof(writeBuffer), *handle);
-            return 0;
+            walk->maxDepth = lua_tointeger(L, -1);
+            if (walk->maxDepth < 1)
+                luaL_errorL(L, "maxdepth must be at least 1");
         }
+        lua_pop(L, 1);
 
+        lua_getfield(L, 2, "followsymlinks");
+        walk->followSymlinks = lua_toboolean(L, -1);
+        lua_pop(L, 1);
 
-        offset += bytesWritten;
-        numBytesLeftToWrite -= bytesWritten;
-    } while (numBytesLeftToWrite > 0);
+        lua_getfield(L, 2, "stat");
+        walk->withStat = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
 
-    cleanup(writeBuffer, sizeof(writeBuffer), *handle);
-    return 0;
-}
+    std::string rootPath = root;
+    while (rootPath.size() > 1 && (rootPath.back() == '/' || rootPath.back() == '\\'))
+        rootPath.pop_back();
+
+    new (lua_newuserdatatagged(L, sizeof(std::shared_ptr<DirectoryWalk>), kDirectoryWalkTag)) std::shared_ptr<DirectoryWalk>(walk);
 
-struct ResumeCaptureInformation
-{
-    explicit ResumeCaptureInformation(lua_State* L)
-        : token(getResumeToken(L))
     {
+        std::lock_guard lock(walk->mutex);
+        walk->pending.push_back({rootPath, "", 0});
+        pumpWalk(*walk);
     }
 
-    ResumeToken token = nullptr;
-};
-
-uv_fs_t* createRequest(lua_State* L)
-{
-    uv_fs_t* req = new uv_fs_t();
-    req->data = new ResumeCaptureInformation(L);
-    return req;
+    lua_pushcclosurek(L, nextWalkBatch, "walk_next", 1, nullptr);
+    return 1;
 }
 
-ResumeCaptureInformation* getResumeInformation(uv_fs_t* req)
-{
-    return reinterpret_cast<ResumeCaptureInformation*>(req->data);
-}
+} // namespace fs
 
-int readasync(lua_State* L)
+// Creates the metatable for a tagged userdata type whose methods live in a read-only __index table, leaving it on the stack
+static void createMethodMetatable(lua_State* L, const char* name, const luaL_Reg* methods)
 {
-    const char* path = luaL_checkstring(L, 1);
+    luaL_newmetatable(L, name);
 
-    uv_fs_t* openReq = createRequest(L);
-    uv_fs_open(
-        uv_default_loop(),
-        openReq,
-        path,
-        O_RDONLY,
-        0,
-        [](uv_fs_t* req)
-        {
-            ResumeCaptureInformation* info = getResumeInformation(req);
-            int fd = req->result;
+    lua_newtable(L);
+    for (const luaL_Reg* method = methods; method->name; method++)
+    {
+        lua_pushcfunction(L, method->func, method->name);
+        lua_setfield(L, -2, method->name);
+    }
+    lua_setreadonly(L, -1, 1);
+    lua_setfield(L, -2, "__index");
 
-            if (fd < 0)
-            {
-                info->token->fail("Error opening file");
-                uv_fs_t closeReq;
-                uv_fs_close(uv_default_loop(), &closeReq, fd, nullptr);
-                uv_fs_req_cleanup(req);
-                delete (ResumeCaptureInformation*)req->data;
-                delete req;
-                return;
-            }
+    lua_pushstring(L, name);
+    lua_setfield(L, -2, "__type");
+}
 
-            // Allocate the destination buffer for reading
-            char readBuffer[1024];
-            memset(readBuffer, 0, sizeof(readBuffer));
-            uv_buf_t iov = uv_buf_init(readBuffer, sizeof(readBuffer));
-            // Read data
-            int numBytesRead = 0;
-            uv_fs_t readReq;
-            // Output data
-            std::vector<char> resultData;
-
-            do
-            {
-                uv_fs_read(uv_default_loop(), &readReq, fd, &iov, 1, -1, nullptr);
-                numBytesRead = readReq.result;
+static void initializeFileWriter(lua_State* L)
+{
+    createMethodMetatable(L, "FileWriter", fs::fileWriterMethods);
 
-                if (numBytesRead < 0)
-                {
-                    uv_fs_t closeReq;
-                    uv_fs_close(uv_default_loop(), &closeReq, fd, nullptr);
-                    // Schedule error;
-                    // Also, we should free the original request. We don't have to do this for the read req since it's sycnrhonous
-                    info->token->fail("Error reading file");
-                    uv_fs_req_cleanup(req);
-                    delete (ResumeCaptureInformation*)req->data;
-                    delete req;
-                    return;
-                }
+    // Collecting an open writer still flushes what it buffered, on the thread pool
+    lua_setuserdatadtor(
+        L,
+        kFileWriterTag,
+        [](lua_State* L, void* ud)
+        {
+            auto* writer = static_cast<std::shared_ptr<fs::FileWriter>*>(ud);
+            fs::releaseWriter(*writer);
+            writer->~shared_ptr();
+        }
+    );
 
-                for (int i = 0; i < numBytesRead; i++)
-                    resultData.push_back(readBuffer[i]);
+    lua_setuserdatametatable(L, kFileWriterTag);
+}
 
-            } while (numBytesRead > 0);
+static void initializeMappedFile(lua_State* L)
+{
+    createMethodMetatable(L, "MappedFile", fs::mappedFileMethods);
 
-            // Push the result buffer onto the stack
-            info->token->complete(
-                [data = std::move(resultData)](lua_State* L)
-                {
-                    lua_pushlstring(L, data.data(), data.size());
-                    return 1;
-                }
-            );
+    lua_pushcfunction(L, fs::mappedLen, "MappedFile.__len");
+    lua_setfield(L, -2, "__len");
 
-            uv_fs_t closeReq;
-            uv_fs_close(uv_default_loop(), &closeReq, fd, nullptr);
-            // free the read buffer as well as the resume information and the request
-            delete (ResumeCaptureInformation*)req->data;
-            delete req;
-            return;
+    lua_setuserdatadtor(
+        L,
+        kMappedFileTag,
+        [](lua_State* L, void* ud)
+        {
+            static_cast<fs::MappedFile*>(ud)->~MappedFile();
         }
     );
 
-    return lua_yield(L, 0);
+    lua_setuserdatametatable(L, kMappedFileTag);
 }
 
-} // namespace fs
-
 static void initalizeFS(lua_State* L)
 {
     luaL_newmetatable(L, "WatchHandle");
@@ -1015,6 +3684,36 @@ static void initalizeFS(lua_State* L)
     );
 
     lua_setuserdatametatable(L, kWatchHandleTag);
+
+    initializeMappedFile(L);
+    initializeFileWriter(L);
+
+    // Walks that are abandoned stop queueing directories once collected
+    lua_setuserdatadtor(
+        L,
+        kDirectoryWalkTag,
+        [](lua_State* L, void* ud)
+        {
+            auto* walk = static_cast<std::shared_ptr<fs::DirectoryWalk>*>(ud);
+            {
+                std::lock_guard lock((*walk)->mutex);
+                (*walk)->cancelled = true;
+            }
+            walk->~shared_ptr();
+        }
+    );
+
+    // Iterators that are abandoned before the end of the file close it when collected
+    lua_setuserdatadtor(
+        L,
+        kFileReaderTag,
+        [](lua_State* L, void* ud)
+        {
+            auto* reader = static_cast<std::shared_ptr<fs::FileReader>*>(ud);
+            fs::closeReader(**reader);
+            reader->~shared_ptr();
+        }
+    );
 }
 
 int luaopen_fs(lua_State* L)
@@ -15,9 +15,13 @@ int request(lua_State* L);
 
 int lua_serve(lua_State* L);
 
+/* Creates a handler serving files below a directory from an in-memory cache */
+int lua_static(lua_State* L);
+
 static const luaL_Reg lib[] = {
     {"request", request},
     {"serve", lua_serve},
+    {"static", lua_static},
     {nullptr, nullptr},
 };
 
@@ -1,6 +1,7 @@
 #include "lute/net.h"
 
 #include "lute/runtime.h"
+#include "lute/userdatas.h"
 
 #include "curl/curl.h"
 #include "App.h"
@@ -9,8 +10,23 @@
 
 #include "lua.h"
 #include "lualib.h"
-
+#include "uv.h"
+#include "zlib.h"
+
+#include <algorithm>
+#include <charconv>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <iterator>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -205,23 +221,255 @@ int request(lua_State* L)
 
 using uWSApp = Luau::Variant<std::unique_ptr<uWS::App>, std::unique_ptr<uWS::SSLApp>>;
 
-static const int kEmptyServerKey = 0;
-static Luau::DenseHashMap<int, uWSApp> serverInstances(kEmptyServerKey);
-static Luau::DenseHashMap<int, std::shared_ptr<struct ServerLoopState>> serverStates(kEmptyServerKey);
+// Servers are removed again once they have shut down, so restarting listeners does not grow this
+static std::mutex serversMutex;
+static std::unordered_map<int, std::shared_ptr<struct ServerLoopState>> servers;
 static int nextServerId = 1;
 
+// Log-linear histogram in the spirit of HdrHistogram: values below 16 get a bucket each and every power of two above that is split
+// into 16 sub-buckets, keeping ~6% precision up to 2^40 microseconds with a fixed footprint and constant-time recording
+struct LatencyHistogram
+{
+    static constexpr int kSubBucketBits = 4;
+    static constexpr int kSubBucketCount = 1 << kSubBucketBits;
+    static constexpr int kMaxValueBits = 40;
+    static constexpr int kBucketCount = (kMaxValueBits - kSubBucketBits + 1) * kSubBucketCount;
+
+    uint64_t counts[kBucketCount] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    static int highestBit(uint64_t value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(value);
+#else
+        int bit = 0;
+        while (value >>= 1)
+            bit++;
+        return bit;
+#endif
+    }
+
+    static int bucketIndex(uint64_t value)
+    {
+        if (value < kSubBucketCount)
+            return int(value);
+
+        int bit = highestBit(value);
+        int range = bit - kSubBucketBits + 1;
+        int subBucket = int((value >> (bit - kSubBucketBits)) & (kSubBucketCount - 1));
+        return range * kSubBucketCount + subBucket;
+    }
+
+    // Highest value that is recorded into the bucket
+    static uint64_t bucketUpperBound(int index)
+    {
+        int range = index / kSubBucketCount;
+        uint64_t subBucket = index % kSubBucketCount;
+
+        if (range == 0)
+            return subBucket;
+
+        return ((kSubBucketCount + subBucket + 1) << (range - 1)) - 1;
+    }
+
+    void record(uint64_t value)
+    {
+        value = std::min<uint64_t>(value, (uint64_t(1) << kMaxValueBits) - 1);
+
+        counts[bucketIndex(value)]++;
+        count++;
+        sum += value;
+        max = std::max(max, value);
+    }
+
+    uint64_t percentile(double fraction) const
+    {
+        if (count == 0)
+            return 0;
+
+        uint64_t target = std::max<uint64_t>(1, uint64_t(fraction * double(count) + 0.5));
+        uint64_t seen = 0;
+
+        for (int i = 0; i < kBucketCount; i++)
+        {
+            seen += counts[i];
+            if (seen >= target)
+                return std::min(bucketUpperBound(i), max);
+        }
+
+        return max;
+    }
+};
+
+struct RequestMetrics
+{
+    uint64_t requests = 0;
+    uint64_t aborted = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    // Completed responses by status class, index 0 is 1xx
+    uint64_t statusClasses[5] = {};
+    // Time spent running Luau handlers (or serving static files), in microseconds
+    LatencyHistogram handlerTime;
+
+    void record(int status, uint64_t in, uint64_t out, std::optional<uint64_t> handlerMicros)
+    {
+        requests++;
+        bytesIn += in;
+        bytesOut += out;
+
+        if (status >= 100 && status < 600)
+            statusClasses[status / 100 - 1]++;
+
+        if (handlerMicros)
+            handlerTime.record(*handlerMicros);
+    }
+};
+
+// Counters are plain integers: every server runs on the thread of the runtime that created it
+struct ServerMetrics
+{
+    RequestMetrics total;
+    uint64_t inFlight = 0;
+    // Keyed by route, e.g. "GET /users/:id"; "*" is the fallback handler
+    std::vector<std::pair<std::string, std::shared_ptr<RequestMetrics>>> routes;
+
+    std::shared_ptr<RequestMetrics> addRoute(std::string name)
+    {
+        auto metrics = std::make_shared<RequestMetrics>();
+        routes.emplace_back(std::move(name), metrics);
+        return metrics;
+    }
+};
+
+struct ResponseSummary
+{
+    int status = 200;
+    size_t bytes = 0;
+};
+
+struct RouteDefinition
+{
+    // Uppercase HTTP method, or "*" when the route accepts any method
+    std::string method;
+    std::string pattern;
+    // Names of the ':param' segments of the pattern, in the order uWS exposes them
+    std::vector<std::string> paramNames;
+    std::shared_ptr<Ref> handlerRef;
+    // Set when the handler is a net.static handler, which is then served without entering the VM
+    std::shared_ptr<struct StaticFiles> staticFiles;
+    std::shared_ptr<RequestMetrics> metrics;
+};
+
 struct ServerLoopState
 {
     Luau::Variant<uWS::App*, uWS::SSLApp*> app;
+    // Owns the app above, released from the loop once the server stopped running
+    uWSApp instance;
+    int serverId = 0;
+    us_listen_socket_t* listenSocket = nullptr;
     Runtime* runtime;
     bool running = true;
+    // Set by close({drain = seconds}): no new connections are accepted and responses close their connection until the
+    // in-flight requests are done or the deadline (in uv_hrtime nanoseconds) passes
+    bool draining = false;
+    uint64_t drainDeadline = 0;
+    ResumeToken drainToken;
     std::function<void()> loopFunction;
+    // Fallback handler for requests that do not match any route, may be null when routes are present
     std::shared_ptr<Ref> handlerRef;
+    std::vector<RouteDefinition> routes;
     std::string hostname;
     int port;
     bool reusePort = false;
+    // Largest accepted request body in bytes, 0 for no limit
+    size_t maxBodySize = 0;
+    // Call handlers as soon as headers arrive and let them consume the body in chunks
+    bool streamBody = false;
+    // Negotiate gzip/deflate for handler responses of at least compressMinSize bytes
+    bool compress = false;
+    size_t compressMinSize = 1024;
+    int compressLevel = Z_DEFAULT_COMPRESSION;
+    // Set when the fallback handler is a net.static handler, which is then served without entering the VM
+    std::shared_ptr<struct StaticFiles> staticFiles;
+    std::shared_ptr<ServerMetrics> metrics = std::make_shared<ServerMetrics>();
+    // Path of the native Prometheus text endpoint, empty when disabled
+    std::string metricsPath;
 };
 
+static const char* kSupportedRouteMethods[] = {"GET", "POST", "PUT", "DELETE", "PATCH", "OPTIONS", "HEAD", "CONNECT", "TRACE"};
+
+// Parses a route key of the form "METHOD /path/:param" (or just "/path/:param" for any method)
+static bool parseRouteKey(std::string_view key, RouteDefinition& route)
+{
+    size_t space = key.find(' ');
+
+    if (space == std::string_view::npos)
+    {
+        route.method = "*";
+        route.pattern = std::string(key);
+    }
+    else
+    {
+        route.method = std::string(key.substr(0, space));
+        std::transform(route.method.begin(), route.method.end(), route.method.begin(), ::toupper);
+
+        std::string_view pattern = key.substr(space + 1);
+        while (!pattern.empty() && pattern.front() == ' ')
+            pattern.remove_prefix(1);
+
+        route.pattern = std::string(pattern);
+
+        bool supported = false;
+        for (const char* method : kSupportedRouteMethods)
+            supported = supported || route.method == method;
+
+        if (!supported)
+            return false;
+    }
+
+    if (route.pattern.empty() || route.pattern.front() != '/')
+        return false;
+
+    size_t pos = 0;
+    while ((pos = route.pattern.find("/:", pos)) != std::string::npos)
+    {
+        size_t start = pos + 2;
+        size_t end = route.pattern.find('/', start);
+        route.paramNames.push_back(route.pattern.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        pos = start;
+    }
+
+    return true;
+}
+
+static void registerRoute(auto* app, const std::string& method, const std::string& pattern, auto handler)
+{
+    if (method == "GET")
+        app->get(pattern, std::move(handler));
+    else if (method == "POST")
+        app->post(pattern, std::move(handler));
+    else if (method == "PUT")
+        app->put(pattern, std::move(handler));
+    else if (method == "DELETE")
+        app->del(pattern, std::move(handler));
+    else if (method == "PATCH")
+        app->patch(pattern, std::move(handler));
+    else if (method == "OPTIONS")
+        app->options(pattern, std::move(handler));
+    else if (method == "HEAD")
+        app->head(pattern, std::move(handler));
+    else if (method == "CONNECT")
+        app->connect(pattern, std::move(handler));
+    else if (method == "TRACE")
+        app->trace(pattern, std::move(handler));
+    else
+        app->any(pattern, std::move(handler));
+}
+
 static void parseQuery(const std::string_view& query, lua_State* L)
 {
     lua_createtable(L, 0, 0);
@@ -254,73 +502,215 @@ static void parseQuery(const std::string_view& query, lua_State* L)
     }
 }
 
-static void parseHeaders(auto* req, lua_State* L)
+using StringPairs = std::vector<std::pair<std::string, std::string>>;
+
+static void pushStringPairs(const StringPairs& pairs, lua_State* L)
 {
-    lua_createtable(L, 0, 0);
-    for (const auto& header : *req)
+    lua_createtable(L, 0, int(pairs.size()));
+    for (const auto& [key, value] : pairs)
     {
-        lua_pushlstring(L, header.first.data(), header.first.size());
-        lua_pushlstring(L, header.second.data(), header.second.size());
+        lua_pushlstring(L, key.data(), key.size());
+        lua_pushlstring(L, value.data(), value.size());
         lua_settable(L, -3);
     }
 }
 
-static void handleResponse(auto* res, lua_State* L, int responseIndex)
+enum class ContentEncoding
 {
-    // Check if the response is a string or a table
-    if (lua_isstring(L, responseIndex))
+    Identity,
+    Gzip,
+    Deflate,
+};
+
+struct ResponseOptions
+{
+    // Encoding negotiated from Accept-Encoding, Identity when compression is disabled for the server
+    ContentEncoding encoding = ContentEncoding::Identity;
+    size_t compressMinSize = 0;
+    int compressLevel = Z_DEFAULT_COMPRESSION;
+    bool closeConnection = false;
+};
+
+static bool equalsIgnoreCase(std::string_view lhs, std::string_view rhs)
+{
+    return lhs.size() == rhs.size() && std::equal(
+                                           lhs.begin(),
+                                           lhs.end(),
+                                           rhs.begin(),
+                                           [](char a, char b)
+                                           {
+                                               return ::tolower(a) == ::tolower(b);
+                                           }
+                                       );
+}
+
+static std::string_view trimWhitespace(std::string_view value)
+{
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+        value.remove_prefix(1);
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+        value.remove_suffix(1);
+    return value;
+}
+
+// Picks gzip over deflate when the client accepts both, honouring 'q=0' exclusions
+static ContentEncoding negotiateEncoding(std::string_view acceptEncoding)
+{
+    bool gzip = false;
+    bool deflate = false;
+
+    while (!acceptEncoding.empty())
     {
-        std::string body = lua_tostring(L, responseIndex);
-        res->writeStatus("200 OK");
-        res->writeHeader("Content-Type", "text/html");
-        res->end(body);
-        return;
+        size_t comma = acceptEncoding.find(',');
+        std::string_view item = acceptEncoding.substr(0, comma);
+        acceptEncoding = comma == std::string_view::npos ? std::string_view() : acceptEncoding.substr(comma + 1);
+
+        size_t semicolon = item.find(';');
+        std::string_view name = trimWhitespace(item.substr(0, semicolon));
+
+        if (semicolon != std::string_view::npos)
+        {
+            std::string_view params = item.substr(semicolon + 1);
+            size_t q = params.find("q=");
+            if (q != std::string_view::npos && strtod(std::string(params.substr(q + 2)).c_str(), nullptr) <= 0.0)
+                continue;
+        }
+
+        if (equalsIgnoreCase(name, "gzip") || name == "*")
+            gzip = true;
+        else if (equalsIgnoreCase(name, "deflate"))
+            deflate = true;
     }
 
-    if (!lua_istable(L, responseIndex))
+    if (gzip)
+        return ContentEncoding::Gzip;
+    if (deflate)
+        return ContentEncoding::Deflate;
+    return ContentEncoding::Identity;
+}
+
+static const char* contentEncodingName(ContentEncoding encoding)
+{
+    switch (encoding)
     {
-        res->writeStatus("500 Internal Server Error");
-        res->end("Handler must return a string or a response table");
-        return;
+    case ContentEncoding::Gzip:
+        return "gzip";
+    case ContentEncoding::Deflate:
+        return "deflate";
+    case ContentEncoding::Identity:
+        break;
     }
 
+    return "identity";
+}
 
-    lua_getfield(L, responseIndex, "status");
-    int status = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 200;
-    lua_pop(L, 1);
+// Compresses 'input' in a single deflate pass, returns false if zlib fails or the output would not be smaller
+static bool compressBody(std::string_view input, ContentEncoding encoding, int level, std::string& output)
+{
+    z_stream stream{};
+
+    // 'deflate' in HTTP is the zlib format, gzip adds 16 to the window bits
+    int windowBits = encoding == ContentEncoding::Gzip ? 15 + 16 : 15;
+    if (deflateInit2(&stream, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    output.resize(deflateBound(&stream, static_cast<uLong>(input.size())));
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    stream.avail_in = static_cast<uInt>(input.size());
+    stream.next_out = reinterpret_cast<Bytef*>(output.data());
+    stream.avail_out = static_cast<uInt>(output.size());
+
+    int result = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
 
-    std::string statusText;
+    if (result != Z_STREAM_END || stream.total_out >= input.size())
+        return false;
+
+    output.resize(stream.total_out);
+    return true;
+}
+
+static std::string statusLine(int status)
+{
     switch (status)
     {
     case 200:
-        statusText = "200 OK";
-        break;
+        return "200 OK";
     case 201:
-        statusText = "201 Created";
-        break;
+        return "201 Created";
     case 204:
-        statusText = "204 No Content";
-        break;
+        return "204 No Content";
+    case 304:
+        return "304 Not Modified";
     case 400:
-        statusText = "400 Bad Request";
-        break;
+        return "400 Bad Request";
     case 401:
-        statusText = "401 Unauthorized";
-        break;
+        return "401 Unauthorized";
     case 403:
-        statusText = "403 Forbidden";
-        break;
+        return "403 Forbidden";
     case 404:
-        statusText = "404 Not Found";
-        break;
+        return "404 Not Found";
+    case 405:
+        return "405 Method Not Allowed";
+    case 413:
+        return "413 Payload Too Large";
     case 500:
-        statusText = "500 Internal Server Error";
-        break;
+        return "500 Internal Server Error";
     default:
-        statusText = std::to_string(status) + " Status";
-        break;
+        return std::to_string(status) + " Status";
+    }
+}
+
+// Writes the body, compressing it when the client negotiated an encoding and the handler did not set one itself
+// Returns the number of body bytes written
+static size_t endWithBody(auto* res, std::string_view body, bool hasContentEncoding, const ResponseOptions& options)
+{
+    if (options.encoding != ContentEncoding::Identity && !hasContentEncoding && body.size() >= options.compressMinSize)
+    {
+        res->writeHeader("Vary", "Accept-Encoding");
+
+        std::string compressed;
+        if (compressBody(body, options.encoding, options.compressLevel, compressed))
+        {
+            res->writeHeader("Content-Encoding", contentEncodingName(options.encoding));
+            res->end(compressed, options.closeConnection);
+            return compressed.size();
+        }
+    }
+
+    res->end(body, options.closeConnection);
+    return body.size();
+}
+
+static ResponseSummary handleResponse(auto* res, lua_State* L, int responseIndex, const ResponseOptions& options)
+{
+    // Check if the response is a string or a table
+    if (lua_isstring(L, responseIndex))
+    {
+        size_t length = 0;
+        const char* body = lua_tolstring(L, responseIndex, &length);
+        res->writeStatus("200 OK");
+        res->writeHeader("Content-Type", "text/html");
+        return {200, endWithBody(res, std::string_view(body, length), false, options)};
+    }
+
+    if (!lua_istable(L, responseIndex))
+    {
+        std::string_view message = "Handler must return a string or a response table";
+        res->writeStatus("500 Internal Server Error");
+        res->end(message, options.closeConnection);
+        return {500, message.size()};
     }
-    res->writeStatus(statusText);
+
+
+    lua_getfield(L, responseIndex, "status");
+    int status = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 200;
+    lua_pop(L, 1);
+
+    res->writeStatus(statusLine(status));
+
+    bool hasContentEncoding = false;
 
     lua_getfield(L, responseIndex, "headers");
     if (lua_istable(L, -1))
@@ -332,6 +722,7 @@ static void handleResponse(auto* res, lua_State* L, int responseIndex)
             {
                 std::string headerName = lua_tostring(L, -2);
                 std::string headerValue = lua_tostring(L, -1);
+                hasContentEncoding = hasContentEncoding || equalsIgnoreCase(headerName, "content-encoding");
                 res->writeHeader(headerName, headerValue);
             }
             lua_pop(L, 1);
@@ -340,170 +731,1761 @@ static void handleResponse(auto* res, lua_State* L, int responseIndex)
     lua_pop(L, 1);
 
     lua_getfield(L, responseIndex, "body");
-    std::string body = lua_isstring(L, -1) ? lua_tostring(L, -1) : "";
+    size_t length = 0;
+    const char* body = lua_isstring(L, -1) ? lua_tolstring(L, -1, &length) : "";
+    // The body stays on the stack until it has been written
+    size_t written = endWithBody(res, std::string_view(body, length), hasContentEncoding, options);
     lua_pop(L, 1);
 
-    res->end(body);
+    return {status, written};
 }
 
-static void processRequest(
-    std::shared_ptr<ServerLoopState> state,
-    auto* res,
-    auto* req,
-    const std::string& method,
-    const std::string_view& path,
-    const std::string_view& query,
-    const std::string_view& body
-)
+struct StaticFile
 {
-    lua_State* L = lua_newthread(state->runtime->GL);
-    luaL_sandboxthread(L);
-    std::shared_ptr<Ref> threadRef = getRefForThread(L);
-    lua_pop(state->runtime->GL, 1);
+    // Empty for files too large to cache, which are streamed from 'path' instead
+    std::string identity;
+    // Precompressed variant, empty when the type is not compressible or gzip does not make it smaller
+    std::string gzip;
+    std::string etag;
+    std::string lastModified;
+    const char* contentType = "application/octet-stream";
+    std::string path;
+    uint64_t size = 0;
+    bool streamed = false;
+};
 
-    lua_createtable(L, 0, 5);
+struct StaticDirectoryWatch
+{
+    uv_fs_event_t handle;
+    std::string directory;
+    struct StaticFiles* owner = nullptr;
+};
 
-    lua_pushstring(L, "method");
-    lua_pushstring(L, method.c_str());
-    lua_settable(L, -3);
+struct StaticCacheEntry
+{
+    std::shared_ptr<StaticFile> file;
+    // Position in StaticFiles::recent
+    std::list<std::string>::iterator recent;
+};
 
-    lua_pushstring(L, "path");
-    lua_pushlstring(L, path.data(), path.size());
-    lua_settable(L, -3);
+// Default budget for the contents of a net.static cache, both variants of a file count towards it
+static constexpr size_t kDefaultStaticCacheSize = 64 * 1024 * 1024;
 
-    lua_pushstring(L, "query");
-    parseQuery(query, L);
-    lua_settable(L, -3);
+// File cache behind a net.static handler, entries are dropped when the watch on their directory reports a change and
+// the least recently served ones are evicted to keep the cached contents within maxCacheSize
+struct StaticFiles
+{
+    std::string root;
+    // Leading part of the request path that is stripped before resolving it under 'root'
+    std::string prefix;
+    // Loop of the runtime that created the handler, the directory watches live on it
+    uv_loop_t* loop = nullptr;
 
-    lua_pushstring(L, "headers");
-    parseHeaders(req, L);
-    lua_settable(L, -3);
+    std::unordered_map<std::string, StaticCacheEntry> cache;
+    // Cached paths, most recently served first
+    std::list<std::string> recent;
+    size_t cacheSize = 0;
+    size_t maxCacheSize = kDefaultStaticCacheSize;
 
-    lua_pushstring(L, "body");
-    lua_pushlstring(L, body.data(), body.size());
-    lua_settable(L, -3);
+    std::map<std::string, StaticDirectoryWatch*> watches;
+
+    ~StaticFiles()
+    {
+        for (auto& [directory, watch] : watches)
+        {
+            watch->owner = nullptr;
+            uv_fs_event_stop(&watch->handle);
+            uv_close(
+                reinterpret_cast<uv_handle_t*>(&watch->handle),
+                [](uv_handle_t* handle)
+                {
+                    delete static_cast<StaticDirectoryWatch*>(handle->data);
+                }
+            );
+        }
+    }
+};
 
-    state->handlerRef->push(L);
+// Files above this size are still served, but streamed from disk in pieces on every request and never compressed
+static constexpr size_t kMaxCachedStaticFileSize = 8 * 1024 * 1024;
+static constexpr size_t kMinCompressedStaticFileSize = 256;
+static constexpr size_t kStaticStreamChunkSize = 64 * 1024;
 
-    lua_pushvalue(L, -2);
-    lua_remove(L, -3);
+struct StaticContentType
+{
+    const char* extension;
+    const char* contentType;
+    bool compressible;
+};
 
-    int status = lua_resume(L, nullptr, 1);
-    if (status != LUA_OK && status != LUA_YIELD)
-    {
-        std::string error = lua_tostring(L, -1);
-        lua_pop(L, 1);
+static const StaticContentType kStaticContentTypes[] = {
+    {"html", "text/html; charset=utf-8", true},
+    {"htm", "text/html; charset=utf-8", true},
+    {"css", "text/css; charset=utf-8", true},
+    {"js", "text/javascript; charset=utf-8", true},
+    {"mjs", "text/javascript; charset=utf-8", true},
+    {"json", "application/json", true},
+    {"map", "application/json", true},
+    {"txt", "text/plain; charset=utf-8", true},
+    {"xml", "application/xml", true},
+    {"svg", "image/svg+xml", true},
+    {"wasm", "application/wasm", true},
+    {"ico", "image/x-icon", true},
+    {"png", "image/png", false},
+    {"jpg", "image/jpeg", false},
+    {"jpeg", "image/jpeg", false},
+    {"gif", "image/gif", false},
+    {"webp", "image/webp", false},
+    {"woff", "font/woff", false},
+    {"woff2", "font/woff2", false},
+    {"pdf", "application/pdf", false},
+    {"mp4", "video/mp4", false},
+};
 
-        res->writeStatus("500 Internal Server Error");
-        res->end("Server error: " + error);
-        return;
-    }
+static const StaticContentType* staticContentTypeFor(std::string_view path)
+{
+    size_t dot = path.rfind('.');
+    if (dot == std::string_view::npos || path.find('/', dot) != std::string_view::npos)
+        return nullptr;
 
-    handleResponse(res, L, -1);
+    std::string_view extension = path.substr(dot + 1);
+    for (const StaticContentType& type : kStaticContentTypes)
+    {
+        if (equalsIgnoreCase(extension, type.extension))
+            return &type;
+    }
 
-    lua_pop(L, 1);
+    return nullptr;
 }
 
-void setupAppAndListen(auto* app, std::shared_ptr<ServerLoopState> state, bool& success)
+static std::string httpDate(int64_t seconds)
 {
-    app->any(
-        "/*",
-        [state](auto* res, auto* req)
-        {
-            std::string method = std::string(req->getMethod());
-            std::transform(method.begin(), method.end(), method.begin(), ::toupper);
-            std::string_view url = req->getFullUrl();
-            std::string_view path = url;
+    time_t time = static_cast<time_t>(seconds);
+    std::tm tm{};
+#ifdef _WIN32
+    gmtime_s(&tm, &time);
+#else
+    gmtime_r(&time, &tm);
+#endif
+
+    char buffer[64];
+    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buffer;
+}
 
-            // Split URL into path and query
-            size_t queryPos = url.find('?');
-            std::string query;
-            if (queryPos != std::string::npos)
-            {
-                path = std::string_view(url.data(), queryPos);
-                query = std::string_view(url.data() + queryPos, url.size() - queryPos);
-            }
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
 
-            res->onAborted(
-                []()
-                {
-                    // TODO: handle aborted requests
-                }
-            );
+// Percent-decodes a request path and rejects anything that could escape the static root
+static std::optional<std::string> decodeStaticPath(std::string_view path)
+{
+    std::string decoded;
+    decoded.reserve(path.size());
 
-            std::unique_ptr<std::string> bodyBuffer;
-            res->onData(
-                [state, res, req, method, path, query, bodyBuffer = std::move(bodyBuffer)](std::string_view data, bool last) mutable
-                {
-                    if (last)
-                    {
-                        if (bodyBuffer.get())
-                        {
-                            bodyBuffer->append(data);
-                            processRequest(state, res, req, method, path, query, *bodyBuffer);
-                        }
-                        else
-                        {
-                            processRequest(state, res, req, method, path, query, data);
-                        }
-                    }
-                    else
-                    {
-                        if (bodyBuffer.get())
-                        {
-                            bodyBuffer->append(data);
-                        }
-                        else
-                        {
-                            bodyBuffer = std::make_unique<std::string>(data);
-                        }
-                    }
-                }
-            );
+    for (size_t i = 0; i < path.size(); i++)
+    {
+        if (path[i] == '%' && i + 2 < path.size() && hexValue(path[i + 1]) >= 0 && hexValue(path[i + 2]) >= 0)
+        {
+            decoded.push_back(static_cast<char>(hexValue(path[i + 1]) * 16 + hexValue(path[i + 2])));
+            i += 2;
         }
-    );
-
-    int options = state->reusePort ? LIBUS_LISTEN_DEFAULT : LIBUS_LISTEN_EXCLUSIVE_PORT;
-
-    app->listen(
-        state->hostname,
-        state->port,
-        options,
-        [&success](auto* listen_socket)
+        else
         {
-            success = (listen_socket != nullptr);
+            decoded.push_back(path[i]);
         }
-    );
-}
+    }
 
-bool closeServer(int serverId)
-{
-    if (!serverInstances.contains(serverId) || !serverStates.contains(serverId))
+    if (decoded.find('\0') != std::string::npos || decoded.find('\\') != std::string::npos)
+        return std::nullopt;
+
+    size_t start = 0;
+    while (start <= decoded.size())
     {
-        return false;
+        size_t end = decoded.find('/', start);
+        std::string_view segment = std::string_view(decoded).substr(start, end == std::string::npos ? std::string::npos : end - start);
+        if (segment == "..")
+            return std::nullopt;
+
+        if (end == std::string::npos)
+            break;
+        start = end + 1;
     }
 
-    Luau::visit(
-        [](auto* appPtr)
+    return decoded;
+}
+
+static size_t cachedStaticFileSize(const StaticFile& file)
+{
+    return file.identity.size() + file.gzip.size();
+}
+
+static std::unordered_map<std::string, StaticCacheEntry>::iterator evictStaticFile(
+    StaticFiles& files,
+    std::unordered_map<std::string, StaticCacheEntry>::iterator it
+)
+{
+    files.cacheSize -= cachedStaticFileSize(*it->second.file);
+    files.recent.erase(it->second.recent);
+    return files.cache.erase(it);
+}
+
+static std::shared_ptr<StaticFile> findCachedStaticFile(StaticFiles& files, const std::string& path)
+{
+    auto it = files.cache.find(path);
+    if (it == files.cache.end())
+        return nullptr;
+
+    files.recent.splice(files.recent.begin(), files.recent, it->second.recent);
+    return it->second.file;
+}
+
+static void watchStaticDirectory(StaticFiles& files, const std::string& directory);
+
+// Adds a file that was read on the thread pool, making room for it by evicting the least recently served files
+static void cacheStaticFile(StaticFiles& files, const std::string& path, std::shared_ptr<StaticFile> file)
+{
+    // Another request for the same path may have been read at the same time
+    if (auto it = files.cache.find(path); it != files.cache.end())
+        evictStaticFile(files, it);
+
+    size_t size = cachedStaticFileSize(*file);
+    if (file->streamed || size > files.maxCacheSize)
+        return;
+
+    while (files.cacheSize + size > files.maxCacheSize && !files.recent.empty())
+        evictStaticFile(files, files.cache.find(files.recent.back()));
+
+    files.recent.push_front(path);
+    files.cache[path] = {std::move(file), files.recent.begin()};
+    files.cacheSize += size;
+
+    watchStaticDirectory(files, path.substr(0, path.rfind('/')));
+}
+
+static void watchStaticDirectory(StaticFiles& files, const std::string& directory)
+{
+    if (files.watches.count(directory))
+        return;
+
+    auto* watch = new StaticDirectoryWatch();
+    watch->directory = directory;
+    watch->owner = &files;
+    watch->handle.data = watch;
+
+    if (uv_fs_event_init(files.loop, &watch->handle) != 0)
+    {
+        delete watch;
+        return;
+    }
+
+    int err = uv_fs_event_start(
+        &watch->handle,
+        [](uv_fs_event_t* handle, const char* filename, int events, int status)
+        {
+            auto* watch = static_cast<StaticDirectoryWatch*>(handle->data);
+            if (!watch->owner)
+                return;
+
+            StaticFiles& files = *watch->owner;
+            if (!filename || status < 0)
+            {
+                // Without a file name the whole directory has to be considered stale
+                std::string prefix = watch->directory + "/";
+                for (auto it = files.cache.begin(); it != files.cache.end();)
+                    it = it->first.compare(0, prefix.size(), prefix) == 0 ? evictStaticFile(files, it) : std::next(it);
+                return;
+            }
+
+            if (auto it = files.cache.find(watch->directory + "/" + filename); it != files.cache.end())
+                evictStaticFile(files, it);
+        },
+        directory.c_str(),
+        0
+    );
+
+    if (err != 0)
+    {
+        uv_close(
+            reinterpret_cast<uv_handle_t*>(&watch->handle),
+            [](uv_handle_t* handle)
+            {
+                delete static_cast<StaticDirectoryWatch*>(handle->data);
+            }
+        );
+        return;
+    }
+
+    // The watch must not keep the runtime alive on its own
+    uv_unref(reinterpret_cast<uv_handle_t*>(&watch->handle));
+
+    files.watches[directory] = watch;
+}
+
+// Reads up to out.size() bytes at offset, stopping early at the end of the file. Returns how many were read
+static size_t readStaticRange(uv_file fd, std::string& out, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < out.size())
+    {
+        uv_buf_t iov = uv_buf_init(out.data() + done, static_cast<unsigned int>(out.size() - done));
+
+        uv_fs_t readReq;
+        int bytesRead = uv_fs_read(uv_default_loop(), &readReq, fd, &iov, 1, static_cast<int64_t>(offset + done), nullptr);
+        uv_fs_req_cleanup(&readReq);
+
+        if (bytesRead <= 0)
+            break;
+
+        done += bytesRead;
+    }
+
+    return done;
+}
+
+static uv_file openStaticFile(const std::string& path)
+{
+    uv_fs_t openReq;
+    int fd = uv_fs_open(uv_default_loop(), &openReq, path.c_str(), O_RDONLY, 0, nullptr);
+    uv_fs_req_cleanup(&openReq);
+
+    return fd;
+}
+
+static void closeStaticFile(uv_file fd)
+{
+    uv_fs_t closeReq;
+    uv_fs_close(uv_default_loop(), &closeReq, fd, nullptr);
+    uv_fs_req_cleanup(&closeReq);
+}
+
+// Reads a file for the cache, on the thread pool. Files too large to cache are only stat'ed here, so the size is checked
+// before anything is read or compressed
+static std::shared_ptr<StaticFile> readStaticFile(const std::string& path, size_t maxCacheSize)
+{
+    uv_file fd = openStaticFile(path);
+    if (fd < 0)
+        return nullptr;
+
+    uv_fs_t statReq;
+    int err = uv_fs_fstat(uv_default_loop(), &statReq, fd, nullptr);
+    uv_stat_t stat = statReq.statbuf;
+    uv_fs_req_cleanup(&statReq);
+
+    if (err != 0 || (stat.st_mode & S_IFMT) != S_IFREG)
+    {
+        closeStaticFile(fd);
+        return nullptr;
+    }
+
+    auto file = std::make_shared<StaticFile>();
+    file->path = path;
+    file->size = stat.st_size;
+    file->streamed = file->size > std::min(kMaxCachedStaticFileSize, maxCacheSize);
+
+    if (!file->streamed)
+    {
+        file->identity.resize(file->size);
+
+        // The file may have shrunk since it was stat'ed
+        file->identity.resize(readStaticRange(fd, file->identity, 0));
+        file->size = file->identity.size();
+    }
+
+    closeStaticFile(fd);
+
+    char etag[64];
+    snprintf(
+        etag,
+        sizeof(etag),
+        "W/\"%llx-%llx\"",
+        static_cast<unsigned long long>(file->size),
+        static_cast<unsigned long long>(stat.st_mtim.tv_sec) * 1000 + stat.st_mtim.tv_nsec / 1000000
+    );
+    file->etag = etag;
+    file->lastModified = httpDate(stat.st_mtim.tv_sec);
+
+    if (const StaticContentType* type = staticContentTypeFor(path))
+    {
+        file->contentType = type->contentType;
+
+        // Only cached files are compressed, once, so the extra time of the best level is paid a single time
+        if (type->compressible && !file->streamed && file->identity.size() >= kMinCompressedStaticFileSize)
+        {
+            if (!compressBody(file->identity, ContentEncoding::Gzip, Z_BEST_COMPRESSION, file->gzip))
+                file->gzip.clear();
+        }
+    }
+
+    return file;
+}
+
+// Maps a request path to the file it names below the root, or nothing when it is outside the prefix or the root
+static std::optional<std::string> resolveStaticPath(const StaticFiles& files, std::string_view requestPath)
+{
+    if (!files.prefix.empty())
+    {
+        if (requestPath.substr(0, files.prefix.size()) != files.prefix)
+            return std::nullopt;
+
+        requestPath.remove_prefix(files.prefix.size());
+    }
+
+    std::optional<std::string> relative = decodeStaticPath(requestPath);
+    if (!relative)
+        return std::nullopt;
+
+    if (relative->empty() || relative->back() == '/')
+        *relative += "index.html";
+
+    if (relative->front() != '/')
+        relative->insert(relative->begin(), '/');
+
+    return files.root + *relative;
+}
+
+static bool etagMatches(std::string_view ifNoneMatch, std::string_view etag)
+{
+    // Weak comparison, as the cached variants share a weak validator
+    auto stripWeak = [](std::string_view tag)
+    {
+        return tag.substr(0, 2) == "W/" ? tag.substr(2) : tag;
+    };
+
+    while (!ifNoneMatch.empty())
+    {
+        size_t comma = ifNoneMatch.find(',');
+        std::string_view candidate = trimWhitespace(ifNoneMatch.substr(0, comma));
+        ifNoneMatch = comma == std::string_view::npos ? std::string_view() : ifNoneMatch.substr(comma + 1);
+
+        if (candidate == "*" || stripWeak(candidate) == stripWeak(etag))
+            return true;
+    }
+
+    return false;
+}
+
+struct StaticLookup
+{
+    int status = 404;
+    std::shared_ptr<StaticFile> file;
+    bool gzip = false;
+
+    std::string_view body() const
+    {
+        return gzip ? file->gzip : file->identity;
+    }
+};
+
+// Headers of a static request that decide the response, copied out since a miss is answered after the request is gone
+struct StaticConditions
+{
+    std::string ifNoneMatch;
+    std::string ifModifiedSince;
+    std::string acceptEncoding;
+};
+
+static StaticLookup lookupStatic(std::shared_ptr<StaticFile> file, const StaticConditions& conditions)
+{
+    std::string_view ifNoneMatch = conditions.ifNoneMatch;
+    std::string_view ifModifiedSince = conditions.ifModifiedSince;
+    std::string_view acceptEncoding = conditions.acceptEncoding;
+
+    StaticLookup lookup;
+    lookup.file = std::move(file);
+
+    if (!lookup.file)
+        return lookup;
+
+    lookup.gzip = !lookup.file->gzip.empty() && negotiateEncoding(acceptEncoding) == ContentEncoding::Gzip;
+
+    // If-None-Match takes precedence over If-Modified-Since when both are present
+    bool notModified = !ifNoneMatch.empty() ? etagMatches(ifNoneMatch, lookup.file->etag) : ifModifiedSince == lookup.file->lastModified;
+    lookup.status = notModified ? 304 : 200;
+
+    return lookup;
+}
+
+// A file too large for the cache on its way to one client. Only one piece of it is in memory at a time
+struct StaticFileStream
+{
+    uv_file fd = -1;
+    uint64_t size = 0;
+    // The piece being sent and where it starts in the file
+    std::string chunk;
+    uint64_t chunkOffset = 0;
+    bool aborted = false;
+
+    ~StaticFileStream()
+    {
+        if (fd >= 0)
+            closeStaticFile(fd);
+    }
+};
+
+// Sends the file from offset on until uWS pushes back or everything is sent. Returns false on backpressure, in which case
+// onWritable picks up again from the offset uWS reached
+static bool pumpStaticFile(auto* res, StaticFileStream& stream, uint64_t offset)
+{
+    while (true)
+    {
+        if (offset < stream.chunkOffset || offset >= stream.chunkOffset + stream.chunk.size())
+        {
+            stream.chunkOffset = offset;
+            stream.chunk.resize(static_cast<size_t>(std::min<uint64_t>(kStaticStreamChunkSize, stream.size - offset)));
+
+            // The file shrank after it was stat'ed, so the promised length can no longer be sent
+            if (readStaticRange(stream.fd, stream.chunk, offset) < stream.chunk.size())
+            {
+                res->close();
+                return true;
+            }
+        }
+
+        std::string_view rest = std::string_view(stream.chunk).substr(static_cast<size_t>(offset - stream.chunkOffset));
+        auto [ok, done] = res->tryEnd(rest, stream.size);
+        if (done)
+            return true;
+        if (!ok)
+            return false;
+
+        offset = res->getWriteOffset();
+    }
+}
+
+// Starts sending a file that is not cached, from an fd the stream takes over
+static void streamStaticFile(const StaticFile& file, uv_file fd, auto* res)
+{
+    auto stream = std::make_shared<StaticFileStream>();
+    stream->fd = fd;
+    stream->size = file.size;
+
+    res->onAborted(
+        [stream]()
+        {
+            stream->aborted = true;
+        }
+    );
+
+    if (!pumpStaticFile(res, *stream, 0))
+    {
+        res->onWritable(
+            [res, stream](uintmax_t offset)
+            {
+                return stream->aborted || pumpStaticFile(res, *stream, offset);
+            }
+        );
+    }
+}
+
+// Writes the response for a static lookup, streaming files that are too large to cache
+static ResponseSummary sendStatic(StaticLookup& lookup, bool head, auto* res)
+{
+    // Opened before anything is written, so a file that went away since it was stat'ed still gets a clean 404
+    uv_file streamFd = -1;
+    if (lookup.file && lookup.file->streamed && lookup.status == 200 && !head)
+    {
+        streamFd = openStaticFile(lookup.file->path);
+        if (streamFd < 0)
+            lookup.file = nullptr;
+    }
+
+    if (!lookup.file)
+    {
+        res->writeStatus("404 Not Found");
+        res->end("Not Found");
+        return {404, 9};
+    }
+
+    res->writeStatus(statusLine(lookup.status));
+    res->writeHeader("ETag", lookup.file->etag);
+    res->writeHeader("Last-Modified", lookup.file->lastModified);
+
+    if (!lookup.file->gzip.empty())
+        res->writeHeader("Vary", "Accept-Encoding");
+
+    if (lookup.status == 304)
+    {
+        res->endWithoutBody();
+        return {304, 0};
+    }
+
+    res->writeHeader("Content-Type", lookup.file->contentType);
+
+    if (lookup.gzip)
+        res->writeHeader("Content-Encoding", "gzip");
+
+    if (head)
+    {
+        res->endWithoutBody(lookup.file->streamed ? lookup.file->size : lookup.body().size());
+        return {200, 0};
+    }
+
+    if (lookup.file->streamed)
+    {
+        streamStaticFile(*lookup.file, streamFd, res);
+        return {200, lookup.file->size};
+    }
+
+    res->end(lookup.body());
+    return {200, lookup.body().size()};
+}
+
+// Serves a net.static route without entering the VM. Hits are answered from the cache right away; misses are read on the
+// thread pool and answered from the uWS loop through defer, keeping the server responsive while a file is read
+static void serveStatic(Runtime* runtime, std::shared_ptr<StaticFiles> files, auto* res, auto* req, std::function<void(ResponseSummary)> done)
+{
+    StaticConditions conditions;
+    conditions.ifNoneMatch = req->getHeader("if-none-match");
+    conditions.ifModifiedSince = req->getHeader("if-modified-since");
+    conditions.acceptEncoding = req->getHeader("accept-encoding");
+
+    bool head = equalsIgnoreCase(req->getMethod(), "head");
+
+    std::optional<std::string> path = resolveStaticPath(*files, req->getUrl());
+    std::shared_ptr<StaticFile> cached = path ? findCachedStaticFile(*files, *path) : nullptr;
+
+    if (!path || cached)
+    {
+        StaticLookup lookup = lookupStatic(std::move(cached), conditions);
+        done(sendStatic(lookup, head, res));
+        return;
+    }
+
+    auto aborted = std::make_shared<bool>(false);
+    res->onAborted(
+        [aborted]()
+        {
+            *aborted = true;
+        }
+    );
+
+    uWS::Loop* loop = uWS::Loop::get();
+    size_t maxCacheSize = files->maxCacheSize;
+
+    runtime->runInWorkQueue(
+        [=]
+        {
+            std::shared_ptr<StaticFile> file = readStaticFile(*path, maxCacheSize);
+
+            loop->defer(
+                [=]()
+                {
+                    if (file)
+                        cacheStaticFile(*files, *path, file);
+
+                    if (*aborted)
+                        return;
+
+                    res->cork(
+                        [&]()
+                        {
+                            StaticLookup lookup = lookupStatic(file, conditions);
+                            done(sendStatic(lookup, head, res));
+                        }
+                    );
+                }
+            );
+        }
+    );
+}
+
+static std::shared_ptr<StaticFiles>* getStaticFilesUpvalue(lua_State* L)
+{
+    return static_cast<std::shared_ptr<StaticFiles>*>(lua_touserdatatagged(L, lua_upvalueindex(1), kStaticFilesTag));
+}
+
+// Reads the whole body of a file too large to cache, for a response that has to carry it as one string
+static std::string readWholeStaticFile(const StaticFile& file)
+{
+    std::string body(static_cast<size_t>(file.size), '\0');
+    uv_file fd = openStaticFile(file.path);
+    if (fd >= 0)
+    {
+        body.resize(readStaticRange(fd, body, 0));
+        closeStaticFile(fd);
+    }
+
+    return body;
+}
+
+// Pushes the response table for a lookup; 'streamedBody' is the contents of a file too large to cache
+static int pushStaticResponse(lua_State* L, const StaticLookup& lookup, std::string_view streamedBody)
+{
+    lua_createtable(L, 0, 3);
+
+    lua_pushinteger(L, lookup.file ? lookup.status : 404);
+    lua_setfield(L, -2, "status");
+
+    if (!lookup.file)
+    {
+        lua_pushstring(L, "Not Found");
+        lua_setfield(L, -2, "body");
+        return 1;
+    }
+
+    lua_createtable(L, 0, 5);
+
+    lua_pushlstring(L, lookup.file->etag.data(), lookup.file->etag.size());
+    lua_setfield(L, -2, "ETag");
+
+    lua_pushlstring(L, lookup.file->lastModified.data(), lookup.file->lastModified.size());
+    lua_setfield(L, -2, "Last-Modified");
+
+    lua_pushstring(L, lookup.file->contentType);
+    lua_setfield(L, -2, "Content-Type");
+
+    if (!lookup.file->gzip.empty())
+    {
+        lua_pushstring(L, "Accept-Encoding");
+        lua_setfield(L, -2, "Vary");
+    }
+
+    // Always set so the server does not try to compress the body again
+    lua_pushstring(L, lookup.gzip ? "gzip" : "identity");
+    lua_setfield(L, -2, "Content-Encoding");
+
+    lua_setfield(L, -2, "headers");
+
+    if (lookup.status == 200)
+    {
+        std::string_view body = lookup.file->streamed ? streamedBody : lookup.body();
+        lua_pushlstring(L, body.data(), body.size());
+        lua_setfield(L, -2, "body");
+    }
+
+    return 1;
+}
+
+// Luau entry point of a net.static handler, used when it is called directly instead of being routed natively.
+// Misses are read on the thread pool when the caller can yield
+static int staticHandlerCall(lua_State* L)
+{
+    std::shared_ptr<StaticFiles> files = *getStaticFilesUpvalue(L);
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "path");
+    std::string requestPath = luaL_checkstring(L, -1);
+    lua_pop(L, 1);
+
+    StaticConditions conditions;
+
+    lua_getfield(L, 1, "headers");
+    if (lua_istable(L, -1))
+    {
+        auto readHeader = [L](const char* name, std::string& out)
+        {
+            lua_getfield(L, -1, name);
+            if (lua_isstring(L, -1))
+                out = lua_tostring(L, -1);
+            lua_pop(L, 1);
+        };
+
+        readHeader("if-none-match", conditions.ifNoneMatch);
+        readHeader("if-modified-since", conditions.ifModifiedSince);
+        readHeader("accept-encoding", conditions.acceptEncoding);
+    }
+    lua_pop(L, 1);
+
+    std::optional<std::string> path = resolveStaticPath(*files, requestPath);
+    std::shared_ptr<StaticFile> cached = path ? findCachedStaticFile(*files, *path) : nullptr;
+
+    if (!path || cached || !lua_isyieldable(L))
+    {
+        std::shared_ptr<StaticFile> file = cached;
+        if (path && !file)
+        {
+            file = readStaticFile(*path, files->maxCacheSize);
+            if (file)
+                cacheStaticFile(*files, *path, file);
+        }
+
+        StaticLookup lookup = lookupStatic(std::move(file), conditions);
+        std::string streamedBody = lookup.file && lookup.file->streamed && lookup.status == 200 ? readWholeStaticFile(*lookup.file) : "";
+        return pushStaticResponse(L, lookup, streamedBody);
+    }
+
+    auto token = getResumeToken(L);
+    size_t maxCacheSize = files->maxCacheSize;
+
+    token->runtime->runInWorkQueue(
+        [=]
+        {
+            std::shared_ptr<StaticFile> file = readStaticFile(*path, maxCacheSize);
+            StaticLookup lookup = lookupStatic(file, conditions);
+            std::string streamedBody = lookup.file && lookup.file->streamed && lookup.status == 200 ? readWholeStaticFile(*lookup.file) : "";
+
+            token->complete(
+                [=](lua_State* L)
+                {
+                    // The cache belongs to the runtime thread, so the file is only added once the handler resumes
+                    if (file)
+                        cacheStaticFile(*files, *path, file);
+
+                    return pushStaticResponse(L, lookup, streamedBody);
+                }
+            );
+        }
+    );
+
+    return lua_yield(L, 0);
+}
+
+// Returns the file cache if the value at 'idx' is a handler created by net.static
+static std::shared_ptr<StaticFiles> toStaticFiles(lua_State* L, int idx)
+{
+    if (lua_tocfunction(L, idx) != staticHandlerCall)
+        return nullptr;
+
+    lua_getupvalue(L, idx, 1);
+    auto* files = static_cast<std::shared_ptr<StaticFiles>*>(lua_touserdatatagged(L, -1, kStaticFilesTag));
+    std::shared_ptr<StaticFiles> result = files ? *files : nullptr;
+    lua_pop(L, 1);
+
+    return result;
+}
+
+int lua_static(lua_State* L)
+{
+    std::string root = luaL_checkstring(L, 1);
+
+    while (root.size() > 1 && (root.back() == '/' || root.back() == '\\'))
+        root.pop_back();
+
+    auto files = std::make_shared<StaticFiles>();
+    files->root = std::move(root);
+    files->loop = &getRuntime(L)->loop;
+
+    if (lua_istable(L, 2))
+    {
+        lua_getfield(L, 2, "prefix");
+        if (lua_isstring(L, -1))
+            files->prefix = lua_tostring(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "cachesize");
+        if (lua_isnumber(L, -1))
+        {
+            double cacheSize = lua_tonumber(L, -1);
+            if (cacheSize < 0)
+                luaL_errorL(L, "cachesize cannot be negative");
+            files->maxCacheSize = static_cast<size_t>(cacheSize);
+        }
+        lua_pop(L, 1);
+    }
+
+    new (lua_newuserdatatagged(L, sizeof(std::shared_ptr<StaticFiles>), kStaticFilesTag)) std::shared_ptr<StaticFiles>(std::move(files));
+    lua_pushcclosurek(L, staticHandlerCall, "static_handler", 1, nullptr);
+
+    return 1;
+}
+
+// Everything the Luau handler sees about a request; uWS only keeps the HttpRequest alive during the route handler,
+// so it is copied out before any body data arrives
+struct ServerRequest
+{
+    std::string method;
+    std::string path;
+    std::string query;
+    StringPairs params;
+    StringPairs headers;
+
+    std::string body;
+    size_t receivedBytes = 0;
+
+    // Set when the handler of a streaming server returned a function to consume the body chunks
+    std::shared_ptr<Ref> bodyReader;
+
+    ContentEncoding acceptedEncoding = ContentEncoding::Identity;
+
+    std::shared_ptr<RequestMetrics> routeMetrics;
+    // Accumulated across the handler and body reader calls, in microseconds
+    uint64_t handlerTime = 0;
+    bool ranHandler = false;
+
+    // Set while the handler or a body reader call is suspended, chunks that arrive meanwhile wait in pendingChunks
+    bool handlerRunning = false;
+    std::deque<std::pair<std::string, bool>> pendingChunks;
+
+    bool aborted = false;
+    bool responded = false;
+};
+
+struct HandlerCall
+{
+    std::shared_ptr<Ref> threadRef;
+    lua_State* L = nullptr;
+    int status = LUA_OK;
+    uint64_t elapsedMicros = 0;
+    // The handler yielded, so it finished from the runtime rather than inside the uWS callback that started it
+    bool resumed = false;
+
+    bool failed() const
+    {
+        return status != LUA_OK;
+    }
+
+    bool hasResult() const
+    {
+        return !failed() && lua_gettop(L) > 0 && !lua_isnil(L, -1);
+    }
+};
+
+// Runs 'func' on a fresh sandboxed thread and passes the finished call to 'done', with the results (or error) on top of
+// the thread stack. A handler that yields (in fs, task.wait, ...) is finished by the runtime once its thread completes;
+// it runs under pcall so that an error raised after the yield still reaches 'done' instead of the runtime.
+static void callHandler(ServerLoopState& state, const std::shared_ptr<Ref>& func, auto pushArgs, std::function<void(HandlerCall&)> done)
+{
+    lua_State* L = lua_newthread(state.runtime->GL);
+    luaL_sandboxthread(L);
+
+    auto call = std::make_shared<HandlerCall>();
+    call->threadRef = getRefForThread(L);
+    call->L = L;
+    lua_pop(state.runtime->GL, 1);
+
+    lua_getglobal(L, "pcall");
+    func->push(L);
+    int nargs = pushArgs(L);
+
+    uint64_t start = uv_hrtime();
+
+    auto finish = [call, start, done = std::move(done)]()
+    {
+        call->elapsedMicros = (uv_hrtime() - start) / 1000;
+
+        if (!lua_toboolean(call->L, 1))
+            call->status = LUA_ERRRUN;
+        lua_remove(call->L, 1);
+
+        done(*call);
+    };
+
+    int status = lua_resume(L, nullptr, nargs + 1);
+
+    if (status == LUA_YIELD)
+    {
+        call->resumed = true;
+        state.runtime->suspendedContinuations[L] = std::move(finish);
+        return;
+    }
+
+    if (status != LUA_OK)
+    {
+        call->status = status;
+        call->elapsedMicros = (uv_hrtime() - start) / 1000;
+        done(*call);
+        return;
+    }
+
+    finish();
+}
+
+static void pushRequest(const ServerRequest& request, const std::string_view* body, lua_State* L)
+{
+    lua_createtable(L, 0, 6);
+
+    lua_pushstring(L, "method");
+    lua_pushlstring(L, request.method.data(), request.method.size());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "path");
+    lua_pushlstring(L, request.path.data(), request.path.size());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "query");
+    parseQuery(request.query, L);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "headers");
+    pushStringPairs(request.headers, L);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "params");
+    pushStringPairs(request.params, L);
+    lua_settable(L, -3);
+
+    // Streaming requests have no body field, the handler reads it through the function it returns
+    if (body)
+    {
+        lua_pushstring(L, "body");
+        lua_pushlstring(L, body->data(), body->size());
+        lua_settable(L, -3);
+    }
+}
+
+static ResponseOptions responseOptions(const ServerLoopState& state, const ServerRequest& request, bool closeConnection)
+{
+    ResponseOptions options;
+    options.encoding = request.acceptedEncoding;
+    options.compressMinSize = state.compressMinSize;
+    options.compressLevel = state.compressLevel;
+    options.closeConnection = closeConnection || state.draining;
+    return options;
+}
+
+static ResponseSummary sendHandlerResult(auto* res, const HandlerCall& call, const ResponseOptions& options)
+{
+    if (call.failed())
+    {
+        const char* error = lua_tostring(call.L, -1);
+        std::string message = std::string("Server error: ") + (error ? error : "unknown error");
+
+        res->writeStatus("500 Internal Server Error");
+        res->end(message, options.closeConnection);
+        return {500, message.size()};
+    }
+
+    return handleResponse(res, call.L, -1, options);
+}
+
+static ResponseSummary rejectPayloadTooLarge(auto* res)
+{
+    std::string_view message = "Payload Too Large";
+    res->writeStatus("413 Payload Too Large");
+    res->end(message, true);
+    return {413, message.size()};
+}
+
+static void completeRequest(ServerLoopState& state, ServerRequest& request, ResponseSummary summary)
+{
+    request.responded = true;
+
+    std::optional<uint64_t> handlerTime;
+    if (request.ranHandler)
+        handlerTime = request.handlerTime;
+
+    ServerMetrics& metrics = *state.metrics;
+    metrics.inFlight--;
+    metrics.total.record(summary.status, request.receivedBytes, summary.bytes, handlerTime);
+
+    if (request.routeMetrics)
+        request.routeMetrics->record(summary.status, request.receivedBytes, summary.bytes, handlerTime);
+}
+
+static void recordHandlerCall(ServerRequest& request, const HandlerCall& call)
+{
+    request.ranHandler = true;
+    request.handlerTime += call.elapsedMicros;
+}
+
+// Sends the result of a finished handler call, unless the client went away or was answered while the handler was suspended.
+// A resumed handler responds outside of any uWS callback, so the response is corked to go out in one write.
+static void respondWithHandlerResult(ServerLoopState& state, auto* res, ServerRequest& request, const HandlerCall& call, bool closeConnection)
+{
+    if (request.aborted || request.responded)
+        return;
+
+    res->cork(
+        [&]()
+        {
+            completeRequest(state, request, sendHandlerResult(res, call, responseOptions(state, request, closeConnection)));
+        }
+    );
+}
+
+static void processRequest(
+    std::shared_ptr<ServerLoopState> state,
+    const std::shared_ptr<Ref>& handlerRef,
+    auto* res,
+    std::shared_ptr<ServerRequest> request,
+    std::string_view body
+)
+{
+    callHandler(
+        *state,
+        handlerRef,
+        [&](lua_State* L)
+        {
+            pushRequest(*request, &body, L);
+            return 1;
+        },
+        [state, res, request](HandlerCall& call)
+        {
+            recordHandlerCall(*request, call);
+            respondWithHandlerResult(*state, res, *request, call, false);
+        }
+    );
+}
+
+static void pumpBodyChunks(std::shared_ptr<ServerLoopState> state, auto* res, std::shared_ptr<ServerRequest> request);
+
+// Feeds one chunk of a streamed body to the reader returned by the handler
+static void processBodyChunk(
+    std::shared_ptr<ServerLoopState> state,
+    auto* res,
+    std::shared_ptr<ServerRequest> request,
+    std::string_view data,
+    bool last
+)
+{
+    request->handlerRunning = true;
+
+    callHandler(
+        *state,
+        request->bodyReader,
+        [&](lua_State* L)
+        {
+            lua_pushlstring(L, data.data(), data.size());
+            lua_pushboolean(L, last);
+            return 2;
+        },
+        [state, res, request, last](HandlerCall& call)
+        {
+            request->handlerRunning = false;
+            recordHandlerCall(*request, call);
+
+            // The reader may respond early (e.g. to reject an upload), in which case the rest of the body is dropped
+            if (!last && !call.failed() && !call.hasResult())
+            {
+                // Chunks that queued up behind a suspended reader are fed from here, otherwise the caller continues
+                if (call.resumed)
+                    pumpBodyChunks(state, res, request);
+                return;
+            }
+
+            respondWithHandlerResult(*state, res, *request, call, !last);
+        }
+    );
+}
+
+// Feeds the queued body chunks to the reader in order, stopping while a call is suspended
+static void pumpBodyChunks(std::shared_ptr<ServerLoopState> state, auto* res, std::shared_ptr<ServerRequest> request)
+{
+    while (request->bodyReader && !request->handlerRunning && !request->pendingChunks.empty() && !request->aborted && !request->responded)
+    {
+        auto [data, last] = std::move(request->pendingChunks.front());
+        request->pendingChunks.pop_front();
+
+        processBodyChunk(state, res, request, data, last);
+    }
+}
+
+// Caps the up-front reservation for bodies with a declared length when no body size limit is configured
+static constexpr size_t kMaxBodyPreallocation = 64 * 1024 * 1024;
+
+static void dispatchRequest(
+    std::shared_ptr<ServerLoopState> state,
+    std::shared_ptr<Ref> handlerRef,
+    const std::vector<std::string>& paramNames,
+    std::shared_ptr<RequestMetrics> routeMetrics,
+    auto* res,
+    auto* req
+)
+{
+    auto request = std::make_shared<ServerRequest>();
+    request->routeMetrics = std::move(routeMetrics);
+
+    state->metrics->inFlight++;
+
+    request->method = std::string(req->getMethod());
+    std::transform(request->method.begin(), request->method.end(), request->method.begin(), ::toupper);
+
+    std::string_view url = req->getFullUrl();
+
+    // Split URL into path and query
+    size_t queryPos = url.find('?');
+    if (queryPos != std::string::npos)
+    {
+        request->path = std::string(url.data(), queryPos);
+        request->query = std::string(url.data() + queryPos, url.size() - queryPos);
+    }
+    else
+    {
+        request->path = std::string(url);
+    }
+
+    request->params.reserve(paramNames.size());
+    for (size_t i = 0; i < paramNames.size(); i++)
+    {
+        std::string_view value = req->getParameter(static_cast<unsigned short>(i));
+        request->params.emplace_back(paramNames[i], std::string(value));
+    }
+
+    for (const auto& header : *req)
+        request->headers.emplace_back(std::string(header.first), std::string(header.second));
+
+    if (state->compress)
+        request->acceptedEncoding = negotiateEncoding(req->getHeader("accept-encoding"));
+
+    // Reject oversized uploads from the declared length before reading any of the body
+    std::optional<size_t> contentLength;
+    std::string_view contentLengthHeader = req->getHeader("content-length");
+    if (!contentLengthHeader.empty())
+    {
+        size_t declared = 0;
+        auto [ptr, ec] = std::from_chars(contentLengthHeader.data(), contentLengthHeader.data() + contentLengthHeader.size(), declared);
+        if (ec == std::errc() && ptr == contentLengthHeader.data() + contentLengthHeader.size())
+            contentLength = declared;
+    }
+
+    if (state->maxBodySize != 0 && contentLength && *contentLength > state->maxBodySize)
+    {
+        completeRequest(*state, *request, rejectPayloadTooLarge(res));
+        return;
+    }
+
+    bool hasBody = (contentLength && *contentLength > 0) || !req->getHeader("transfer-encoding").empty();
+
+    res->onAborted(
+        [state, request]()
+        {
+            request->aborted = true;
+
+            if (request->responded)
+                return;
+
+            state->metrics->inFlight--;
+            state->metrics->total.aborted++;
+
+            if (request->routeMetrics)
+                request->routeMetrics->aborted++;
+        }
+    );
+
+    if (state->streamBody)
+    {
+        request->handlerRunning = true;
+
+        callHandler(
+            *state,
+            handlerRef,
+            [&](lua_State* L)
+            {
+                pushRequest(*request, nullptr, L);
+                return 1;
+            },
+            [state, res, request, hasBody](HandlerCall& call)
+            {
+                request->handlerRunning = false;
+                recordHandlerCall(*request, call);
+
+                if (!call.failed() && lua_gettop(call.L) > 0 && lua_isfunction(call.L, -1))
+                {
+                    request->bodyReader = std::make_shared<Ref>(call.L, -1);
+                    pumpBodyChunks(state, res, request);
+                }
+                else
+                {
+                    // Responding before the body is read closes the connection, so the remaining upload is not parsed
+                    respondWithHandlerResult(*state, res, *request, call, hasBody);
+                }
+            }
+        );
+
+        if (request->responded)
+            return;
+    }
+    else if (contentLength)
+    {
+        request->body.reserve(state->maxBodySize != 0 ? *contentLength : std::min(*contentLength, kMaxBodyPreallocation));
+    }
+
+    res->onData(
+        [state, handlerRef, res, request](std::string_view data, bool last)
+        {
+            if (request->aborted || request->responded)
+                return;
+
+            request->receivedBytes += data.size();
+
+            // Chunked uploads have no declared length, so the limit is also enforced as data arrives
+            if (state->maxBodySize != 0 && request->receivedBytes > state->maxBodySize)
+            {
+                completeRequest(*state, *request, rejectPayloadTooLarge(res));
+                return;
+            }
+
+            if (state->streamBody)
+            {
+                // Chunks are only copied when they have to wait for the handler or an earlier chunk
+                if (request->bodyReader && !request->handlerRunning && request->pendingChunks.empty())
+                    processBodyChunk(state, res, request, data, last);
+                else
+                    request->pendingChunks.emplace_back(std::string(data), last);
+                return;
+            }
+
+            if (!last)
+            {
+                request->body.append(data);
+                return;
+            }
+
+            if (request->body.empty())
+            {
+                processRequest(state, handlerRef, res, request, data);
+            }
+            else
+            {
+                request->body.append(data);
+                processRequest(state, handlerRef, res, request, request->body);
+            }
+        }
+    );
+}
+
+static void serveStaticWithMetrics(
+    std::shared_ptr<ServerLoopState> state,
+    std::shared_ptr<StaticFiles> files,
+    std::shared_ptr<RequestMetrics> routeMetrics,
+    auto* res,
+    auto* req
+)
+{
+    uint64_t start = uv_hrtime();
+
+    serveStatic(
+        state->runtime,
+        std::move(files),
+        res,
+        req,
+        [state, routeMetrics, start](ResponseSummary summary)
+        {
+            uint64_t elapsed = (uv_hrtime() - start) / 1000;
+
+            state->metrics->total.record(summary.status, 0, summary.bytes, elapsed);
+            if (routeMetrics)
+                routeMetrics->record(summary.status, 0, summary.bytes, elapsed);
+        }
+    );
+}
+
+static void writePrometheusLabel(std::string& out, const char* name, std::string_view value)
+{
+    out += name;
+    out += "=\"";
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+            out += '\\';
+
+        if (c == '\n')
+            out += "\\n";
+        else
+            out += c;
+    }
+    out += '"';
+}
+
+static void writePrometheusSample(std::string& out, const std::string& name, const std::string& labels, const std::string& extraLabels, double value)
+{
+    out += name;
+
+    if (!labels.empty() || !extraLabels.empty())
+    {
+        out += '{';
+        out += labels;
+        if (!labels.empty() && !extraLabels.empty())
+            out += ',';
+        out += extraLabels;
+        out += '}';
+    }
+
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), " %.17g\n", value);
+    out += buffer;
+}
+
+// Writes one metric family for the whole server and one for the routes; samples of a family have to stay contiguous
+static void writePrometheusFamily(std::string& out, const ServerMetrics& metrics, const char* name, const char* type, auto write)
+{
+    std::string serverName = std::string("lute_http_server_") + name;
+    out += "# TYPE " + serverName + " " + type + "\n";
+    write(serverName, std::string(), metrics.total);
+
+    std::string routeName = std::string("lute_http_route_") + name;
+    out += "# TYPE " + routeName + " " + type + "\n";
+    for (const auto& [route, routeMetrics] : metrics.routes)
+    {
+        std::string label;
+        writePrometheusLabel(label, "route", route);
+        write(routeName, label, *routeMetrics);
+    }
+}
+
+// Renders the metrics in the Prometheus text exposition format
+static std::string renderPrometheusMetrics(const ServerMetrics& metrics)
+{
+    static const char* kStatusClassNames[] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+    static const double kQuantiles[] = {0.5, 0.9, 0.99};
+
+    std::string out;
+
+    out += "# TYPE lute_http_server_requests_in_flight gauge\n";
+    writePrometheusSample(out, "lute_http_server_requests_in_flight", "", "", double(metrics.inFlight));
+
+    auto counter = [&](const char* name, uint64_t RequestMetrics::*field)
+    {
+        writePrometheusFamily(
+            out,
+            metrics,
+            name,
+            "counter",
+            [&](const std::string& series, const std::string& labels, const RequestMetrics& values)
+            {
+                writePrometheusSample(out, series, labels, "", double(values.*field));
+            }
+        );
+    };
+
+    counter("requests_total", &RequestMetrics::requests);
+    counter("aborted_total", &RequestMetrics::aborted);
+    counter("request_bytes_total", &RequestMetrics::bytesIn);
+    counter("response_bytes_total", &RequestMetrics::bytesOut);
+
+    writePrometheusFamily(
+        out,
+        metrics,
+        "responses_total",
+        "counter",
+        [&](const std::string& series, const std::string& labels, const RequestMetrics& values)
         {
-            if (appPtr)
-                appPtr->close();
+            for (int i = 0; i < 5; i++)
+            {
+                std::string code;
+                writePrometheusLabel(code, "code", kStatusClassNames[i]);
+                writePrometheusSample(out, series, labels, code, double(values.statusClasses[i]));
+            }
+        }
+    );
+
+    writePrometheusFamily(
+        out,
+        metrics,
+        "handler_seconds",
+        "summary",
+        [&](const std::string& series, const std::string& labels, const RequestMetrics& values)
+        {
+            for (double quantile : kQuantiles)
+            {
+                char value[16];
+                snprintf(value, sizeof(value), "%g", quantile);
+
+                std::string quantileLabel;
+                writePrometheusLabel(quantileLabel, "quantile", value);
+                writePrometheusSample(out, series, labels, quantileLabel, double(values.handlerTime.percentile(quantile)) / 1e6);
+            }
+
+            writePrometheusSample(out, series + "_sum", labels, "", double(values.handlerTime.sum) / 1e6);
+            writePrometheusSample(out, series + "_count", labels, "", double(values.handlerTime.count));
+        }
+    );
+
+    return out;
+}
+
+static void pushRequestMetrics(lua_State* L, const RequestMetrics& metrics)
+{
+    static const char* kStatusClassNames[] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+
+    lua_createtable(L, 0, 6);
+
+    lua_pushnumber(L, double(metrics.requests));
+    lua_setfield(L, -2, "requests");
+
+    lua_pushnumber(L, double(metrics.aborted));
+    lua_setfield(L, -2, "aborted");
+
+    lua_pushnumber(L, double(metrics.bytesIn));
+    lua_setfield(L, -2, "bytesin");
+
+    lua_pushnumber(L, double(metrics.bytesOut));
+    lua_setfield(L, -2, "bytesout");
+
+    lua_createtable(L, 0, 5);
+    for (int i = 0; i < 5; i++)
+    {
+        lua_pushnumber(L, double(metrics.statusClasses[i]));
+        lua_setfield(L, -2, kStatusClassNames[i]);
+    }
+    lua_setfield(L, -2, "status");
+
+    // Handler times are reported in seconds, like the rest of the runtime
+    const LatencyHistogram& histogram = metrics.handlerTime;
+    lua_createtable(L, 0, 6);
+
+    lua_pushnumber(L, double(histogram.count));
+    lua_setfield(L, -2, "count");
+
+    lua_pushnumber(L, histogram.count ? double(histogram.sum) / double(histogram.count) / 1e6 : 0.0);
+    lua_setfield(L, -2, "mean");
+
+    lua_pushnumber(L, double(histogram.max) / 1e6);
+    lua_setfield(L, -2, "max");
+
+    lua_pushnumber(L, double(histogram.percentile(0.5)) / 1e6);
+    lua_setfield(L, -2, "p50");
+
+    lua_pushnumber(L, double(histogram.percentile(0.9)) / 1e6);
+    lua_setfield(L, -2, "p90");
+
+    lua_pushnumber(L, double(histogram.percentile(0.99)) / 1e6);
+    lua_setfield(L, -2, "p99");
+
+    lua_setfield(L, -2, "handlertime");
+}
+
+static int serverStats(lua_State* L)
+{
+    auto* metrics = static_cast<std::shared_ptr<ServerMetrics>*>(lua_touserdatatagged(L, lua_upvalueindex(1), kServerMetricsTag));
+    if (!metrics)
+        luaL_errorL(L, "invalid server metrics");
+
+    const ServerMetrics& server = **metrics;
+
+    pushRequestMetrics(L, server.total);
+
+    lua_pushnumber(L, double(server.inFlight));
+    lua_setfield(L, -2, "inflight");
+
+    lua_createtable(L, 0, int(server.routes.size()));
+    for (const auto& [route, routeMetrics] : server.routes)
+    {
+        pushRequestMetrics(L, *routeMetrics);
+        lua_setfield(L, -2, route.c_str());
+    }
+    lua_setfield(L, -2, "routes");
+
+    return 1;
+}
+
+void setupAppAndListen(auto* app, std::shared_ptr<ServerLoopState> state, bool& success)
+{
+    if (!state->metricsPath.empty())
+    {
+        app->get(
+            state->metricsPath,
+            [metrics = state->metrics](auto* res, auto* req)
+            {
+                res->writeHeader("Content-Type", "text/plain; version=0.0.4");
+                res->end(renderPrometheusMetrics(*metrics));
+            }
+        );
+    }
+
+    // Routes are registered with the uWS router, so matching happens natively and never enters the VM
+    std::map<std::string, std::vector<std::string>> allowedMethods;
+
+    for (const RouteDefinition& route : state->routes)
+    {
+        registerRoute(
+            app,
+            route.method,
+            route.pattern,
+            [state, handlerRef = route.handlerRef, paramNames = route.paramNames, staticFiles = route.staticFiles, metrics = route.metrics](
+                auto* res, auto* req
+            )
+            {
+                if (staticFiles)
+                    serveStaticWithMetrics(state, staticFiles, metrics, res, req);
+                else
+                    dispatchRequest(state, handlerRef, paramNames, metrics, res, req);
+            }
+        );
+
+        allowedMethods[route.pattern].push_back(route.method);
+    }
+
+    // Paths that match a route under a different method get a native 405; 'any' routes have lower priority in uWS
+    for (const auto& [pattern, methods] : allowedMethods)
+    {
+        if (std::find(methods.begin(), methods.end(), "*") != methods.end())
+            continue;
+
+        std::string allow;
+        for (const std::string& method : methods)
+            allow += allow.empty() ? method : ", " + method;
+
+        app->any(
+            pattern,
+            [metrics = state->metrics, allow](auto* res, auto* req)
+            {
+                std::string_view message = "Method Not Allowed";
+                res->writeStatus("405 Method Not Allowed");
+                res->writeHeader("Allow", allow);
+                res->end(message);
+                metrics->total.record(405, 0, message.size(), std::nullopt);
+            }
+        );
+    }
+
+    std::shared_ptr<RequestMetrics> fallbackMetrics = state->metrics->addRoute("*");
+
+    if (state->staticFiles)
+    {
+        app->any(
+            "/*",
+            [state, fallbackMetrics](auto* res, auto* req)
+            {
+                serveStaticWithMetrics(state, state->staticFiles, fallbackMetrics, res, req);
+            }
+        );
+    }
+    else if (state->handlerRef)
+    {
+        app->any(
+            "/*",
+            [state, fallbackMetrics](auto* res, auto* req)
+            {
+                dispatchRequest(state, state->handlerRef, {}, fallbackMetrics, res, req);
+            }
+        );
+    }
+    else
+    {
+        app->any(
+            "/*",
+            [metrics = state->metrics](auto* res, auto* req)
+            {
+                std::string_view message = "Not Found";
+                res->writeStatus("404 Not Found");
+                res->end(message);
+                metrics->total.record(404, 0, message.size(), std::nullopt);
+            }
+        );
+    }
+
+    int options = state->reusePort ? LIBUS_LISTEN_DEFAULT : LIBUS_LISTEN_EXCLUSIVE_PORT;
+
+    app->listen(
+        state->hostname,
+        state->port,
+        options,
+        [&success, state](auto* listen_socket)
+        {
+            success = (listen_socket != nullptr);
+            state->listenSocket = listen_socket;
+
+            // With port 0 the system picks a free port, which the server then reports
+            if (listen_socket)
+            {
+                constexpr int ssl = std::is_same_v<std::remove_pointer_t<decltype(app)>, uWS::SSLApp> ? 1 : 0;
+                state->port = us_socket_local_port(ssl, reinterpret_cast<us_socket_t*>(listen_socket));
+            }
+        }
+    );
+}
+
+// Closes the listen socket only, connections that are already open keep being served
+static void stopListening(ServerLoopState& state)
+{
+    if (!state.listenSocket)
+        return;
+
+    Luau::visit(
+        [&state](auto* appPtr)
+        {
+            constexpr int ssl = std::is_same_v<std::remove_pointer_t<decltype(appPtr)>, uWS::SSLApp> ? 1 : 0;
+            us_listen_socket_close(ssl, state.listenSocket);
         },
-        serverStates[serverId]->app
+        state.app
     );
-    serverStates[serverId]->running = false;
 
+    state.listenSocket = nullptr;
+}
+
+// Closes the listen socket and every open connection; the app is destroyed on the next loop iteration, outside of any uWS callback
+static void shutdownServer(ServerLoopState& state, bool drained)
+{
     Luau::visit(
-        [](auto& ptr)
+        [](auto* appPtr)
         {
-            if (ptr)
-                ptr.reset();
+            if (appPtr)
+                appPtr->close();
         },
-        serverInstances[serverId]
+        state.app
     );
-    serverStates[serverId] = nullptr;
 
-    return true;
+    state.listenSocket = nullptr;
+    state.running = false;
+    state.draining = false;
+
+    if (ResumeToken token = std::move(state.drainToken))
+    {
+        token->complete(
+            [drained](lua_State* L)
+            {
+                lua_pushboolean(L, drained);
+                return 1;
+            }
+        );
+    }
+}
+
+// Drops everything the server holds on to; the route handlers capture the state, so destroying the app breaks that cycle
+static void releaseServer(ServerLoopState& state)
+{
+    {
+        std::lock_guard lock(serversMutex);
+        servers.erase(state.serverId);
+    }
+
+    state.app = static_cast<uWS::App*>(nullptr);
+    uWSApp instance = std::move(state.instance);
+
+    state.loopFunction = nullptr;
+    state.routes.clear();
+    state.handlerRef.reset();
+    state.staticFiles.reset();
+}
+
+static int serverClose(lua_State* L)
+{
+    int serverId = lua_tointeger(L, lua_upvalueindex(1));
+
+    double drain = 0.0;
+    if (lua_istable(L, 1))
+    {
+        lua_getfield(L, 1, "drain");
+        if (lua_isnumber(L, -1))
+        {
+            drain = lua_tonumber(L, -1);
+        }
+        else if (!lua_isnil(L, -1))
+        {
+            luaL_errorL(L, "drain must be a number of seconds");
+            return 0;
+        }
+        lua_pop(L, 1);
+    }
+
+    std::shared_ptr<ServerLoopState> state;
+    {
+        std::lock_guard lock(serversMutex);
+        auto it = servers.find(serverId);
+        if (it != servers.end())
+            state = it->second;
+    }
+
+    if (!state || !state->running || state->draining)
+    {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    if (drain <= 0.0)
+    {
+        shutdownServer(*state, true);
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    // The loop function finishes the shutdown once nothing is in flight anymore, or forcibly at the deadline
+    stopListening(*state);
+    state->draining = true;
+    state->drainDeadline = uv_hrtime() + static_cast<uint64_t>(drain * 1e9);
+    state->drainToken = getResumeToken(L);
+
+    return lua_yield(L, 0);
 }
 
 int lua_serve(lua_State* L)
@@ -511,7 +2493,14 @@ int lua_serve(lua_State* L)
     std::string hostname = "0.0.0.0";
     int port = 3000;
     bool reusePort = false;
+    size_t maxBodySize = 0;
+    bool streamBody = false;
+    bool compress = false;
+    size_t compressMinSize = 1024;
+    int compressLevel = Z_DEFAULT_COMPRESSION;
+    std::string metricsPath;
     std::optional<uWS::SocketContextOptions> tlsOptions;
+    std::vector<RouteDefinition> routes;
     int handlerIndex = 1;
 
     // Check if first argument is a table (config) or function (handler)
@@ -538,6 +2527,66 @@ int lua_serve(lua_State* L)
         }
         lua_pop(L, 1);
 
+        lua_getfield(L, 1, "maxbodysize");
+        if (lua_isnumber(L, -1))
+        {
+            double size = lua_tonumber(L, -1);
+            if (size < 0)
+            {
+                luaL_errorL(L, "maxbodysize cannot be negative");
+                return 0;
+            }
+            maxBodySize = static_cast<size_t>(size);
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 1, "compression");
+        if (lua_isboolean(L, -1))
+        {
+            compress = lua_toboolean(L, -1);
+        }
+        else if (lua_istable(L, -1))
+        {
+            compress = true;
+
+            lua_getfield(L, -1, "minsize");
+            if (lua_isnumber(L, -1))
+                compressMinSize = static_cast<size_t>(std::max(0.0, lua_tonumber(L, -1)));
+            lua_pop(L, 1);
+
+            lua_getfield(L, -1, "level");
+            if (lua_isnumber(L, -1))
+            {
+                compressLevel = lua_tointeger(L, -1);
+                if (compressLevel < 0 || compressLevel > 9)
+                {
+                    luaL_errorL(L, "compression level must be between 0 and 9");
+                    return 0;
+                }
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 1, "metrics");
+        if (lua_isstring(L, -1))
+        {
+            metricsPath = lua_tostring(L, -1);
+            if (metricsPath.empty() || metricsPath.front() != '/')
+            {
+                luaL_errorL(L, "metrics must be a path starting with '/'");
+                return 0;
+            }
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 1, "streambody");
+        if (lua_isboolean(L, -1))
+        {
+            streamBody = lua_toboolean(L, -1);
+        }
+        lua_pop(L, 1);
+
         lua_getfield(L, 1, "tls");
         if (lua_istable(L, -1))
         {
@@ -577,15 +2626,59 @@ int lua_serve(lua_State* L)
         }
         lua_pop(L, 1);
 
+        lua_getfield(L, 1, "routes");
+        if (lua_istable(L, -1))
+        {
+            lua_pushnil(L);
+            while (lua_next(L, -2))
+            {
+                if (!lua_isstring(L, -2) || !lua_isfunction(L, -1))
+                {
+                    luaL_errorL(L, "routes must map 'METHOD /path' strings to handler functions");
+                    return 0;
+                }
+
+                size_t keyLength = 0;
+                const char* key = lua_tolstring(L, -2, &keyLength);
+
+                RouteDefinition route;
+                if (!parseRouteKey(std::string_view(key, keyLength), route))
+                {
+                    luaL_errorL(L, "invalid route '%s', expected 'METHOD /path'", key);
+                    return 0;
+                }
+
+                route.handlerRef = std::make_shared<Ref>(L, -1);
+                route.staticFiles = toStaticFiles(L, -1);
+                routes.push_back(std::move(route));
+
+                lua_pop(L, 1);
+            }
+        }
+        else if (!lua_isnil(L, -1))
+        {
+            luaL_errorL(L, "routes must be a table");
+            return 0;
+        }
+        lua_pop(L, 1);
+
         lua_getfield(L, 1, "handler");
-        if (!lua_isfunction(L, -1))
+        if (lua_isnil(L, -1) && !routes.empty())
+        {
+            // With routes present, the handler is an optional fallback for unmatched requests
+            lua_pop(L, 1);
+            handlerIndex = 0;
+        }
+        else if (!lua_isfunction(L, -1))
         {
             lua_pop(L, 1);
             luaL_errorL(L, "handler function is required in config table");
             return 0;
         }
-        lua_insert(L, -1);
-        handlerIndex = lua_gettop(L);
+        else
+        {
+            handlerIndex = lua_gettop(L);
+        }
     }
     else if (!lua_isfunction(L, 1))
     {
@@ -595,17 +2688,37 @@ int lua_serve(lua_State* L)
 
     Runtime* runtime = getRuntime(L);
 
-    int serverId = nextServerId++;
+    int serverId = 0;
+    {
+        std::lock_guard lock(serversMutex);
+        serverId = nextServerId++;
+    }
 
     auto state = std::make_shared<ServerLoopState>();
+    state->serverId = serverId;
     state->runtime = runtime;
     state->hostname = hostname;
     state->port = port;
     state->reusePort = reusePort;
+    state->maxBodySize = maxBodySize;
+    state->streamBody = streamBody;
+    state->compress = compress;
+    state->compressMinSize = compressMinSize;
+    state->compressLevel = compressLevel;
+    state->metricsPath = metricsPath;
 
-    lua_pushvalue(L, handlerIndex);
-    state->handlerRef = std::make_shared<Ref>(L, -1);
-    lua_pop(L, 1);
+    state->routes = std::move(routes);
+
+    for (RouteDefinition& route : state->routes)
+        route.metrics = state->metrics->addRoute(route.method == "*" ? route.pattern : route.method + " " + route.pattern);
+
+    if (handlerIndex != 0)
+    {
+        lua_pushvalue(L, handlerIndex);
+        state->handlerRef = std::make_shared<Ref>(L, -1);
+        state->staticFiles = toStaticFiles(L, -1);
+        lua_pop(L, 1);
+    }
 
     uWSApp app;
     bool success = false;
@@ -635,6 +2748,7 @@ int lua_serve(lua_State* L)
     {
         if (!state->running)
         {
+            releaseServer(*state);
             return;
         }
         Luau::visit(
@@ -645,39 +2759,45 @@ int lua_serve(lua_State* L)
             },
             state->app
         );
+
+        if (state->draining)
+        {
+            bool drained = state->metrics->inFlight == 0;
+            if (drained || uv_hrtime() >= state->drainDeadline)
+                shutdownServer(*state, drained);
+        }
+
         state->runtime->schedule(state->loopFunction);
     };
 
-    serverInstances[serverId] = std::move(app);
-    serverStates[serverId] = state;
+    state->instance = std::move(app);
+
+    {
+        std::lock_guard lock(serversMutex);
+        servers[serverId] = state;
+    }
 
     runtime->schedule(state->loopFunction);
 
-    lua_createtable(L, 0, 3);
+    lua_createtable(L, 0, 4);
 
     lua_pushstring(L, "hostname");
     lua_pushstring(L, hostname.c_str());
     lua_settable(L, -3);
 
     lua_pushstring(L, "port");
-    lua_pushinteger(L, port);
+    lua_pushinteger(L, state->port);
     lua_settable(L, -3);
 
     lua_pushstring(L, "close");
     lua_pushinteger(L, serverId);
-    lua_pushcclosurek(
-        L,
-        [](lua_State* L) -> int
-        {
-            int serverId = lua_tointeger(L, lua_upvalueindex(1));
+    lua_pushcclosurek(L, serverClose, "server_close", 1, nullptr);
+    lua_settable(L, -3);
 
-            lua_pushboolean(L, closeServer(serverId));
-            return 1;
-        },
-        "server_close",
-        1,
-        nullptr
-    );
+    // The metrics outlive the server, so stats can still be read after it was closed
+    lua_pushstring(L, "stats");
+    new (lua_newuserdatatagged(L, sizeof(std::shared_ptr<ServerMetrics>), kServerMetricsTag)) std::shared_ptr<ServerMetrics>(state->metrics);
+    lua_pushcclosurek(L, serverStats, "server_stats", 1, nullptr);
     lua_settable(L, -3);
 
     return 1;
@@ -704,9 +2824,31 @@ static CurlHolder& globalCurlInit()
     return holder;
 }
 
+static void initializeNet(lua_State* L)
+{
+    lua_setuserdatadtor(
+        L,
+        kStaticFilesTag,
+        [](lua_State* L, void* ud)
+        {
+            static_cast<std::shared_ptr<net::StaticFiles>*>(ud)->~shared_ptr();
+        }
+    );
+
+    lua_setuserdatadtor(
+        L,
+        kServerMetricsTag,
+        [](lua_State* L, void* ud)
+        {
+            static_cast<std::shared_ptr<net::ServerMetrics>*>(ud)->~shared_ptr();
+        }
+    );
+}
+
 int luaopen_net(lua_State* L)
 {
     globalCurlInit();
+    initializeNet(L);
 
     luaL_register(L, "net", net::lib);
 
@@ -716,6 +2858,7 @@ int luaopen_net(lua_State* L)
 int luteopen_net(lua_State* L)
 {
     globalCurlInit();
+    initializeNet(L);
 
     lua_createtable(L, 0, std::size(net::lib));
 
@@ -295,7 +295,7 @@ int run(lua_State* L)
     }
 
     auto handle = std::make_shared<ProcessHandle>();
-    handle->loop = uv_default_loop();
+    handle->loop = &getRuntime(L)->loop;
     handle->self = handle;
 
     uv_process_options_t options = {};
@@ -11,7 +11,13 @@
 #include "Luau/CodeGen.h"
 #include "Luau/Require.h"
 #include "Luau/StringUtils.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 
 static luarequire_WriteResult write(std::optional<std::string> contents, char* buffer, size_t bufferSize, size_t* sizeOut)
 {
@@ -108,6 +114,86 @@ static luarequire_WriteResult get_config(lua_State* L, void* ctx, char* buffer,
     return write(reqCtx->vfs.getConfig(L), buffer, buffer_size, size_out);
 }
 
+// Sources are identified by their size and hash, a collision would also need both to match
+struct BytecodeKey
+{
+    size_t size = 0;
+    size_t hash = 0;
+
+    bool operator==(const BytecodeKey& other) const
+    {
+        return size == other.size && hash == other.hash;
+    }
+};
+
+struct BytecodeKeyHash
+{
+    size_t operator()(const BytecodeKey& key) const
+    {
+        return key.hash;
+    }
+};
+
+struct CachedBytecode
+{
+    std::shared_ptr<const std::string> bytecode;
+    // Position in bytecodeCacheRecent
+    std::list<BytecodeKey>::iterator recent;
+};
+
+// Bytecode kept at most, the least recently loaded modules are evicted first
+static constexpr size_t kMaxBytecodeCacheSize = 32 * 1024 * 1024;
+
+// Every VM in the process requires the same modules (each child VM loads its worker module and usually the same
+// @std libraries), so compiled bytecode is shared between them. Entries are keyed by the contents of the source,
+// so edited files are recompiled and identical files share their bytecode.
+static std::mutex bytecodeCacheMutex;
+static std::unordered_map<BytecodeKey, CachedBytecode, BytecodeKeyHash> bytecodeCache;
+static std::list<BytecodeKey> bytecodeCacheRecent;
+static size_t bytecodeCacheSize = 0;
+
+static std::shared_ptr<const std::string> compileModule(const std::string& source)
+{
+    BytecodeKey key{source.size(), std::hash<std::string_view>()(source)};
+
+    {
+        std::lock_guard lock(bytecodeCacheMutex);
+
+        auto it = bytecodeCache.find(key);
+        if (it != bytecodeCache.end())
+        {
+            bytecodeCacheRecent.splice(bytecodeCacheRecent.begin(), bytecodeCacheRecent, it->second.recent);
+            return it->second.bytecode;
+        }
+    }
+
+    // compile outside of the lock so VMs loading different modules don't wait on each other
+    auto bytecode = std::make_shared<const std::string>(Luau::compile(source, copts()));
+
+    if (bytecode->size() > kMaxBytecodeCacheSize)
+        return bytecode;
+
+    std::lock_guard lock(bytecodeCacheMutex);
+
+    // Another VM may have compiled the same source in the meantime
+    if (bytecodeCache.count(key))
+        return bytecode;
+
+    while (bytecodeCacheSize + bytecode->size() > kMaxBytecodeCacheSize && !bytecodeCacheRecent.empty())
+    {
+        auto evicted = bytecodeCache.find(bytecodeCacheRecent.back());
+        bytecodeCacheSize -= evicted->second.bytecode->size();
+        bytecodeCache.erase(evicted);
+        bytecodeCacheRecent.pop_back();
+    }
+
+    bytecodeCacheRecent.push_front(key);
+    bytecodeCache[key] = CachedBytecode{bytecode, bytecodeCacheRecent.begin()};
+    bytecodeCacheSize += bytecode->size();
+
+    return bytecode;
+}
+
 static int load(lua_State* L, void* ctx, const char* path, const char* chunkname, const char* loadname)
 {
     // module needs to run in a new thread, isolated from the rest
@@ -125,8 +211,8 @@ static int load(lua_State* L, void* ctx, const char* path, const char* chunkname
         luaL_error(L, "could not read file '%s'", loadname);
 
     // now we can compile & run module on the new thread
-    std::string bytecode = Luau::compile(*contents, copts());
-    if (luau_load(ML, chunkname, bytecode.data(), bytecode.size(), 0) == 0)
+    std::shared_ptr<const std::string> bytecode = compileModule(*contents);
+    if (luau_load(ML, chunkname, bytecode->data(), bytecode->size(), 0) == 0)
     {
         #ifndef LUTE_DISABLE_NATIVE_CODEGEN
         if (getCodegenEnabled())
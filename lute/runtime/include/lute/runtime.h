@@ -3,6 +3,8 @@
 #include "Luau/Variant.h"
 #include "lute/ref.h"
 
+#include "uv.h"
+
 #include <atomic>
 #include <condition_variable>
 #include <functional>
@@ -10,6 +12,7 @@
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 struct lua_State;
@@ -72,6 +75,12 @@ struct Runtime
     // Run 'f' in a libuv work queue
     void runInWorkQueue(std::function<void()> f);
 
+    // Event loop of this runtime, only used from the thread running it
+    uv_loop_t loop;
+
+    // Breaks out of 'loop' when work is scheduled, including from other threads
+    uv_async_t wakeup;
+
     void addPendingToken();
     void releasePendingToken();
 
@@ -81,11 +90,11 @@ struct Runtime
     // Shorthand for global state
     lua_State* GL = nullptr;
 
-    std::mutex dataCopyMutex;
-    std::unique_ptr<lua_State, void (*)(lua_State*)> dataCopy;
-
     std::vector<ThreadToContinue> runningThreads;
 
+    // Continuations of threads that yielded before finishing; they run once the thread completes on a later resumption
+    std::unordered_map<lua_State*, std::function<void()>> suspendedContinuations;
+
     std::mutex continuationMutex;
     std::vector<std::function<void()>> continuations;
 
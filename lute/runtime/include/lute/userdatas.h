@@ -4,4 +4,13 @@
 constexpr int kDurationTag       = 127;
 constexpr int kInstantTag        = 126;
 constexpr int kCompilerResultTag = 125;
-constexpr int kWatchHandleTag    = 124;
\ No newline at end of file
+constexpr int kWatchHandleTag    = 124;
+constexpr int kStaticFilesTag    = 123;
+constexpr int kServerMetricsTag  = 122;
+constexpr int kMappedFileTag     = 121;
+constexpr int kFileWriterTag     = 120;
+constexpr int kFileReaderTag     = 119;
+constexpr int kDirectoryWalkTag  = 118;
+constexpr int kSharedTableTag    = 117;
+constexpr int kChannelTag        = 116;
+constexpr int kSharedBufferTag   = 115;
@@ -32,10 +32,24 @@ static void lua_close_checked(lua_State* L)
 
 Runtime::Runtime()
     : globalState(nullptr, lua_close_checked)
-    , dataCopy(nullptr, lua_close_checked)
 {
     stop.store(false);
     activeTokens.store(0);
+
+    // libuv loops are not thread-safe, so every runtime (and the thread driving it) has a loop of its own
+    uv_loop_init(&loop);
+
+    uv_async_init(
+        &loop,
+        &wakeup,
+        [](uv_async_t* handle)
+        {
+            uv_stop(handle->loop);
+        }
+    );
+
+    // The wakeup handle alone does not keep the loop running
+    uv_unref(reinterpret_cast<uv_handle_t*>(&wakeup));
 }
 
 Runtime::~Runtime()
@@ -48,8 +62,42 @@ Runtime::~Runtime()
         runLoopCv.notify_one();
     }
 
+    uv_async_send(&wakeup);
+
     if (runLoopThread.joinable())
         runLoopThread.join();
+
+    // References into the VM have to be released before it is closed
+    runningThreads.clear();
+    suspendedContinuations.clear();
+    continuations.clear();
+    errorStack.clear();
+
+    // Finalizers can still close handles, so the VM is closed before the loop
+    globalState.reset();
+    GL = nullptr;
+
+    // Handles embedded in userdata are closed by their finalizers above, so whatever is still open is heap-owned: the wakeup,
+    // unref'd watches, or work that was abandoned with its token still pending. It is closed so that nothing fires into
+    // a runtime that no longer exists.
+    uv_walk(
+        &loop,
+        [](uv_handle_t* handle, void* arg)
+        {
+            auto* runtime = static_cast<Runtime*>(arg);
+
+            if (uv_is_closing(handle))
+                return;
+
+            assert(handle == reinterpret_cast<uv_handle_t*>(&runtime->wakeup) || !uv_has_ref(handle) || runtime->activeTokens.load() != 0);
+
+            uv_close(handle, nullptr);
+        },
+        this
+    );
+
+    uv_run(&loop, UV_RUN_DEFAULT);
+    uv_loop_close(&loop);
 }
 
 bool Runtime::hasWork()
@@ -59,7 +107,28 @@ bool Runtime::hasWork()
 
 RuntimeStep Runtime::runOnce()
 {
-    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    if (hasContinuations() || hasThreads() || !errorStack.empty())
+    {
+        uv_run(&loop, UV_RUN_NOWAIT);
+    }
+    else if (uv_loop_alive(&loop))
+    {
+        // Returns once a callback or another thread schedules work, which stops the loop through 'wakeup'
+        uv_run(&loop, UV_RUN_DEFAULT);
+    }
+    else if (activeTokens.load() != 0)
+    {
+        // Nothing can happen on this thread until another runtime schedules a continuation
+        std::unique_lock lock(continuationMutex);
+
+        runLoopCv.wait(
+            lock,
+            [this]
+            {
+                return !continuations.empty() || stop;
+            }
+        );
+    }
 
     // mluau patch: Push errorStack over via StepErr
     if (!errorStack.empty())
@@ -112,14 +181,28 @@ RuntimeStep Runtime::runOnce()
 
     if (status == LUA_YIELD)
     {
+        // The thread is resumed later through its resume token, without a continuation of its own
+        if (next.cont)
+            suspendedContinuations[L] = std::move(next.cont);
+
         return StepSuccess{L};
     }
 
     if (status != LUA_OK)
     {
+        suspendedContinuations.erase(L);
         return StepErr{L};
     };
 
+    if (!next.cont)
+    {
+        if (auto it = suspendedContinuations.find(L); it != suspendedContinuations.end())
+        {
+            next.cont = std::move(it->second);
+            suspendedContinuations.erase(it);
+        }
+    }
+
     if (next.cont)
         next.cont();
 
@@ -128,7 +211,7 @@ RuntimeStep Runtime::runOnce()
 
 bool Runtime::runToCompletion()
 {
-    while (hasWork())
+    while (hasWork() && !stop)
     {
         auto step = runOnce();
 
@@ -210,6 +293,7 @@ void Runtime::schedule(std::function<void()> f)
     continuations.push_back(std::move(f));
 
     runLoopCv.notify_one();
+    uv_async_send(&wakeup);
 }
 
 void Runtime::scheduleLuauError(std::shared_ptr<Ref> ref, std::string error)
@@ -229,6 +313,7 @@ void Runtime::scheduleLuauError(std::shared_ptr<Ref> ref, std::string error)
     );
 
     runLoopCv.notify_one();
+    uv_async_send(&wakeup);
 }
 
 void Runtime::scheduleLuauResume(std::shared_ptr<Ref> ref, std::function<int(lua_State*)> cont)
@@ -248,17 +333,16 @@ void Runtime::scheduleLuauResume(std::shared_ptr<Ref> ref, std::function<int(lua
     );
 
     runLoopCv.notify_one();
+    uv_async_send(&wakeup);
 }
 
 void Runtime::runInWorkQueue(std::function<void()> f)
 {
-    auto loop = uv_default_loop();
-
     uv_work_t* work = new uv_work_t();
     work->data = new decltype(f)(std::move(f));
 
     uv_queue_work(
-        loop,
+        &loop,
         work,
         [](uv_work_t* req)
         {
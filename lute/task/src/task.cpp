@@ -28,11 +28,13 @@ struct WaitData
 
 static void yieldLuaStateFor(lua_State* L, uint64_t milliseconds, bool putDeltaTimeOnStack)
 {
+    uv_loop_t* loop = &getRuntime(L)->loop;
+
     WaitData* yield = new WaitData();
-    uv_timer_init(uv_default_loop(), &yield->uvTimer);
+    uv_timer_init(loop, &yield->uvTimer);
 
     yield->resumptionToken = getResumeToken(L);
-    yield->startedAtMs = uv_now(uv_default_loop());
+    yield->startedAtMs = uv_now(loop);
     yield->uvTimer.data = yield;
     yield->putDeltaTimeOnStack = putDeltaTimeOnStack;
 
@@ -42,19 +44,27 @@ static void yieldLuaStateFor(lua_State* L, uint64_t milliseconds, bool putDeltaT
         {
             WaitData* yield = static_cast<WaitData*>(timer->data);
 
+            double elapsed = static_cast<double>(uv_now(timer->loop) - yield->startedAtMs) / 1000.0;
+
             yield->resumptionToken->complete(
-                [yield](lua_State* L)
+                [elapsed, putDeltaTimeOnStack = yield->putDeltaTimeOnStack](lua_State* L)
                 {
-                    int stackReturnAmount = yield->putDeltaTimeOnStack ? 1 : 0;
-                    if (stackReturnAmount)
-                        lua_pushnumber(L, static_cast<double>(uv_now(uv_default_loop()) - yield->startedAtMs) / 1000.0);
+                    if (!putDeltaTimeOnStack)
+                        return 0;
 
-                    delete yield;
-                    return stackReturnAmount;
+                    lua_pushnumber(L, elapsed);
+                    return 1;
                 }
             );
 
-            uv_timer_stop(&yield->uvTimer);
+            // The handle stays registered with the loop until it is closed
+            uv_close(
+                reinterpret_cast<uv_handle_t*>(&yield->uvTimer),
+                [](uv_handle_t* handle)
+                {
+                    delete static_cast<WaitData*>(handle->data);
+                }
+            );
         },
         milliseconds,
         0
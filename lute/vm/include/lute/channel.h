@@ -0,0 +1,24 @@
+#pragma once
+
+#include <memory>
+
+struct lua_State;
+
+namespace vm
+{
+
+struct ChannelState;
+
+// Sets up the Channel metatable in this VM
+void initializeChannels(lua_State* L);
+
+// Pushes a handle to the channel; handles in different VMs share the same queue
+void pushChannel(lua_State* L, std::shared_ptr<ChannelState> channel);
+
+// Returns the channel at idx, or nullptr when it is not a Channel
+std::shared_ptr<ChannelState>* toChannel(lua_State* L, int idx);
+
+/* Takes an optional capacity and returns a Channel that any VM it is sent to can send and receive values on */
+int channel(lua_State* L);
+
+} // namespace vm
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "lute/channel.h"
+#include "lute/sharedbuffer.h"
+#include "lute/sharedtable.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct lua_State;
+struct Ref;
+struct ResumeTokenData;
+struct Runtime;
+
+namespace vm
+{
+
+// Values encoded in a flat byte buffer, so they can be moved to another VM without an intermediate lua_State.
+// The format is tagged and length-prefixed; strings seen earlier in the same message are sent as back references.
+struct MarshalledValues
+{
+    MarshalledValues() = default;
+    MarshalledValues(const MarshalledValues&) = delete;
+    MarshalledValues& operator=(const MarshalledValues&) = delete;
+    ~MarshalledValues();
+
+    std::vector<uint8_t> data;
+    int count = 0;
+
+    // Buffers are not copied into data. By default each one is copied once at encode time into ownedBuffers. When a
+    // lender runtime is given, the receiving VM instead copies them straight out of the sender's memory, which is kept
+    // alive by 'retained' until the values are decoded. The references belong to 'owner' and are released on its thread,
+    // and holding 'owner' keeps that VM alive.
+    struct BorrowedBuffer
+    {
+        const void* data = nullptr;
+        size_t size = 0;
+    };
+
+    std::vector<BorrowedBuffer> buffers;
+    std::vector<std::shared_ptr<Ref>> retained;
+    std::shared_ptr<Runtime> owner;
+    std::vector<std::vector<uint8_t>> ownedBuffers;
+
+    // Shared tables travel as references to their data, which every VM can read
+    std::vector<SharedTableProxy> sharedTables;
+    std::vector<std::shared_ptr<ChannelState>> channels;
+    std::vector<std::shared_ptr<SharedMemory>> sharedBuffers;
+
+    // Names of the registered metatables used in the message, which the receiving VM has to know
+    std::vector<std::string> metatableNames;
+    // Set when a table or buffer appears more than once, so the decoder has to remember what it decoded
+    bool hasObjectRefs = false;
+
+    // Hands the references on the sender's buffers back to its runtime to be released
+    void releaseRetained();
+};
+
+// Encodes the values from index 'first' to the top of the stack of L. On failure, e.g. when a value is a function, returns false
+// and sets error; the stack of L is left as it was either way. Buffers are copied unless 'lender' is the runtime of L, which
+// the values then keep alive so the receiver can read the buffers in place
+bool marshallValues(lua_State* L, int first, MarshalledValues& values, std::string& error, std::shared_ptr<Runtime> lender = nullptr);
+
+// Checks that every metatable name used by the values is registered in the VM of L, which has to happen before decoding
+bool checkMetatables(lua_State* L, const MarshalledValues& values, std::string& error);
+
+// Decodes the values onto the stack of L and returns how many were pushed. Borrowed buffers are released afterwards, so
+// the values can only be decoded once
+int unmarshallValues(lua_State* L, MarshalledValues& values);
+
+// Resumes the thread behind 'source' with the values. Values that use registered metatables are first checked on its
+// runtime, failing the token when a name is missing there, as a continuation cannot raise an error
+void completeWithValues(const std::shared_ptr<ResumeTokenData>& source, std::shared_ptr<MarshalledValues> values);
+
+/* Takes a name and a frozen metatable. Tables with this metatable keep it when sent to a VM that registered the same name */
+int registerMetatable(lua_State* L);
+
+} // namespace vm
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "lua.h"
+#include "lualib.h"
+
+#include <memory>
+
+namespace vm
+{
+
+struct SharedMemory;
+
+// Sets up the SharedBuffer metatable in this VM
+void initializeSharedBuffers(lua_State* L);
+
+// Pushes a handle to the memory; handles in different VMs see the same bytes
+void pushSharedBuffer(lua_State* L, std::shared_ptr<SharedMemory> memory);
+
+// Returns the shared buffer at idx, or nullptr when it is not a SharedBuffer
+std::shared_ptr<SharedMemory>* toSharedBuffer(lua_State* L, int idx);
+
+/* Takes a size in bytes and returns a zeroed SharedBuffer that child VMs it is sent to read and write directly */
+int sharedbuffer(lua_State* L);
+
+/* Atomic operations on the aligned 32-bit signed integers of a SharedBuffer, by byte offset */
+int atomicLoad(lua_State* L);
+int atomicStore(lua_State* L);
+int atomicAdd(lua_State* L);
+int atomicCas(lua_State* L);
+int atomicWait(lua_State* L);
+int atomicNotify(lua_State* L);
+
+static const luaL_Reg atomicLib[] = {
+    {"load", atomicLoad},
+    {"store", atomicStore},
+    {"add", atomicAdd},
+    {"cas", atomicCas},
+    {"wait", atomicWait},
+    {"notify", atomicNotify},
+    {nullptr, nullptr},
+};
+
+} // namespace vm
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+
+struct lua_State;
+
+namespace vm
+{
+
+struct SharedData;
+struct SharedTable;
+
+// A read-only view of a table built by vm.share. The data lives outside of any VM and is shared by every proxy to it,
+// in any number of VMs
+struct SharedTableProxy
+{
+    std::shared_ptr<const SharedData> data;
+    const SharedTable* table = nullptr;
+};
+
+// Sets up the SharedTable metatable in this VM
+void initializeSharedTables(lua_State* L);
+
+// Pushes the proxy for 'table', which belongs to 'data'. Proxies are cached per VM, so the same table reads as the same value
+void pushSharedTable(lua_State* L, std::shared_ptr<const SharedData> data, const SharedTable* table);
+
+// Returns the proxy at idx, or nullptr when it is not a SharedTable
+SharedTableProxy* toSharedTable(lua_State* L, int idx);
+
+/* Takes a table and returns a read-only SharedTable with a deep copy of its contents, that child VMs receive without copying */
+int share(lua_State* L);
+
+} // namespace vm
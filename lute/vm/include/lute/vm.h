@@ -3,6 +3,10 @@
 #include "lua.h"
 #include "lualib.h"
 
+#include "lute/channel.h"
+#include "lute/marshal.h"
+#include "lute/sharedbuffer.h"
+#include "lute/sharedtable.h"
 #include "lute/spawn.h"
 
 // open the library as a standard global luau library
@@ -17,6 +21,10 @@ int lua_defer(lua_State* L);
 
 static const luaL_Reg lib[] = {
     {"create", lua_spawn},
+    {"share", share},
+    {"registermetatable", registerMetatable},
+    {"channel", channel},
+    {"sharedbuffer", sharedbuffer},
     {nullptr, nullptr},
 };
 
@@ -0,0 +1,287 @@
+#include "lute/channel.h"
+
+#include "lute/marshal.h"
+#include "lute/runtime.h"
+#include "lute/userdatas.h"
+
+#include "lua.h"
+#include "lualib.h"
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace vm
+{
+
+static constexpr size_t kDefaultChannelCapacity = 64;
+
+struct ChannelState
+{
+    explicit ChannelState(size_t capacity)
+        : capacity(capacity)
+        , ring(capacity)
+    {
+    }
+
+    // Only guards the queues below; messages are encoded before and decoded after it is held
+    std::mutex mutex;
+
+    const size_t capacity;
+    // 'count' messages waiting to be received, starting at 'head'
+    std::vector<std::shared_ptr<MarshalledValues>> ring;
+    size_t head = 0;
+    size_t count = 0;
+    bool closed = false;
+
+    // Receivers waiting for a message, and senders waiting for room with the message they are sending, oldest first
+    std::deque<ResumeToken> receivers;
+    std::deque<std::pair<ResumeToken, std::shared_ptr<MarshalledValues>>> senders;
+
+    void push(std::shared_ptr<MarshalledValues> message)
+    {
+        ring[(head + count) % capacity] = std::move(message);
+        count++;
+    }
+
+    std::shared_ptr<MarshalledValues> pop()
+    {
+        std::shared_ptr<MarshalledValues> message = std::move(ring[head]);
+        head = (head + 1) % capacity;
+        count--;
+        return message;
+    }
+};
+
+static ChannelState& checkChannel(lua_State* L, int idx)
+{
+    std::shared_ptr<ChannelState>* channel = toChannel(L, idx);
+    if (!channel)
+        luaL_typeerrorL(L, idx, "Channel");
+
+    return **channel;
+}
+
+// Sends the values after the channel. Returns at once while there is room or a receiver is waiting, otherwise yields until a
+// receiver makes room
+static int channelSend(lua_State* L)
+{
+    ChannelState& channel = checkChannel(L, 1);
+
+    auto message = std::make_shared<MarshalledValues>();
+    std::string error;
+    // send returns before the message is received, possibly after the sending VM is gone, so buffers are copied
+    if (!marshallValues(L, 2, *message, error))
+        luaL_errorL(L, "Failed to send on channel: %s", error.c_str());
+
+    bool canWait = lua_isyieldable(L);
+    const char* failure = nullptr;
+    ResumeToken receiver;
+
+    {
+        std::unique_lock lock(channel.mutex);
+
+        if (channel.closed)
+        {
+            failure = "send on a closed channel";
+        }
+        else if (!channel.receivers.empty())
+        {
+            receiver = std::move(channel.receivers.front());
+            channel.receivers.pop_front();
+        }
+        else if (channel.count < channel.capacity)
+        {
+            channel.push(std::move(message));
+            return 0;
+        }
+        else if (!canWait)
+        {
+            failure = "cannot wait on a full channel from a thread that cannot yield";
+        }
+        else
+        {
+            channel.senders.emplace_back(getResumeToken(L), std::move(message));
+            lock.unlock();
+
+            return lua_yield(L, 0);
+        }
+    }
+
+    if (failure)
+        luaL_errorL(L, "%s", failure);
+
+    completeWithValues(receiver, std::move(message));
+    return 0;
+}
+
+// Returns the values of the oldest message, yielding until one is sent. Returns nothing once the channel is closed and empty
+static int channelRecv(lua_State* L)
+{
+    ChannelState& channel = checkChannel(L, 1);
+    bool canWait = lua_isyieldable(L);
+
+    std::shared_ptr<MarshalledValues> message;
+    ResumeToken sender;
+
+    {
+        std::unique_lock lock(channel.mutex);
+
+        if (channel.count > 0)
+        {
+            message = channel.pop();
+
+            // the oldest waiting sender takes the freed slot
+            if (!channel.senders.empty())
+            {
+                auto [token, pending] = std::move(channel.senders.front());
+                channel.senders.pop_front();
+
+                channel.push(std::move(pending));
+                sender = std::move(token);
+            }
+        }
+        else if (!channel.senders.empty())
+        {
+            // without capacity, values go straight from a waiting sender to the receiver
+            auto [token, pending] = std::move(channel.senders.front());
+            channel.senders.pop_front();
+
+            message = std::move(pending);
+            sender = std::move(token);
+        }
+        else if (channel.closed)
+        {
+            return 0;
+        }
+        else if (canWait)
+        {
+            channel.receivers.push_back(getResumeToken(L));
+            lock.unlock();
+
+            return lua_yield(L, 0);
+        }
+    }
+
+    if (!message)
+        luaL_errorL(L, "cannot wait on an empty channel from a thread that cannot yield");
+
+    if (sender)
+    {
+        sender->complete(
+            [](lua_State* L)
+            {
+                return 0;
+            }
+        );
+    }
+
+    std::string error;
+    if (!checkMetatables(L, *message, error))
+        luaL_errorL(L, "Failed to receive from channel: %s", error.c_str());
+
+    return unmarshallValues(L, *message);
+}
+
+// Stops further sends. Messages already in the channel can still be received, waiting receivers get nothing and waiting
+// senders fail
+static int channelClose(lua_State* L)
+{
+    ChannelState& channel = checkChannel(L, 1);
+
+    std::deque<ResumeToken> receivers;
+    std::deque<std::pair<ResumeToken, std::shared_ptr<MarshalledValues>>> senders;
+
+    {
+        std::unique_lock lock(channel.mutex);
+
+        channel.closed = true;
+        receivers.swap(channel.receivers);
+        senders.swap(channel.senders);
+    }
+
+    for (ResumeToken& receiver : receivers)
+    {
+        receiver->complete(
+            [](lua_State* L)
+            {
+                return 0;
+            }
+        );
+    }
+
+    for (auto& [sender, message] : senders)
+        sender->fail("send on a closed channel");
+
+    return 0;
+}
+
+static int channelLen(lua_State* L)
+{
+    ChannelState& channel = checkChannel(L, 1);
+
+    std::unique_lock lock(channel.mutex);
+    lua_pushinteger(L, int(channel.count));
+    return 1;
+}
+
+static const luaL_Reg channelMethods[] = {
+    {"send", channelSend},
+    {"recv", channelRecv},
+    {"close", channelClose},
+    {"len", channelLen},
+    {nullptr, nullptr},
+};
+
+void initializeChannels(lua_State* L)
+{
+    luaL_newmetatable(L, "Channel");
+
+    lua_newtable(L);
+    for (const luaL_Reg* method = channelMethods; method->name; method++)
+    {
+        lua_pushcfunction(L, method->func, method->name);
+        lua_setfield(L, -2, method->name);
+    }
+    lua_setreadonly(L, -1, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushstring(L, "Channel");
+    lua_setfield(L, -2, "__type");
+
+    lua_setuserdatametatable(L, kChannelTag);
+
+    lua_setuserdatadtor(
+        L,
+        kChannelTag,
+        [](lua_State* L, void* userdata)
+        {
+            static_cast<std::shared_ptr<ChannelState>*>(userdata)->~shared_ptr();
+        }
+    );
+}
+
+void pushChannel(lua_State* L, std::shared_ptr<ChannelState> channel)
+{
+    new (lua_newuserdatataggedwithmetatable(L, sizeof(std::shared_ptr<ChannelState>), kChannelTag))
+        std::shared_ptr<ChannelState>(std::move(channel));
+}
+
+std::shared_ptr<ChannelState>* toChannel(lua_State* L, int idx)
+{
+    return static_cast<std::shared_ptr<ChannelState>*>(lua_touserdatatagged(L, idx, kChannelTag));
+}
+
+int channel(lua_State* L)
+{
+    int capacity = luaL_optinteger(L, 1, int(kDefaultChannelCapacity));
+    if (capacity < 0)
+        luaL_errorL(L, "channel capacity must not be negative");
+
+    pushChannel(L, std::make_shared<ChannelState>(size_t(capacity)));
+    return 1;
+}
+
+} // namespace vm
@@ -0,0 +1,696 @@
+#include "lute/marshal.h"
+
+#include "lute/ref.h"
+#include "lute/runtime.h"
+
+#include "lua.h"
+#include "lualib.h"
+
+#include <assert.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+namespace vm
+{
+
+enum class MarshalTag : uint8_t
+{
+    Nil,
+    False,
+    True,
+    // Integral numbers, as a zigzag varint
+    Integer,
+    Number,
+    // Length-prefixed bytes, recorded for later back references
+    String,
+    // Index of a string sent earlier in the message
+    StringRef,
+    // Array and hash entry counts, then the array values, then key/value pairs
+    Table,
+    // Index into MarshalledValues::buffers
+    Buffer,
+    // Index into MarshalledValues::sharedTables
+    SharedTable,
+    // LUA_VECTOR_SIZE floats
+    Vector,
+    // A metatable name (as a String or StringRef) followed by a Table
+    TableWithMetatable,
+    // Index of a table or buffer sent earlier in the message, in the order they were first sent
+    ObjectRef,
+    // Index into MarshalledValues::channels
+    Channel,
+    // Index into MarshalledValues::sharedBuffers
+    SharedBuffer,
+};
+
+// Nested tables are written recursively, so very deep nesting is rejected instead of exhausting the C stack
+static constexpr int kMaxMarshalDepth = 256;
+
+// Registry tables of the metatables registered with vm.registermetatable in this VM, by name and by metatable
+static const char* kMetatablesByNameKey = "vm.metatablesByName";
+static const char* kMetatableNamesKey = "vm.metatableNames";
+
+struct Encoder
+{
+    lua_State* L;
+    MarshalledValues& values;
+    std::vector<uint8_t>& out = values.data;
+    std::unordered_map<const char*, uint32_t> strings;
+    // Tables and buffers already written, by address
+    std::unordered_map<const void*, uint32_t> objects;
+    std::string error;
+    // Where the failing value is, built while unwinding, e.g. ".items[3]"
+    std::string location;
+
+    void writeByte(uint8_t byte)
+    {
+        out.push_back(byte);
+    }
+
+    void writeVarint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(uint8_t(value | 0x80));
+            value >>= 7;
+        }
+
+        out.push_back(uint8_t(value));
+    }
+
+    void writeBytes(const void* data, size_t size)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        out.insert(out.end(), bytes, bytes + size);
+    }
+
+    void patchUint32(size_t offset, uint32_t value)
+    {
+        memcpy(out.data() + offset, &value, sizeof(value));
+    }
+
+    void writeNumber(double number)
+    {
+        // 2^53 keeps the conversion exact; -0 has to stay a double
+        if (number == std::floor(number) && std::fabs(number) <= 9007199254740992.0 && !(number == 0 && std::signbit(number)))
+        {
+            int64_t integer = static_cast<int64_t>(number);
+
+            writeByte(uint8_t(MarshalTag::Integer));
+            writeVarint((uint64_t(integer) << 1) ^ uint64_t(integer >> 63));
+            return;
+        }
+
+        writeByte(uint8_t(MarshalTag::Number));
+        writeBytes(&number, sizeof(number));
+    }
+
+    void writeString(int idx)
+    {
+        size_t length = 0;
+        const char* str = lua_tolstring(L, idx, &length);
+
+        // Luau interns strings, so equal strings share their address
+        auto [it, inserted] = strings.try_emplace(str, uint32_t(strings.size()));
+
+        if (!inserted)
+        {
+            writeByte(uint8_t(MarshalTag::StringRef));
+            writeVarint(it->second);
+            return;
+        }
+
+        writeByte(uint8_t(MarshalTag::String));
+        writeVarint(length);
+        writeBytes(str, length);
+    }
+
+    void writeVector(int idx)
+    {
+        const float* vector = lua_tovector(L, idx);
+
+        writeByte(uint8_t(MarshalTag::Vector));
+        writeBytes(vector, LUA_VECTOR_SIZE * sizeof(float));
+    }
+
+    // Writes an ObjectRef and returns true when the object at idx was already written; numbers it otherwise
+    bool writeObjectRef(int idx)
+    {
+        auto [it, inserted] = objects.try_emplace(lua_topointer(L, idx), uint32_t(objects.size()));
+
+        if (inserted)
+            return false;
+
+        writeByte(uint8_t(MarshalTag::ObjectRef));
+        writeVarint(it->second);
+        values.hasObjectRefs = true;
+        return true;
+    }
+
+    void writeBuffer(int idx)
+    {
+        size_t size = 0;
+        const void* data = lua_tobuffer(L, idx, &size);
+
+        writeByte(uint8_t(MarshalTag::Buffer));
+        writeVarint(values.buffers.size());
+
+        if (values.owner)
+        {
+            values.buffers.push_back({data, size});
+            values.retained.push_back(std::make_shared<Ref>(L, idx));
+            return;
+        }
+
+        // Moving the vector along with ownedBuffers keeps its storage in place, so the pointer stays valid
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        values.ownedBuffers.emplace_back(bytes, bytes + size);
+        values.buffers.push_back({values.ownedBuffers.back().data(), size});
+    }
+
+    // Sends the name the metatable of the table at idx was registered under, if it has one. Metatables that were not
+    // registered are not sent, as before they could be
+    void writeMetatableName(int idx)
+    {
+        if (!lua_getmetatable(L, idx))
+            return;
+
+        lua_getfield(L, LUA_REGISTRYINDEX, kMetatableNamesKey);
+        if (lua_istable(L, -1))
+        {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, -2);
+
+            if (lua_isstring(L, -1))
+            {
+                writeByte(uint8_t(MarshalTag::TableWithMetatable));
+                writeString(-1);
+                values.metatableNames.emplace_back(lua_tostring(L, -1));
+            }
+
+            lua_pop(L, 1);
+        }
+
+        lua_pop(L, 2);
+    }
+
+    void describeKey(int idx)
+    {
+        char segment[64];
+
+        if (lua_type(L, idx) == LUA_TSTRING)
+        {
+            location.insert(0, std::string(".") + lua_tostring(L, idx));
+            return;
+        }
+
+        if (lua_type(L, idx) == LUA_TNUMBER)
+            snprintf(segment, sizeof(segment), "[%.14g]", lua_tonumber(L, idx));
+        else
+            snprintf(segment, sizeof(segment), "[%s key]", luaL_typename(L, idx));
+
+        location.insert(0, segment);
+    }
+
+    bool writeTable(int idx, int depth)
+    {
+        if (depth >= kMaxMarshalDepth)
+        {
+            error = "table is nested too deeply";
+            return false;
+        }
+
+        if (!lua_checkstack(L, 4))
+        {
+            error = "out of stack space";
+            return false;
+        }
+
+        idx = lua_absindex(L, idx);
+
+        if (writeObjectRef(idx))
+            return true;
+
+        writeMetatableName(idx);
+        writeByte(uint8_t(MarshalTag::Table));
+
+        size_t countsOffset = out.size();
+        out.resize(out.size() + 2 * sizeof(uint32_t));
+
+        // Iteration visits the array part in order first: values with keys continuing 1, 2, 3... are sent without their keys
+        // until the first other key, everything after that as pairs
+        uint32_t arrayCount = 0;
+        uint32_t pairCount = 0;
+
+        for (int i = 0; i = lua_rawiter(L, idx, i), i >= 0;)
+        {
+            if (pairCount == 0 && lua_type(L, -2) == LUA_TNUMBER && lua_tonumber(L, -2) == double(arrayCount + 1))
+            {
+                arrayCount++;
+            }
+            else
+            {
+                if (!writeValue(-2, depth + 1))
+                {
+                    describeKey(-2);
+                    lua_pop(L, 2);
+                    return false;
+                }
+
+                pairCount++;
+            }
+
+            if (!writeValue(-1, depth + 1))
+            {
+                describeKey(-2);
+                lua_pop(L, 2);
+                return false;
+            }
+
+            lua_pop(L, 2);
+        }
+
+        patchUint32(countsOffset, arrayCount);
+        patchUint32(countsOffset + sizeof(uint32_t), pairCount);
+        return true;
+    }
+
+    bool writeValue(int idx, int depth)
+    {
+        switch (lua_type(L, idx))
+        {
+        case LUA_TNIL:
+            writeByte(uint8_t(MarshalTag::Nil));
+            return true;
+        case LUA_TBOOLEAN:
+            writeByte(uint8_t(lua_toboolean(L, idx) ? MarshalTag::True : MarshalTag::False));
+            return true;
+        case LUA_TNUMBER:
+            writeNumber(lua_tonumber(L, idx));
+            return true;
+        case LUA_TVECTOR:
+            writeVector(idx);
+            return true;
+        case LUA_TSTRING:
+            writeString(idx);
+            return true;
+        case LUA_TTABLE:
+            return writeTable(idx, depth);
+        case LUA_TBUFFER:
+            if (!writeObjectRef(idx))
+                writeBuffer(idx);
+            return true;
+        case LUA_TUSERDATA:
+            if (SharedTableProxy* proxy = toSharedTable(L, idx))
+            {
+                writeByte(uint8_t(MarshalTag::SharedTable));
+                writeVarint(values.sharedTables.size());
+                values.sharedTables.push_back(*proxy);
+                return true;
+            }
+
+            if (std::shared_ptr<ChannelState>* channel = toChannel(L, idx))
+            {
+                writeByte(uint8_t(MarshalTag::Channel));
+                writeVarint(values.channels.size());
+                values.channels.push_back(*channel);
+                return true;
+            }
+
+            if (std::shared_ptr<SharedMemory>* memory = toSharedBuffer(L, idx))
+            {
+                writeByte(uint8_t(MarshalTag::SharedBuffer));
+                writeVarint(values.sharedBuffers.size());
+                values.sharedBuffers.push_back(*memory);
+                return true;
+            }
+            break;
+        default:
+            break;
+        }
+
+        error = std::string("cannot send a ") + luaL_typename(L, idx) + " between VMs";
+        return false;
+    }
+};
+
+struct Decoder
+{
+    lua_State* L;
+    const MarshalledValues& values;
+    const uint8_t* data = values.data.data();
+    // Offset and length of every String, in the order they were sent
+    std::vector<std::pair<size_t, size_t>> strings;
+    size_t pos = 0;
+
+    // Stack index of the table holding every decoded table and buffer, only when the message has back references
+    int objects = 0;
+    int objectCount = 0;
+
+    uint8_t readByte()
+    {
+        return data[pos++];
+    }
+
+    uint64_t readVarint()
+    {
+        uint64_t value = 0;
+
+        for (int shift = 0;; shift += 7)
+        {
+            uint8_t byte = data[pos++];
+            value |= uint64_t(byte & 0x7f) << shift;
+
+            if ((byte & 0x80) == 0)
+                return value;
+        }
+    }
+
+    uint32_t readUint32()
+    {
+        uint32_t value;
+        memcpy(&value, data + pos, sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+
+    // Numbers the object on top of the stack for later ObjectRefs
+    void recordObject()
+    {
+        objectCount++;
+
+        if (objects == 0)
+            return;
+
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, objects, objectCount);
+    }
+
+    void readTable()
+    {
+        uint32_t arrayCount = readUint32();
+        uint32_t pairCount = readUint32();
+
+        luaL_checkstack(L, 3, "unmarshalling a nested table");
+        lua_createtable(L, int(arrayCount), int(pairCount));
+        recordObject();
+
+        for (uint32_t i = 0; i < arrayCount; i++)
+        {
+            readValue();
+            lua_rawseti(L, -2, int(i + 1));
+        }
+
+        for (uint32_t i = 0; i < pairCount; i++)
+        {
+            readValue();
+            readValue();
+            lua_rawset(L, -3);
+        }
+    }
+
+    void readValue()
+    {
+        switch (MarshalTag(readByte()))
+        {
+        case MarshalTag::Nil:
+            lua_pushnil(L);
+            break;
+        case MarshalTag::False:
+            lua_pushboolean(L, false);
+            break;
+        case MarshalTag::True:
+            lua_pushboolean(L, true);
+            break;
+        case MarshalTag::Integer:
+        {
+            uint64_t zigzag = readVarint();
+            int64_t integer = int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1);
+            lua_pushnumber(L, double(integer));
+            break;
+        }
+        case MarshalTag::Number:
+        {
+            double number;
+            memcpy(&number, data + pos, sizeof(number));
+            pos += sizeof(number);
+            lua_pushnumber(L, number);
+            break;
+        }
+        case MarshalTag::Vector:
+        {
+            float vector[LUA_VECTOR_SIZE];
+            memcpy(vector, data + pos, sizeof(vector));
+            pos += sizeof(vector);
+#if LUA_VECTOR_SIZE == 4
+            lua_pushvector(L, vector[0], vector[1], vector[2], vector[3]);
+#else
+            lua_pushvector(L, vector[0], vector[1], vector[2]);
+#endif
+            break;
+        }
+        case MarshalTag::String:
+        {
+            size_t length = readVarint();
+            strings.emplace_back(pos, length);
+            lua_pushlstring(L, reinterpret_cast<const char*>(data + pos), length);
+            pos += length;
+            break;
+        }
+        case MarshalTag::StringRef:
+        {
+            auto [offset, length] = strings[readVarint()];
+            lua_pushlstring(L, reinterpret_cast<const char*>(data + offset), length);
+            break;
+        }
+        case MarshalTag::Table:
+            readTable();
+            break;
+        case MarshalTag::TableWithMetatable:
+        {
+            // name, then the table
+            readValue();
+            readByte();
+            readTable();
+
+            lua_getfield(L, LUA_REGISTRYINDEX, kMetatablesByNameKey);
+            if (lua_istable(L, -1))
+            {
+                lua_pushvalue(L, -3);
+                lua_rawget(L, -2);
+            }
+            else
+            {
+                lua_pushnil(L);
+            }
+
+            // checkMetatables made sure the name is registered before decoding started
+            if (lua_istable(L, -1))
+                lua_setmetatable(L, -3);
+            else
+                lua_pop(L, 1);
+
+            lua_pop(L, 1);
+            lua_remove(L, -2);
+            break;
+        }
+        case MarshalTag::Buffer:
+        {
+            const MarshalledValues::BorrowedBuffer& borrowed = values.buffers[readVarint()];
+            void* buffer = lua_newbuffer(L, borrowed.size);
+            memcpy(buffer, borrowed.data, borrowed.size);
+            recordObject();
+            break;
+        }
+        case MarshalTag::SharedTable:
+        {
+            const SharedTableProxy& proxy = values.sharedTables[readVarint()];
+            pushSharedTable(L, proxy.data, proxy.table);
+            break;
+        }
+        case MarshalTag::Channel:
+            pushChannel(L, values.channels[readVarint()]);
+            break;
+        case MarshalTag::SharedBuffer:
+            pushSharedBuffer(L, values.sharedBuffers[readVarint()]);
+            break;
+        case MarshalTag::ObjectRef:
+            lua_rawgeti(L, objects, int(readVarint()) + 1);
+            break;
+        }
+    }
+};
+
+MarshalledValues::~MarshalledValues()
+{
+    releaseRetained();
+}
+
+void MarshalledValues::releaseRetained()
+{
+    if (retained.empty())
+        return;
+
+    // lua_unref is not thread-safe, so the references are dropped by the runtime that made them. Should it stop before it
+    // gets to them, its destructor drops them with the rest of its continuations, still ahead of closing the VM
+    owner->schedule(
+        [retained = std::move(retained)]() mutable
+        {
+            retained.clear();
+        }
+    );
+
+    retained.clear();
+    buffers.clear();
+    owner.reset();
+}
+
+bool marshallValues(lua_State* L, int first, MarshalledValues& values, std::string& error, std::shared_ptr<Runtime> lender)
+{
+    int top = lua_gettop(L);
+
+    assert(!lender || lender.get() == getRuntime(L));
+
+    Encoder encoder{L, values};
+    values.count = 0;
+    values.owner = std::move(lender);
+
+    for (int idx = first; idx <= top; idx++)
+    {
+        if (!encoder.writeValue(idx, 0))
+        {
+            lua_settop(L, top);
+            error = encoder.error + " (at value " + std::to_string(idx - first + 1) + encoder.location + ")";
+            return false;
+        }
+
+        values.count++;
+    }
+
+    return true;
+}
+
+bool checkMetatables(lua_State* L, const MarshalledValues& values, std::string& error)
+{
+    if (values.metatableNames.empty())
+        return true;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, kMetatablesByNameKey);
+
+    for (const std::string& name : values.metatableNames)
+    {
+        bool registered = false;
+
+        if (lua_istable(L, -1))
+        {
+            lua_getfield(L, -1, name.c_str());
+            registered = lua_istable(L, -1);
+            lua_pop(L, 1);
+        }
+
+        if (!registered)
+        {
+            lua_pop(L, 1);
+            error = "metatable '" + name + "' is not registered in the receiving VM";
+            return false;
+        }
+    }
+
+    lua_pop(L, 1);
+    return true;
+}
+
+int unmarshallValues(lua_State* L, MarshalledValues& values)
+{
+    luaL_checkstack(L, values.count + 1, "too many values to unmarshall");
+
+    Decoder decoder{L, values};
+
+    if (values.hasObjectRefs)
+    {
+        lua_newtable(L);
+        decoder.objects = lua_gettop(L);
+    }
+
+    for (int i = 0; i < values.count; i++)
+        decoder.readValue();
+
+    if (decoder.objects != 0)
+        lua_remove(L, decoder.objects);
+
+    values.releaseRetained();
+
+    return values.count;
+}
+
+static void resumeWithValues(const ResumeToken& source, std::shared_ptr<MarshalledValues> values)
+{
+    source->complete(
+        [values](lua_State* L)
+        {
+            return unmarshallValues(L, *values);
+        }
+    );
+}
+
+void completeWithValues(const ResumeToken& source, std::shared_ptr<MarshalledValues> values)
+{
+    if (values->metatableNames.empty())
+    {
+        resumeWithValues(source, std::move(values));
+        return;
+    }
+
+    source->runtime->schedule(
+        [source, values]
+        {
+            std::string error;
+            if (!checkMetatables(source->runtime->GL, *values, error))
+                source->fail("Failed to copy values between VMs: " + error);
+            else
+                resumeWithValues(source, values);
+        }
+    );
+}
+
+int registerMetatable(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    if (!lua_getreadonly(L, 2))
+        luaL_errorL(L, "metatable '%s' must be frozen to be sent between VMs", name);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, kMetatablesByNameKey);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, kMetatablesByNameKey);
+
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, kMetatableNamesKey);
+    }
+
+    lua_getfield(L, -1, name);
+    if (!lua_isnil(L, -1) && !lua_rawequal(L, -1, 2))
+        luaL_errorL(L, "a different metatable is already registered as '%s'", name);
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, 2);
+    lua_setfield(L, -2, name);
+    lua_pop(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, kMetatableNamesKey);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+} // namespace vm
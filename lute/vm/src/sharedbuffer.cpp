@@ -0,0 +1,334 @@
+#include "lute/sharedbuffer.h"
+
+#include "lute/runtime.h"
+#include "lute/userdatas.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+
+namespace vm
+{
+
+static_assert(sizeof(std::atomic<int32_t>) == sizeof(int32_t), "shared buffer words must have the layout of int32_t");
+
+struct SharedMemory
+{
+    explicit SharedMemory(size_t size)
+        : size(size)
+        , words(new std::atomic<int32_t>[(size + sizeof(int32_t) - 1) / sizeof(int32_t)]())
+    {
+    }
+
+    uint8_t* bytes() const
+    {
+        return reinterpret_cast<uint8_t*>(words.get());
+    }
+
+    const size_t size;
+    // Stored as words so atomics can be used on aligned offsets; plain reads and writes go through bytes() like buffer does
+    std::unique_ptr<std::atomic<int32_t>[]> words;
+
+    // Coroutines in atomic.wait, by the offset they wait on
+    std::mutex waitersMutex;
+    std::unordered_map<size_t, std::deque<ResumeToken>> waiters;
+};
+
+static SharedMemory& checkSharedBuffer(lua_State* L, int idx)
+{
+    std::shared_ptr<SharedMemory>* memory = toSharedBuffer(L, idx);
+    if (!memory)
+        luaL_typeerrorL(L, idx, "SharedBuffer");
+
+    return **memory;
+}
+
+static size_t checkSharedRange(lua_State* L, const SharedMemory& memory, int arg, size_t size)
+{
+    double offset = luaL_checknumber(L, arg);
+
+    if (size > memory.size || !(offset >= 0) || offset != std::floor(offset) || offset > static_cast<double>(memory.size - size))
+        luaL_errorL(L, "shared buffer access out of bounds");
+
+    return static_cast<size_t>(offset);
+}
+
+template<typename T>
+static int sharedRead(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+    size_t offset = checkSharedRange(L, memory, 2, sizeof(T));
+
+    T value;
+    memcpy(&value, memory.bytes() + offset, sizeof(T));
+
+    lua_pushnumber(L, static_cast<double>(value));
+    return 1;
+}
+
+template<typename T>
+static int sharedWrite(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+    size_t offset = checkSharedRange(L, memory, 2, sizeof(T));
+
+    // Integers wrap around like the buffer library does
+    T value;
+    if constexpr (std::is_floating_point_v<T>)
+        value = static_cast<T>(luaL_checknumber(L, 3));
+    else
+        value = static_cast<T>(luaL_checkunsigned(L, 3));
+
+    memcpy(memory.bytes() + offset, &value, sizeof(T));
+    return 0;
+}
+
+static int sharedReadString(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+    int count = luaL_checkinteger(L, 3);
+    if (count < 0)
+        luaL_errorL(L, "count cannot be negative");
+
+    size_t offset = checkSharedRange(L, memory, 2, size_t(count));
+
+    lua_pushlstring(L, reinterpret_cast<const char*>(memory.bytes() + offset), size_t(count));
+    return 1;
+}
+
+static int sharedWriteString(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+
+    size_t length = 0;
+    const char* str = luaL_checklstring(L, 3, &length);
+
+    int count = luaL_optinteger(L, 4, int(length));
+    if (count < 0 || size_t(count) > length)
+        luaL_errorL(L, "count must be between 0 and the length of the string");
+
+    size_t offset = checkSharedRange(L, memory, 2, size_t(count));
+
+    memcpy(memory.bytes() + offset, str, size_t(count));
+    return 0;
+}
+
+static int sharedLen(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+
+    lua_pushnumber(L, static_cast<double>(memory.size));
+    return 1;
+}
+
+static const luaL_Reg sharedBufferMethods[] = {
+    {"len", sharedLen},
+    {"readi8", sharedRead<int8_t>},
+    {"readu8", sharedRead<uint8_t>},
+    {"readi16", sharedRead<int16_t>},
+    {"readu16", sharedRead<uint16_t>},
+    {"readi32", sharedRead<int32_t>},
+    {"readu32", sharedRead<uint32_t>},
+    {"readf32", sharedRead<float>},
+    {"readf64", sharedRead<double>},
+    {"readstring", sharedReadString},
+    {"writei8", sharedWrite<int8_t>},
+    {"writeu8", sharedWrite<uint8_t>},
+    {"writei16", sharedWrite<int16_t>},
+    {"writeu16", sharedWrite<uint16_t>},
+    {"writei32", sharedWrite<int32_t>},
+    {"writeu32", sharedWrite<uint32_t>},
+    {"writef32", sharedWrite<float>},
+    {"writef64", sharedWrite<double>},
+    {"writestring", sharedWriteString},
+    {nullptr, nullptr},
+};
+
+// Returns the word at a byte offset, which has to be 4-byte aligned
+static std::atomic<int32_t>& checkAtomicWord(lua_State* L, SharedMemory& memory, size_t& offset)
+{
+    offset = checkSharedRange(L, memory, 2, sizeof(int32_t));
+    if (offset % sizeof(int32_t) != 0)
+        luaL_errorL(L, "atomic offset must be a multiple of 4");
+
+    return memory.words[offset / sizeof(int32_t)];
+}
+
+int atomicLoad(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+    size_t offset = 0;
+    std::atomic<int32_t>& word = checkAtomicWord(L, memory, offset);
+
+    lua_pushinteger(L, word.load());
+    return 1;
+}
+
+int atomicStore(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+    size_t offset = 0;
+    std::atomic<int32_t>& word = checkAtomicWord(L, memory, offset);
+
+    word.store(int32_t(luaL_checkinteger(L, 3)));
+    return 0;
+}
+
+// Returns the value before the addition; the result wraps around
+int atomicAdd(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+    size_t offset = 0;
+    std::atomic<int32_t>& word = checkAtomicWord(L, memory, offset);
+
+    lua_pushinteger(L, word.fetch_add(int32_t(luaL_checkinteger(L, 3))));
+    return 1;
+}
+
+// Stores 'desired' if the word holds 'expected'. Returns the value the word held, which equals 'expected' on success
+int atomicCas(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+    size_t offset = 0;
+    std::atomic<int32_t>& word = checkAtomicWord(L, memory, offset);
+
+    int32_t expected = int32_t(luaL_checkinteger(L, 3));
+    int32_t desired = int32_t(luaL_checkinteger(L, 4));
+
+    word.compare_exchange_strong(expected, desired);
+
+    lua_pushinteger(L, expected);
+    return 1;
+}
+
+// Yields while the word holds 'expected', until a notify on the same offset. Returns "ok" when woken and "not-equal" when the
+// word already held another value. The check and the registration happen under the lock notify takes, so a store followed by a
+// notify cannot be missed
+int atomicWait(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+    size_t offset = 0;
+    std::atomic<int32_t>& word = checkAtomicWord(L, memory, offset);
+
+    int32_t expected = int32_t(luaL_checkinteger(L, 3));
+
+    if (!lua_isyieldable(L))
+        luaL_errorL(L, "atomic.wait cannot be called from a thread that cannot yield");
+
+    {
+        std::unique_lock lock(memory.waitersMutex);
+
+        if (word.load() != expected)
+        {
+            lua_pushstring(L, "not-equal");
+            return 1;
+        }
+
+        memory.waiters[offset].push_back(getResumeToken(L));
+    }
+
+    return lua_yield(L, 0);
+}
+
+// Wakes up to 'count' (default: all) coroutines waiting on the offset, oldest first. Returns how many were woken
+int atomicNotify(lua_State* L)
+{
+    SharedMemory& memory = checkSharedBuffer(L, 1);
+    size_t offset = 0;
+    checkAtomicWord(L, memory, offset);
+
+    int count = luaL_optinteger(L, 3, -1);
+
+    std::deque<ResumeToken> woken;
+
+    {
+        std::unique_lock lock(memory.waitersMutex);
+
+        auto it = memory.waiters.find(offset);
+        if (it != memory.waiters.end())
+        {
+            std::deque<ResumeToken>& waiting = it->second;
+
+            while (!waiting.empty() && (count < 0 || int(woken.size()) < count))
+            {
+                woken.push_back(std::move(waiting.front()));
+                waiting.pop_front();
+            }
+
+            if (waiting.empty())
+                memory.waiters.erase(it);
+        }
+    }
+
+    for (ResumeToken& token : woken)
+    {
+        token->complete(
+            [](lua_State* L)
+            {
+                lua_pushstring(L, "ok");
+                return 1;
+            }
+        );
+    }
+
+    lua_pushinteger(L, int(woken.size()));
+    return 1;
+}
+
+void initializeSharedBuffers(lua_State* L)
+{
+    luaL_newmetatable(L, "SharedBuffer");
+
+    lua_newtable(L);
+    for (const luaL_Reg* method = sharedBufferMethods; method->name; method++)
+    {
+        lua_pushcfunction(L, method->func, method->name);
+        lua_setfield(L, -2, method->name);
+    }
+    lua_setreadonly(L, -1, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, sharedLen, "SharedBuffer.__len");
+    lua_setfield(L, -2, "__len");
+
+    lua_pushstring(L, "SharedBuffer");
+    lua_setfield(L, -2, "__type");
+
+    lua_setuserdatametatable(L, kSharedBufferTag);
+
+    lua_setuserdatadtor(
+        L,
+        kSharedBufferTag,
+        [](lua_State* L, void* userdata)
+        {
+            static_cast<std::shared_ptr<SharedMemory>*>(userdata)->~shared_ptr();
+        }
+    );
+}
+
+void pushSharedBuffer(lua_State* L, std::shared_ptr<SharedMemory> memory)
+{
+    new (lua_newuserdatataggedwithmetatable(L, sizeof(std::shared_ptr<SharedMemory>), kSharedBufferTag))
+        std::shared_ptr<SharedMemory>(std::move(memory));
+}
+
+std::shared_ptr<SharedMemory>* toSharedBuffer(lua_State* L, int idx)
+{
+    return static_cast<std::shared_ptr<SharedMemory>*>(lua_touserdatatagged(L, idx, kSharedBufferTag));
+}
+
+int sharedbuffer(lua_State* L)
+{
+    double size = luaL_checknumber(L, 1);
+    if (!(size >= 0) || size != std::floor(size) || size > double(1u << 30))
+        luaL_errorL(L, "shared buffer size must be an integer between 0 and 1 GiB");
+
+    pushSharedBuffer(L, std::make_shared<SharedMemory>(size_t(size)));
+    return 1;
+}
+
+} // namespace vm
@@ -0,0 +1,461 @@
+#include "lute/sharedtable.h"
+
+#include "lute/userdatas.h"
+
+#include "lua.h"
+#include "lualib.h"
+
+#include <cmath>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace vm
+{
+
+struct SharedValue
+{
+    enum class Type : uint8_t
+    {
+        Nil,
+        Boolean,
+        Number,
+        String,
+        Table,
+    };
+
+    Type type = Type::Nil;
+    bool boolean = false;
+    double number = 0.0;
+    std::string_view string;
+    const SharedTable* table = nullptr;
+};
+
+struct SharedTable
+{
+    // Values for the keys 1..n, n being the length of the source table; holes are Nil
+    std::vector<SharedValue> array;
+
+    // The other entries, in the order the source table was iterated, indexed by key for lookups
+    std::vector<std::pair<SharedValue, SharedValue>> entries;
+    std::unordered_map<std::string_view, uint32_t> stringKeys;
+    std::unordered_map<double, uint32_t> numberKeys;
+    int32_t booleanKeys[2] = {-1, -1};
+};
+
+struct SharedData
+{
+    // deque and node-based set, so tables and strings never move once added
+    std::deque<SharedTable> tables;
+    std::unordered_set<std::string> strings;
+
+    // Shared tables from other vm.share calls that this data refers to
+    std::vector<std::shared_ptr<const SharedData>> dependencies;
+};
+
+// Nested tables are built recursively
+static constexpr int kMaxShareDepth = 512;
+
+static const char* kSharedTableProxiesKey = "vm.sharedTableProxies";
+
+// Table keys compare 0 and -0 as equal
+static double normalizeKey(double key)
+{
+    return key == 0 ? 0.0 : key;
+}
+
+struct SharedBuilder
+{
+    lua_State* L;
+    SharedData& data;
+
+    // Source tables already built, so repeated and cyclic references keep pointing at one shared table
+    std::unordered_map<const void*, const SharedTable*> built;
+    std::string error;
+
+    std::string_view intern(int idx)
+    {
+        size_t length = 0;
+        const char* str = lua_tolstring(L, idx, &length);
+
+        return *data.strings.emplace(str, length).first;
+    }
+
+    bool buildValue(int idx, SharedValue& value, int depth)
+    {
+        switch (lua_type(L, idx))
+        {
+        case LUA_TBOOLEAN:
+            value.type = SharedValue::Type::Boolean;
+            value.boolean = lua_toboolean(L, idx);
+            return true;
+        case LUA_TNUMBER:
+            value.type = SharedValue::Type::Number;
+            value.number = lua_tonumber(L, idx);
+            return true;
+        case LUA_TSTRING:
+            value.type = SharedValue::Type::String;
+            value.string = intern(idx);
+            return true;
+        case LUA_TTABLE:
+            value.type = SharedValue::Type::Table;
+            return buildTable(idx, value.table, depth);
+        case LUA_TUSERDATA:
+            if (SharedTableProxy* proxy = toSharedTable(L, idx))
+            {
+                if (proxy->data.get() != &data)
+                    data.dependencies.push_back(proxy->data);
+
+                value.type = SharedValue::Type::Table;
+                value.table = proxy->table;
+                return true;
+            }
+            break;
+        default:
+            break;
+        }
+
+        error = std::string("cannot share a ") + luaL_typename(L, idx);
+        return false;
+    }
+
+    bool addEntry(SharedTable& table)
+    {
+        SharedValue key;
+        if (!buildValue(-2, key, 0))
+            return false;
+
+        uint32_t index = uint32_t(table.entries.size());
+
+        switch (key.type)
+        {
+        case SharedValue::Type::String:
+            table.stringKeys.emplace(key.string, index);
+            break;
+        case SharedValue::Type::Number:
+            key.number = normalizeKey(key.number);
+            table.numberKeys.emplace(key.number, index);
+            break;
+        case SharedValue::Type::Boolean:
+            table.booleanKeys[key.boolean] = int32_t(index);
+            break;
+        default:
+            error = std::string("cannot share a table with ") + luaL_typename(L, -2) + " keys";
+            return false;
+        }
+
+        table.entries.emplace_back(key, SharedValue{});
+        return true;
+    }
+
+    bool buildTable(int idx, const SharedTable*& result, int depth)
+    {
+        const void* source = lua_topointer(L, idx);
+
+        if (auto it = built.find(source); it != built.end())
+        {
+            result = it->second;
+            return true;
+        }
+
+        if (depth >= kMaxShareDepth || !lua_checkstack(L, 2))
+        {
+            error = "table is nested too deeply";
+            return false;
+        }
+
+        idx = lua_absindex(L, idx);
+
+        SharedTable& table = data.tables.emplace_back();
+        built[source] = &table;
+        result = &table;
+
+        size_t length = lua_objlen(L, idx);
+        table.array.resize(length);
+
+        for (int i = 0; i = lua_rawiter(L, idx, i), i >= 0;)
+        {
+            SharedValue* value = nullptr;
+
+            double key = lua_type(L, -2) == LUA_TNUMBER ? lua_tonumber(L, -2) : 0.0;
+            if (key >= 1 && key <= double(length) && key == std::floor(key))
+            {
+                value = &table.array[size_t(key) - 1];
+            }
+            else
+            {
+                if (!addEntry(table))
+                {
+                    lua_pop(L, 2);
+                    return false;
+                }
+
+                value = &table.entries.back().second;
+            }
+
+            if (!buildValue(-1, *value, depth + 1))
+            {
+                lua_pop(L, 2);
+                return false;
+            }
+
+            lua_pop(L, 2);
+        }
+
+        return true;
+    }
+};
+
+static SharedTableProxy& checkSharedTable(lua_State* L, int idx)
+{
+    SharedTableProxy* proxy = toSharedTable(L, idx);
+    if (!proxy)
+        luaL_typeerrorL(L, idx, "SharedTable");
+
+    return *proxy;
+}
+
+static void pushSharedValue(lua_State* L, const SharedTableProxy& owner, const SharedValue& value)
+{
+    switch (value.type)
+    {
+    case SharedValue::Type::Nil:
+        lua_pushnil(L);
+        break;
+    case SharedValue::Type::Boolean:
+        lua_pushboolean(L, value.boolean);
+        break;
+    case SharedValue::Type::Number:
+        lua_pushnumber(L, value.number);
+        break;
+    case SharedValue::Type::String:
+        lua_pushlstring(L, value.string.data(), value.string.size());
+        break;
+    case SharedValue::Type::Table:
+        // The root data also keeps any dependency the nested table came from alive
+        pushSharedTable(L, owner.data, value.table);
+        break;
+    }
+}
+
+// Returns the index into entries for the key at idx, or -1
+static int64_t findEntry(lua_State* L, const SharedTable& table, int idx)
+{
+    switch (lua_type(L, idx))
+    {
+    case LUA_TSTRING:
+    {
+        size_t length = 0;
+        const char* key = lua_tolstring(L, idx, &length);
+
+        auto it = table.stringKeys.find(std::string_view(key, length));
+        return it == table.stringKeys.end() ? -1 : it->second;
+    }
+    case LUA_TNUMBER:
+    {
+        auto it = table.numberKeys.find(normalizeKey(lua_tonumber(L, idx)));
+        return it == table.numberKeys.end() ? -1 : it->second;
+    }
+    case LUA_TBOOLEAN:
+        return table.booleanKeys[lua_toboolean(L, idx) ? 1 : 0];
+    default:
+        return -1;
+    }
+}
+
+// Returns the 1-based array index for the key at idx, or 0 when the key is not in the array part
+static size_t arrayIndex(lua_State* L, const SharedTable& table, int idx)
+{
+    if (lua_type(L, idx) != LUA_TNUMBER)
+        return 0;
+
+    double key = lua_tonumber(L, idx);
+    if (key >= 1 && key <= double(table.array.size()) && key == std::floor(key))
+        return size_t(key);
+
+    return 0;
+}
+
+static int sharedIndex(lua_State* L)
+{
+    SharedTableProxy& proxy = checkSharedTable(L, 1);
+    const SharedTable& table = *proxy.table;
+
+    if (size_t index = arrayIndex(L, table, 2))
+    {
+        pushSharedValue(L, proxy, table.array[index - 1]);
+        return 1;
+    }
+
+    int64_t entry = findEntry(L, table, 2);
+    if (entry < 0)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    pushSharedValue(L, proxy, table.entries[entry].second);
+    return 1;
+}
+
+static int sharedNewIndex(lua_State* L)
+{
+    luaL_errorL(L, "attempt to modify a SharedTable");
+}
+
+static int sharedLen(lua_State* L)
+{
+    SharedTableProxy& proxy = checkSharedTable(L, 1);
+
+    lua_pushinteger(L, int(proxy.table->array.size()));
+    return 1;
+}
+
+// Stateless iteration: the position after a key is found through the same lookups as __index
+static int sharedNext(lua_State* L)
+{
+    SharedTableProxy& proxy = checkSharedTable(L, 1);
+    const SharedTable& table = *proxy.table;
+
+    // Positions count the array part first, then entries
+    size_t position = 0;
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        if (size_t index = arrayIndex(L, table, 2))
+        {
+            position = index;
+        }
+        else
+        {
+            int64_t entry = findEntry(L, table, 2);
+            if (entry < 0)
+                luaL_errorL(L, "invalid key to 'next'");
+
+            position = table.array.size() + size_t(entry) + 1;
+        }
+    }
+
+    for (; position < table.array.size(); position++)
+    {
+        if (table.array[position].type == SharedValue::Type::Nil)
+            continue;
+
+        lua_pushinteger(L, int(position + 1));
+        pushSharedValue(L, proxy, table.array[position]);
+        return 2;
+    }
+
+    size_t entry = position - table.array.size();
+    if (entry >= table.entries.size())
+        return 0;
+
+    pushSharedValue(L, proxy, table.entries[entry].first);
+    pushSharedValue(L, proxy, table.entries[entry].second);
+    return 2;
+}
+
+static int sharedIter(lua_State* L)
+{
+    checkSharedTable(L, 1);
+
+    lua_pushcfunction(L, sharedNext, "SharedTable.next");
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+void initializeSharedTables(lua_State* L)
+{
+    luaL_newmetatable(L, "SharedTable");
+
+    lua_pushcfunction(L, sharedIndex, "SharedTable.__index");
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, sharedNewIndex, "SharedTable.__newindex");
+    lua_setfield(L, -2, "__newindex");
+
+    lua_pushcfunction(L, sharedLen, "SharedTable.__len");
+    lua_setfield(L, -2, "__len");
+
+    lua_pushcfunction(L, sharedIter, "SharedTable.__iter");
+    lua_setfield(L, -2, "__iter");
+
+    lua_pushstring(L, "SharedTable");
+    lua_setfield(L, -2, "__type");
+
+    lua_setuserdatametatable(L, kSharedTableTag);
+
+    lua_setuserdatadtor(
+        L,
+        kSharedTableTag,
+        [](lua_State* L, void* userdata)
+        {
+            static_cast<SharedTableProxy*>(userdata)->~SharedTableProxy();
+        }
+    );
+
+    // Weak cache of the proxies alive in this VM, keyed by the table they view
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, kSharedTableProxiesKey);
+}
+
+void pushSharedTable(lua_State* L, std::shared_ptr<const SharedData> data, const SharedTable* table)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, kSharedTableProxiesKey);
+
+    lua_pushlightuserdata(L, const_cast<SharedTable*>(table));
+    lua_rawget(L, -2);
+
+    if (!lua_isnil(L, -1))
+    {
+        lua_remove(L, -2);
+        return;
+    }
+
+    lua_pop(L, 1);
+
+    new (lua_newuserdatataggedwithmetatable(L, sizeof(SharedTableProxy), kSharedTableTag)) SharedTableProxy{std::move(data), table};
+
+    lua_pushlightuserdata(L, const_cast<SharedTable*>(table));
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+
+    lua_remove(L, -2);
+}
+
+SharedTableProxy* toSharedTable(lua_State* L, int idx)
+{
+    return static_cast<SharedTableProxy*>(lua_touserdatatagged(L, idx, kSharedTableTag));
+}
+
+int share(lua_State* L)
+{
+    if (toSharedTable(L, 1))
+    {
+        lua_settop(L, 1);
+        return 1;
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    auto data = std::make_shared<SharedData>();
+    SharedBuilder builder{L, *data};
+
+    const SharedTable* root = nullptr;
+    if (!builder.buildTable(1, root, 0))
+        luaL_errorL(L, "vm.share: %s", builder.error.c_str());
+
+    pushSharedTable(L, std::move(data), root);
+    return 1;
+}
+
+} // namespace vm
@@ -1,5 +1,6 @@
 #include "lute/spawn.h"
 
+#include "lute/marshal.h"
 #include "lute/ref.h"
 #include "lute/require.h"
 #include "lute/runtime.h"
@@ -7,6 +8,8 @@
 #include "Luau/Require.h"
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "lua.h"
 #include "lualib.h"
@@ -15,120 +18,60 @@ struct TargetFunction
 {
     std::shared_ptr<Runtime> runtime;
     std::shared_ptr<Ref> func;
+    // Closures keep a pointer to their debug name, so it lives alongside the function
+    std::string name;
 };
 
 constexpr int kTargetFunctionTag = 1;
 
-static bool copyLuauObject(lua_State* from, lua_State* to, int fromIdx)
+// Encodes the values on the stack of 'from', starting at 'first', so they can be decoded straight into the target VM, without a
+// shared intermediate state. Buffers are read in place when 'lender' (the runtime of 'from') is given, otherwise copied
+static std::shared_ptr<vm::MarshalledValues> packStackValues(
+    lua_State* from,
+    int first,
+    std::string& error,
+    std::shared_ptr<Runtime> lender = nullptr
+)
 {
-    switch (lua_type(from, fromIdx))
-    {
-    case LUA_TNIL:
-        lua_pushnil(to);
-        break;
-    case LUA_TBOOLEAN:
-        lua_pushboolean(to, lua_toboolean(from, fromIdx));
-        break;
-    case LUA_TNUMBER:
-        lua_pushnumber(to, lua_tonumber(from, fromIdx));
-        break;
-    case LUA_TSTRING:
-    {
-        size_t len = 0;
-        const char* str = lua_tolstring(from, fromIdx, &len);
-        lua_pushlstring(to, str, len);
-    }
-    break;
-    case LUA_TTABLE:
-        lua_createtable(to, 0, 0);
-
-        for (int i = 0; i = lua_rawiter(from, fromIdx, i), i >= 0;)
-        {
-            if (!copyLuauObject(from, to, -2))
-            {
-                lua_pop(from, 2);
-                return false;
-            }
-
-            if (!copyLuauObject(from, to, -1))
-            {
-                lua_pop(from, 2);
-                return false;
-            }
-
-            lua_rawset(to, -3);
-
-            lua_pop(from, 2);
-        }
-        break;
-    default:
-        return false;
-    }
-
-    return true;
-}
-
-static std::shared_ptr<Ref> packStackValues(lua_State* from, std::shared_ptr<Runtime> runtime)
-{
-    std::unique_lock lock(runtime->dataCopyMutex);
-    lua_State* to = runtime->dataCopy.get();
-
-    lua_createtable(to, lua_gettop(from), 0);
-
-    for (int i = 0; i < lua_gettop(from); i++)
-    {
-        if (!copyLuauObject(from, to, i + 1))
-            luaL_error(from, "Failed to copy arguments between VMs");
-
-        lua_rawseti(to, -2, i + 1);
-    }
+    auto values = std::make_shared<vm::MarshalledValues>();
 
-    auto args = std::make_shared<Ref>(to, -1);
-    lua_pop(to, 1);
+    if (!vm::marshallValues(from, first, *values, error, std::move(lender)))
+        return nullptr;
 
-    return args;
-}
-
-static int unpackStackValue(std::shared_ptr<Runtime> runtime, lua_State* to, std::shared_ptr<Ref> ref)
-{
-    std::unique_lock lock(runtime->dataCopyMutex);
-    lua_State* from = runtime->dataCopy.get();
-
-    ref->push(from);
-    int count = lua_objlen(from, -1);
-
-    for (int i = 0; i < count; i++)
-    {
-        lua_rawgeti(from, -1, i + 1);
-
-        if (!copyLuauObject(from, to, -1))
-            luaL_error(to, "Failed to copy arguments between VMs"); // TODO: might not be in a VM protected call
-
-        lua_pop(from, 1);
-    }
-
-    lua_pop(from, 1);
-    return count;
+    return values;
 }
 
 static int crossVmMarshall(lua_State* L)
 {
     TargetFunction& target = *(TargetFunction*)lua_touserdatatagged(L, lua_upvalueindex(1), kTargetFunctionTag);
 
-    // Copy arguments into the data copy VM
-    std::shared_ptr<Ref> args = packStackValues(L, target.runtime);
+    // The caller's runtime may not be shared, so it cannot lend its buffers and they are copied
+    std::string error;
+    std::shared_ptr<vm::MarshalledValues> args = packStackValues(L, 1, error);
+    if (!args)
+        luaL_error(L, "Failed to copy arguments between VMs: %s", error.c_str());
 
     auto source = getResumeToken(L);
 
     target.runtime->schedule(
         [source, target = target, args]
         {
+            std::string error;
+            if (!vm::checkMetatables(target.runtime->GL, *args, error))
+            {
+                source->fail("Failed to copy arguments between VMs: " + error);
+                return;
+            }
+
             lua_State* L = lua_newthread(target.runtime->GL);
             luaL_sandboxthread(L);
 
+            // The function runs under pcall, so its errors reach the caller instead of stopping at the child runtime. pcall is
+            // yieldable, so the function can still wait on the child's loop
+            lua_getglobal(L, "pcall");
             target.func->push(L);
 
-            int argCount = unpackStackValue(target.runtime, L, args);
+            int argCount = 1 + vm::unmarshallValues(L, *args);
 
             auto co = getRefForThread(L);
             lua_pop(target.runtime->GL, 1);
@@ -143,14 +86,23 @@ static int crossVmMarshall(lua_State* L)
                      lua_State* L = lua_tothread(target->GL, -1);
                      lua_pop(target->GL, 1);
 
-                     std::shared_ptr<Ref> rets = packStackValues(L, target);
-
-                     source->complete(
-                         [target, rets](lua_State* L)
-                         {
-                             return unpackStackValue(target, L, rets);
-                         }
-                     );
+                     if (!lua_toboolean(L, 1))
+                     {
+                         const char* message = lua_tostring(L, 2);
+                         source->fail(message ? message : "error in child VM function");
+                         return;
+                     }
+
+                     // The results keep the child runtime alive until the caller has copied the buffers out of it
+                     std::string error;
+                     std::shared_ptr<vm::MarshalledValues> rets = packStackValues(L, 2, error, target);
+                     if (!rets)
+                     {
+                         source->fail("Failed to copy results between VMs: " + error);
+                         return;
+                     }
+
+                     vm::completeWithValues(source, std::move(rets));
                  }}
             );
         }
@@ -196,15 +148,25 @@ static void* createChildVmRequireContext(lua_State* L)
     return ctx;
 }
 
-int lua_spawn(lua_State* L)
+struct ChildFunction
 {
-    const char* file = luaL_checkstring(L, 1);
-
-    auto child = std::make_shared<Runtime>();
+    std::string name;
+    std::shared_ptr<Ref> func;
+};
 
+// Sets up the child VM and requires the target module in it, collecting the functions it exports.
+// Only touches the child runtime, so it can run on the child's own thread.
+static bool loadChildModule(
+    Runtime& child,
+    const std::string& file,
+    const std::string& requirer,
+    std::vector<ChildFunction>& functions,
+    std::string& error
+)
+{
     auto result = setupState(
-        L,
-        *child,
+        nullptr,
+        child,
         [](lua_State* L)
         {
             luaopen_require(L, requireConfigInit, createChildVmRequireContext(L));
@@ -212,35 +174,67 @@ int lua_spawn(lua_State* L)
     );
 
     if (!result)
-        luaL_error(L, "Failed to setup child VM");
+    {
+        error = "Failed to setup child VM";
+        return false;
+    }
 
-    lua_Debug ar;
-    lua_getinfo(L, 1, "s", &ar);
+    lua_State* GL = child.GL;
 
     // Require the target module
     RequireCtx ctx{};
-    luarequire_pushproxyrequire(child->GL, requireConfigInit, &ctx);
-    lua_pushstring(child->GL, file);
-    lua_pushstring(child->GL, ar.source);
-    int status = lua_pcall(child->GL, 2, 1, 0);
+    luarequire_pushproxyrequire(GL, requireConfigInit, &ctx);
+    lua_pushlstring(GL, file.data(), file.size());
+    lua_pushlstring(GL, requirer.data(), requirer.size());
+    int status = lua_pcall(GL, 2, 1, 0);
 
-    if (status == LUA_ERRRUN && lua_type(child->GL, -1) == LUA_TSTRING)
+    if (status == LUA_ERRRUN && lua_type(GL, -1) == LUA_TSTRING)
     {
         size_t len = 0;
-        const char* str = lua_tolstring(child->GL, -1, &len);
+        const char* str = lua_tolstring(GL, -1, &len);
 
-        std::string error = std::string(str, len);
+        error = "Failed to spawn, target module error: " + std::string(str, len);
         error += "\nstacktrace:\n";
-        error += lua_debugtrace(child->GL);
-        luaL_error(L, "Failed to spawn, target module error: %s", error.c_str());
+        error += lua_debugtrace(GL);
+        lua_pop(GL, 1);
+        return false;
     }
 
     if (status != LUA_OK)
-        luaL_error(L, "Failed to require %s", file);
+    {
+        error = "Failed to require " + file;
+        lua_pop(GL, 1);
+        return false;
+    }
 
-    if (lua_type(child->GL, -1) != LUA_TTABLE)
-        luaL_error(L, "Module %s did not return a table", file);
+    if (lua_type(GL, -1) != LUA_TTABLE)
+    {
+        error = "Module " + file + " did not return a table";
+        lua_pop(GL, 1);
+        return false;
+    }
+
+    for (int i = 0; i = lua_rawiter(GL, -1, i), i >= 0;)
+    {
+        if (lua_type(GL, -2) == LUA_TSTRING && lua_type(GL, -1) == LUA_TFUNCTION)
+        {
+            size_t length = 0;
+            const char* name = lua_tolstring(GL, -2, &length);
+
+            functions.push_back({std::string(name, length), std::make_shared<Ref>(GL, -1)});
+        }
 
+        lua_pop(GL, 2);
+    }
+
+    lua_pop(GL, 1);
+
+    return true;
+}
+
+// For each function exported by the child VM, pushes a wrapper function in the caller VM which will marshall a call
+static void pushTargetFunctions(lua_State* L, const std::shared_ptr<Runtime>& child, const std::vector<ChildFunction>& functions)
+{
     lua_setuserdatadtor(
         L,
         kTargetFunctionTag,
@@ -263,36 +257,79 @@ int lua_spawn(lua_State* L)
         }
     );
 
-    // For each function in the child VM return table, create a wrapper function in main VM which will marshall a call
-    lua_createtable(L, 0, 0);
+    lua_createtable(L, 0, int(functions.size()));
 
-    for (int i = 0; i = lua_rawiter(child->GL, -1, i), i >= 0;)
+    for (const ChildFunction& function : functions)
     {
-        if (lua_type(child->GL, -2) != LUA_TSTRING || lua_type(child->GL, -1) != LUA_TFUNCTION)
-        {
-            lua_pop(child->GL, 2);
-            continue;
-        }
+        TargetFunction* target = new (lua_newuserdatatagged(L, sizeof(TargetFunction), kTargetFunctionTag)) TargetFunction();
+
+        target->runtime = child;
+        target->func = function.func;
+        target->name = function.name;
 
-        size_t length = 0;
-        const char* name = lua_tolstring(child->GL, -2, &length);
+        lua_pushcclosurek(L, crossVmMarshall, target->name.c_str(), 1, crossVmMarshallCont);
+        lua_setfield(L, -2, function.name.c_str());
+    }
+}
 
-        auto func = std::make_shared<Ref>(child->GL, -1);
+int lua_spawn(lua_State* L)
+{
+    std::string file = luaL_checkstring(L, 1);
 
-        TargetFunction* target = new (lua_newuserdatatagged(L, sizeof(TargetFunction), kTargetFunctionTag)) TargetFunction();
+    // The module path is resolved relative to the calling script
+    lua_Debug ar;
+    if (!lua_getinfo(L, 1, "s", &ar))
+        luaL_error(L, "vm.create must be called from a Luau function");
+    std::string requirer = ar.source;
 
-        target->runtime = child;
-        target->func = func;
+    auto child = std::make_shared<Runtime>();
+
+    // Without a coroutine to suspend, the module is required inline as before
+    if (!lua_isyieldable(L))
+    {
+        std::vector<ChildFunction> functions;
+        std::string error;
+        if (!loadChildModule(*child, file, requirer, functions, error))
+            luaL_error(L, "%s", error.c_str());
 
-        lua_pushcclosurek(L, crossVmMarshall, name, 1, crossVmMarshallCont);
-        lua_setfield(L, -2, name);
+        child->runContinuously();
 
-        lua_pop(child->GL, 2);
+        pushTargetFunctions(L, child, functions);
+        return 1;
     }
 
-    lua_pop(child->GL, 1);
+    auto source = getResumeToken(L);
+
+    child->runContinuously();
 
-    return 1;
+    // File I/O, compilation and the module's top-level code all run on the child's thread
+    Runtime* runtime = child.get();
+    runtime->schedule(
+        [source, child = std::move(child), file = std::move(file), requirer = std::move(requirer)]() mutable
+        {
+            auto functions = std::make_shared<std::vector<ChildFunction>>();
+            std::string error;
+
+            if (!loadChildModule(*child, file, requirer, *functions, error))
+            {
+                source->fail(std::move(error));
+
+                // A runtime joins its own loop thread when destroyed, so the last reference is dropped by the caller
+                source->runtime->schedule([child = std::move(child)] {});
+                return;
+            }
+
+            source->complete(
+                [child = std::move(child), functions](lua_State* L)
+                {
+                    pushTargetFunctions(L, child, *functions);
+                    return 1;
+                }
+            );
+        }
+    );
+
+    return lua_yield(L, 0);
 }
 
 } // namespace vm
@@ -2,16 +2,43 @@
 
 #include "lute/runtime.h"
 
+// Adds the vm.atomic table to the library table on top of the stack
+static void pushAtomicLib(lua_State* L)
+{
+    lua_createtable(L, 0, std::size(vm::atomicLib));
+
+    for (auto& [name, func] : vm::atomicLib)
+    {
+        if (!name || !func)
+            break;
+
+        lua_pushcfunction(L, func, name);
+        lua_setfield(L, -2, name);
+    }
+
+    lua_setreadonly(L, -1, 1);
+    lua_setfield(L, -2, "atomic");
+}
+
+static void initializeVm(lua_State* L)
+{
+    vm::initializeSharedTables(L);
+    vm::initializeChannels(L);
+    vm::initializeSharedBuffers(L);
+}
+
 int luaopen_vm(lua_State* L)
 {
     luaL_register(L, "vm", vm::lib);
+    pushAtomicLib(L);
+    initializeVm(L);
 
     return 1;
 }
 
 int luteopen_vm(lua_State* L)
 {
-    lua_createtable(L, 0, std::size(vm::lib));
+    lua_createtable(L, 0, std::size(vm::lib) + 1);
 
     for (auto& [name, func] : vm::lib)
     {
@@ -22,7 +49,11 @@ int luteopen_vm(lua_State* L)
         lua_setfield(L, -2, name);
     }
 
+    pushAtomicLib(L);
+
     lua_setreadonly(L, -1, 1);
 
+    initializeVm(L);
+
     return 1;
 }
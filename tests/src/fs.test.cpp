@@ -0,0 +1,17 @@
+#include "doctest.h"
+#include "luauscript.h"
+
+TEST_CASE_FIXTURE(LuauScriptFixture, "fs_async_errors")
+{
+    CHECK_EQ(runScript("tests/src/fs/async_errors.luau"), 0);
+}
+
+TEST_CASE_FIXTURE(LuauScriptFixture, "fs_lines_and_chunks")
+{
+    CHECK_EQ(runScript("tests/src/fs/lines.luau"), 0);
+}
+
+TEST_CASE_FIXTURE(LuauScriptFixture, "fs_walk")
+{
+    CHECK_EQ(runScript("tests/src/fs/walk.luau"), 0);
+}
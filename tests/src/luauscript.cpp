@@ -0,0 +1,47 @@
+#include "luauscript.h"
+
+#include "luteprojectroot.h"
+
+#include "lute/climain.h"
+
+#include "Luau/FileUtils.h"
+
+#include "doctest.h"
+
+#include <filesystem>
+#include <random>
+
+LuauScriptFixture::LuauScriptFixture()
+{
+    // Named at random, so test runs side by side do not share a directory
+    std::random_device random;
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / ("lute-tests-" + std::to_string(random()));
+
+    std::error_code ec;
+    std::filesystem::remove_all(directory, ec);
+    std::filesystem::create_directories(directory, ec);
+    REQUIRE_MESSAGE(!ec, "Error creating scratch directory");
+
+    scratchDirectory = directory.generic_string();
+}
+
+LuauScriptFixture::~LuauScriptFixture()
+{
+    std::error_code ec;
+    std::filesystem::remove_all(scratchDirectory, ec);
+}
+
+int LuauScriptFixture::runScript(const std::string& script, const std::vector<std::string>& args)
+{
+    std::string executable = "lute";
+    std::string path = joinPaths(getLuteProjectRootAbsolute(), script);
+
+    std::vector<std::string> storage = {executable, path, scratchDirectory};
+    storage.insert(storage.end(), args.begin(), args.end());
+
+    std::vector<char*> argv;
+    for (std::string& arg : storage)
+        argv.push_back(arg.data());
+
+    return cliMain(static_cast<int>(argv.size()), argv.data());
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Runs Luau scripts for a test case. Every test case gets an empty scratch directory of its own, which is passed to the
+// scripts as their first argument and removed again when the test case ends
+class LuauScriptFixture
+{
+public:
+    LuauScriptFixture();
+    ~LuauScriptFixture();
+
+    // Runs a script, given relative to the project root, through the lute CLI and returns its exit code.
+    // The script sees the scratch directory and then 'args' after its own path in `...`.
+    int runScript(const std::string& script, const std::vector<std::string>& args = {});
+
+    std::string scratchDirectory;
+};
@@ -0,0 +1,16 @@
+#ifndef LUTE_DISABLE_NET
+
+#include "doctest.h"
+#include "luauscript.h"
+
+TEST_CASE_FIXTURE(LuauScriptFixture, "net_handlers_use_fs")
+{
+    CHECK_EQ(runScript("tests/src/net/handler_fs.luau"), 0);
+}
+
+TEST_CASE_FIXTURE(LuauScriptFixture, "net_static_files_and_metrics")
+{
+    CHECK_EQ(runScript("tests/src/net/static_files.luau"), 0);
+}
+
+#endif
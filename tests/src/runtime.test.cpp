@@ -0,0 +1,93 @@
+#include "doctest.h"
+
+#include "lute/climain.h"
+#include "lute/ref.h"
+#include "lute/runtime.h"
+
+#include "lua.h"
+
+#include <functional>
+#include <memory>
+
+// Token of the thread parked in yieldUntilResumed, so a test decides when and how it continues
+static ResumeToken pendingToken;
+
+static int yieldUntilResumed(lua_State* L)
+{
+    pendingToken = getResumeToken(L);
+    return lua_yield(L, 0);
+}
+
+class RuntimeFixture
+{
+public:
+    RuntimeFixture()
+        : runtime(std::make_unique<Runtime>())
+    {
+        setupCliState(*runtime);
+    }
+
+    ~RuntimeFixture()
+    {
+        pendingToken.reset();
+    }
+
+    // Queues a thread that yields on its first resumption, with a continuation like the ones cross-VM calls attach
+    void startThread(std::function<void()> cont)
+    {
+        lua_State* L = lua_newthread(runtime->GL);
+        lua_pushcfunction(L, yieldUntilResumed, "yieldUntilResumed");
+
+        runtime->runningThreads.push_back({true, getRefForThread(L), 0, std::move(cont)});
+        lua_pop(runtime->GL, 1);
+    }
+
+    std::unique_ptr<Runtime> runtime;
+};
+
+TEST_CASE_FIXTURE(RuntimeFixture, "runtime_continuation_runs_once_a_yielded_thread_finishes")
+{
+    bool continued = false;
+    startThread(
+        [&continued]
+        {
+            continued = true;
+        }
+    );
+
+    runtime->runOnce();
+    REQUIRE(pendingToken);
+    CHECK_FALSE(continued);
+    CHECK_EQ(runtime->suspendedContinuations.size(), 1);
+
+    pendingToken->complete(
+        [](lua_State*)
+        {
+            return 0;
+        }
+    );
+
+    CHECK(runtime->runToCompletion());
+    CHECK(continued);
+    CHECK(runtime->suspendedContinuations.empty());
+}
+
+TEST_CASE_FIXTURE(RuntimeFixture, "runtime_continuation_is_dropped_when_a_yielded_thread_fails")
+{
+    bool continued = false;
+    startThread(
+        [&continued]
+        {
+            continued = true;
+        }
+    );
+
+    runtime->runOnce();
+    REQUIRE(pendingToken);
+
+    pendingToken->fail("stopped");
+    runtime->runToCompletion();
+
+    CHECK_FALSE(continued);
+    CHECK(runtime->suspendedContinuations.empty());
+}
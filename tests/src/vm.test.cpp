@@ -0,0 +1,22 @@
+#include "doctest.h"
+#include "luauscript.h"
+
+TEST_CASE_FIXTURE(LuauScriptFixture, "vm_calls")
+{
+    CHECK_EQ(runScript("tests/src/vm/calls.luau"), 0);
+}
+
+TEST_CASE_FIXTURE(LuauScriptFixture, "vm_channel")
+{
+    CHECK_EQ(runScript("tests/src/vm/channel.luau"), 0);
+}
+
+TEST_CASE_FIXTURE(LuauScriptFixture, "vm_marshal")
+{
+    CHECK_EQ(runScript("tests/src/vm/marshal.luau"), 0);
+}
+
+TEST_CASE_FIXTURE(LuauScriptFixture, "vm_atomics")
+{
+    CHECK_EQ(runScript("tests/src/vm/atomics.luau"), 0);
+}